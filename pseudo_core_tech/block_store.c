@@ -0,0 +1,674 @@
+// Блочное хранилище сжатых страниц PseudoCore с индексом экстентов
+#include "block_store.h"
+#include "compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC "PCBLKS01"
+#define STORE_VERSION 2           // 1 knew zero, raw and zstd pages only
+#define ENTRY_POS_BITS 38         // granule of the page's data, the word of a same-filled page
+#define ENTRY_LEN_BITS 22         // stored bytes, a 2 MB page fits raw
+#define ENTRY_CODEC_SHIFT 60
+#define INDEX_BLOCK_ENTRIES (BLOCK_STORE_HEADER / sizeof(uint64_t))
+#define PENDING_LEN_BITS 24
+#define SYNC_SLACK_GRANULES ((1u << 20) / BLOCK_STORE_GRANULE) // pending space worth a sync on its own
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t granule;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t data_start;
+    uint64_t sum;      // over the superblock with sum = 0
+} store_super_t;
+
+static uint64_t entry_make(unsigned codec, uint32_t len, uint64_t pos) {
+    return (uint64_t)codec << ENTRY_CODEC_SHIFT | (uint64_t)len << ENTRY_POS_BITS | pos;
+}
+
+static unsigned entry_codec(uint64_t e) {
+    return (unsigned)(e >> ENTRY_CODEC_SHIFT);
+}
+
+static uint32_t entry_len(uint64_t e) {
+    return (uint32_t)(e >> ENTRY_POS_BITS) & ((1u << ENTRY_LEN_BITS) - 1);
+}
+
+static uint64_t entry_pos(uint64_t e) {
+    return e & ((1ULL << ENTRY_POS_BITS) - 1);
+}
+
+// Whether the entry refers to data in the data area
+static int entry_stored(uint64_t e) {
+    return entry_codec(e) != COMPRESS_CODEC_ZERO && entry_codec(e) != COMPRESS_CODEC_SAME;
+}
+
+static compress_tag_t entry_tag(uint64_t e) {
+    compress_tag_t tag = { (uint8_t)entry_codec(e), 0, (int)entry_len(e) };
+    if (tag.codec == COMPRESS_CODEC_SAME) tag.word = (uint32_t)entry_pos(e);
+    return tag;
+}
+
+static uint64_t granules_of(uint64_t bytes) {
+    return (bytes + BLOCK_STORE_GRANULE - 1) / BLOCK_STORE_GRANULE;
+}
+
+static uint64_t super_sum(const store_super_t *sb) {
+    store_super_t tmp = *sb;
+    tmp.sum = 0;
+    const unsigned char *p = (const unsigned char *)&tmp;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(tmp); i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t off) {
+    for (size_t done = 0; done < len;) {
+        ssize_t r = pread(fd, (char *)buf + done, len - done, (off_t)(off + done));
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t off) {
+    for (size_t done = 0; done < len;) {
+        ssize_t r = pwrite(fd, (const char *)buf + done, len - done, (off_t)(off + done));
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+// Grow the bitmap to cover at least 'granules' - caller holds the mutex
+static int bitmap_reserve(block_store_t *bs, uint64_t granules) {
+    uint64_t words = (granules + 63) / 64;
+    if (words <= bs->bitmap_words) return 0;
+    uint64_t cap = bs->bitmap_words ? bs->bitmap_words : 1024;
+    while (cap < words) cap *= 2;
+    uint64_t *bitmap = realloc(bs->bitmap, cap * sizeof(uint64_t));
+    if (!bitmap) return -1;
+    memset(bitmap + bs->bitmap_words, 0, (cap - bs->bitmap_words) * sizeof(uint64_t));
+    bs->bitmap = bitmap;
+    bs->bitmap_words = cap;
+    return 0;
+}
+
+static int bit_test(const block_store_t *bs, uint64_t g) {
+    return (bs->bitmap[g / 64] >> (g % 64)) & 1;
+}
+
+static void bits_set(block_store_t *bs, uint64_t start, uint64_t n, int on) {
+    for (uint64_t g = start; g < start + n; g++) {
+        if (on) bs->bitmap[g / 64] |= 1ULL << (g % 64);
+        else bs->bitmap[g / 64] &= ~(1ULL << (g % 64));
+    }
+}
+
+// Hand out n contiguous granules, next-fit from the cursor, then from the
+// start, then at the end of the data area. Returns UINT64_MAX without memory
+// for a larger bitmap - caller holds the mutex.
+static uint64_t alloc_run(block_store_t *bs, uint64_t n) {
+    uint64_t total = bs->granules;
+    uint64_t from[2] = { bs->cursor < total ? bs->cursor : 0, 0 };
+    uint64_t to[2] = { total, from[0] };
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t run = 0;
+        for (uint64_t g = from[pass]; g < to[pass]; g++) {
+            if (g % 64 == 0 && g + 64 <= to[pass] && bs->bitmap[g / 64] == UINT64_MAX) {
+                run = 0;
+                g += 63;
+                continue;
+            }
+            if (bit_test(bs, g)) {
+                run = 0;
+            } else if (++run == n) {
+                uint64_t start = g + 1 - n;
+                bits_set(bs, start, n, 1);
+                bs->cursor = g + 1;
+                bs->used += n;
+                return start;
+            }
+        }
+    }
+    // The free granules at the end of the data area are extended
+    uint64_t start = total;
+    while (start > 0 && !bit_test(bs, start - 1)) start--;
+    if (bitmap_reserve(bs, start + n) != 0) return UINT64_MAX;
+    bits_set(bs, start, n, 1);
+    bs->granules = start + n;
+    bs->cursor = bs->granules;
+    bs->used += n;
+    return start;
+}
+
+static void release_run(block_store_t *bs, uint64_t start, uint64_t n) {
+    bits_set(bs, start, n, 0);
+    bs->used -= n;
+}
+
+// Keep the run a page used until the index that no longer refers to it is on
+// disk. Without memory to remember it the run is leaked until the next open,
+// which rebuilds the allocator from the index - caller holds the mutex.
+static void pending_push(block_store_t *bs, uint64_t e) {
+    if (bs->npending == bs->pending_cap) {
+        uint64_t cap = bs->pending_cap ? 2 * bs->pending_cap : 256;
+        uint64_t *pending = realloc(bs->pending, cap * sizeof(uint64_t));
+        if (!pending) return;
+        bs->pending = pending;
+        bs->pending_cap = cap;
+    }
+    uint64_t n = granules_of(entry_len(e));
+    bs->pending[bs->npending++] = entry_pos(e) << PENDING_LEN_BITS | n;
+    bs->pending_granules += n;
+}
+
+// Open the store in fd, formatting an empty file for 'capacity' pages. A
+// file that is not a store of this page size is refused with EINVAL. Data is
+// packed at granule offsets, so fd must not be opened with O_DIRECT.
+int block_store_open(block_store_t *bs, int fd, uint32_t page_size, uint64_t capacity) {
+    memset(bs, 0, sizeof(*bs));
+    bs->fd = fd;
+    bs->page_size = page_size;
+    bs->budget = COMPRESS_BUDGET_BALANCED;
+    if (page_size < BLOCK_STORE_GRANULE || page_size % BLOCK_STORE_GRANULE || page_size > (1u << ENTRY_LEN_BITS) - 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    store_super_t sb;
+    if (st.st_size == 0) {
+        if (capacity == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        memset(&sb, 0, sizeof(sb));
+        memcpy(sb.magic, STORE_MAGIC, 8);
+        sb.version = STORE_VERSION;
+        sb.page_size = page_size;
+        sb.granule = BLOCK_STORE_GRANULE;
+        sb.capacity = capacity;
+        // Index entries start out zero, which maps every page to zeros
+        uint64_t index_bytes = capacity * sizeof(uint64_t);
+        sb.data_start = (BLOCK_STORE_HEADER + index_bytes + BLOCK_STORE_HEADER - 1) / BLOCK_STORE_HEADER * BLOCK_STORE_HEADER;
+        sb.sum = super_sum(&sb);
+        if (pwrite_all(fd, &sb, sizeof(sb), 0) != 0 || ftruncate(fd, (off_t)sb.data_start) != 0 || fdatasync(fd) != 0) return -1;
+    } else if (pread_all(fd, &sb, sizeof(sb), 0) != 0 || memcmp(sb.magic, STORE_MAGIC, 8) != 0 ||
+               (sb.version != STORE_VERSION && sb.version != 1) || sb.sum != super_sum(&sb) || sb.granule != BLOCK_STORE_GRANULE ||
+               sb.page_size != page_size) {
+        errno = EINVAL;
+        return -1;
+    } else if (sb.version != STORE_VERSION) {
+        // Stores of version 1 read the same; the version is raised before
+        // pages in the newer codecs go in, so older builds refuse the file
+        sb.version = STORE_VERSION;
+        sb.sum = super_sum(&sb);
+        if (pwrite_all(fd, &sb, sizeof(sb), 0) != 0 || fdatasync(fd) != 0) return -1;
+    }
+    bs->capacity = sb.capacity;
+    bs->data_start = sb.data_start;
+    uint64_t nblocks = (bs->capacity + INDEX_BLOCK_ENTRIES - 1) / INDEX_BLOCK_ENTRIES;
+    bs->index = malloc(bs->capacity * sizeof(uint64_t));
+    bs->index_dirty = calloc(nblocks, 1);
+    if (!bs->index || !bs->index_dirty || pread_all(fd, bs->index, bs->capacity * sizeof(uint64_t), BLOCK_STORE_HEADER) != 0 ||
+        bitmap_reserve(bs, 1) != 0) {
+        goto fail;
+    }
+    // The allocator is rebuilt from the index; runs written after the last
+    // sync are not referenced by it and the file is cut back past them
+    for (uint64_t p = 0; p < bs->capacity; p++) {
+        uint64_t e = bs->index[p];
+        if (!entry_stored(e)) continue;
+        uint64_t end = entry_pos(e) + granules_of(entry_len(e));
+        if (bitmap_reserve(bs, end) != 0) {
+            errno = ENOMEM;
+            goto fail;
+        }
+        bits_set(bs, entry_pos(e), granules_of(entry_len(e)), 1);
+        bs->used += granules_of(entry_len(e));
+        if (end > bs->granules) bs->granules = end;
+    }
+    if ((uint64_t)st.st_size > block_store_disk_bytes(bs) && ftruncate(fd, (off_t)block_store_disk_bytes(bs)) != 0) goto fail;
+    // Reads and writes go through scratch buffers of a bounded batch,
+    // whatever the page size
+    bs->batch = BLOCK_STORE_BATCH_BYTES / page_size;
+    if (bs->batch == 0) bs->batch = 1;
+    if (bs->batch > BLOCK_STORE_BATCH_MAX) bs->batch = BLOCK_STORE_BATCH_MAX;
+    bs->scratch_free = (1u << BLOCK_STORE_SCRATCH) - 1;
+    pthread_mutex_init(&bs->mutex, NULL);
+    pthread_mutex_init(&bs->sync_mutex, NULL);
+    pthread_mutex_init(&bs->scratch_mutex, NULL);
+    pthread_cond_init(&bs->scratch_cond, NULL);
+    pthread_rwlock_init(&bs->reuse, NULL);
+    return 0;
+fail:;
+    int err = errno;
+    free(bs->index);
+    free(bs->index_dirty);
+    free(bs->bitmap);
+    errno = err;
+    return -1;
+}
+
+// Take a free scratch set, waiting while every one is in use; its buffers
+// are allocated on first use. NULL without memory for them.
+static block_store_scratch_t *scratch_take(block_store_t *bs) {
+    pthread_mutex_lock(&bs->scratch_mutex);
+    while (!bs->scratch_free) {
+        pthread_cond_wait(&bs->scratch_cond, &bs->scratch_mutex);
+    }
+    int i = __builtin_ctz(bs->scratch_free);
+    bs->scratch_free &= ~(1u << i);
+    pthread_mutex_unlock(&bs->scratch_mutex);
+    block_store_scratch_t *sc = &bs->scratch[i];
+    if (!sc->buf) {
+        sc->src = malloc(bs->batch * sizeof(*sc->src));
+        sc->tags = malloc(bs->batch * sizeof(*sc->tags));
+        sc->ents = malloc(bs->batch * sizeof(*sc->ents));
+        sc->cmp = malloc((size_t)bs->batch * compress_bound(bs->page_size));
+        sc->buf = malloc((size_t)bs->batch * (bs->page_size + BLOCK_STORE_GRANULE));
+    }
+    if (!sc->src || !sc->tags || !sc->ents || !sc->cmp || !sc->buf) {
+        free(sc->src);
+        free(sc->tags);
+        free(sc->ents);
+        free(sc->cmp);
+        free(sc->buf);
+        memset(sc, 0, sizeof(*sc));
+        pthread_mutex_lock(&bs->scratch_mutex);
+        bs->scratch_free |= 1u << i;
+        pthread_cond_signal(&bs->scratch_cond);
+        pthread_mutex_unlock(&bs->scratch_mutex);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return sc;
+}
+
+static void scratch_put(block_store_t *bs, block_store_scratch_t *sc) {
+    pthread_mutex_lock(&bs->scratch_mutex);
+    bs->scratch_free |= 1u << (sc - bs->scratch);
+    pthread_cond_signal(&bs->scratch_cond);
+    pthread_mutex_unlock(&bs->scratch_mutex);
+}
+
+// Read up to bs->batch pages from 'page' on into iov, as block_store_readv()
+static ssize_t read_batch(block_store_t *bs, block_store_scratch_t *sc, const struct iovec *iov, int n, uint64_t page) {
+    uint64_t *ents = sc->ents;
+    char *buf = sc->buf;
+    ssize_t done = 0;
+    pthread_rwlock_rdlock(&bs->reuse);
+    for (int i = 0; i < n; i++) {
+        ents[i] = __atomic_load_n(&bs->index[page + i], __ATOMIC_ACQUIRE);
+    }
+    for (int i = 0; i < n && done >= 0;) {
+        if (iov[i].iov_len != bs->page_size) {
+            errno = EINVAL;
+            done = -1;
+            break;
+        }
+        if (!entry_stored(ents[i])) {
+            compress_tag_t tag = entry_tag(ents[i]);
+            decompress_tagged(&tag, NULL, iov[i].iov_base, bs->page_size);
+            done += bs->page_size;
+            i++;
+            continue;
+        }
+        // Extend the span over the pages stored right after this one
+        uint64_t first = entry_pos(ents[i]);
+        uint64_t end = first + granules_of(entry_len(ents[i]));
+        int j = i + 1;
+        while (j < n && entry_stored(ents[j]) && entry_pos(ents[j]) == end && iov[j].iov_len == bs->page_size) {
+            end += granules_of(entry_len(ents[j]));
+            j++;
+        }
+        if (pread_all(bs->fd, buf, (end - first) * BLOCK_STORE_GRANULE, bs->data_start + first * BLOCK_STORE_GRANULE) != 0) {
+            done = -1;
+            break;
+        }
+        for (int k = i; k < j; k++) {
+            const char *data = buf + (entry_pos(ents[k]) - first) * BLOCK_STORE_GRANULE;
+            compress_tag_t tag = entry_tag(ents[k]);
+            if (decompress_tagged(&tag, data, iov[k].iov_base, bs->page_size) != (int)bs->page_size) {
+                errno = EIO;
+                done = -1;
+                break;
+            }
+            done += bs->page_size;
+        }
+        i = j;
+    }
+    pthread_rwlock_unlock(&bs->reuse);
+    return done;
+}
+
+// Read whole pages at a page-aligned offset. Pages stored back to back are
+// read with one pread() and decompressed from the buffer. A read past the
+// capacity is short, like one past the end of a file.
+ssize_t block_store_readv(block_store_t *bs, const struct iovec *iov, int n, uint64_t off) {
+    if (off % bs->page_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t page = off / bs->page_size;
+    int fit = page >= bs->capacity ? 0 : bs->capacity - page < (uint64_t)n ? (int)(bs->capacity - page) : n;
+    if (fit == 0) return 0;
+    block_store_scratch_t *sc = scratch_take(bs);
+    if (!sc) return -1;
+    ssize_t done = 0;
+    for (int i = 0; i < fit;) {
+        int k = fit - i < (int)bs->batch ? fit - i : (int)bs->batch;
+        ssize_t r = read_batch(bs, sc, iov + i, k, page + i);
+        if (r < 0) {
+            done = -1;
+            break;
+        }
+        done += r;
+        i += k;
+    }
+    scratch_put(bs, sc);
+    return done;
+}
+
+// Write up to bs->batch pages from 'page' on, as block_store_writev()
+static ssize_t write_batch(block_store_t *bs, block_store_scratch_t *sc, const struct iovec *iov, int n, uint64_t page) {
+    size_t bound = compress_bound(bs->page_size);
+    const char **src = sc->src;
+    compress_tag_t *tags = sc->tags;
+    uint64_t *ents = sc->ents;
+    char *cmp = sc->cmp;
+    char *buf = sc->buf;
+    for (int i = 0; i < n; i++) {
+        src[i] = iov[i].iov_base;
+    }
+    compress_pool_select_pages(__atomic_load_n(&bs->pool, __ATOMIC_ACQUIRE), src, (uint32_t)n, bs->page_size, cmp, bound,
+                               tags, __atomic_load_n(&bs->budget, __ATOMIC_RELAXED));
+
+    // Pack the images granule-aligned in page order, so a read of the same
+    // range finds them in one span
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned codec = tags[i].codec;
+        if (codec == COMPRESS_CODEC_ZERO || codec == COMPRESS_CODEC_SAME) {
+            ents[i] = entry_make(codec, 0, tags[i].word);
+            continue;
+        }
+        int len = tags[i].len;
+        const char *data = cmp + (size_t)i * bound;
+        // Compression that saves no granule is not worth a decompression
+        if (len <= 0 || granules_of(len) >= granules_of(bs->page_size)) {
+            len = (int)bs->page_size;
+            data = iov[i].iov_base;
+            codec = COMPRESS_CODEC_RAW;
+        }
+        memcpy(buf + total * BLOCK_STORE_GRANULE, data, len);
+        memset(buf + total * BLOCK_STORE_GRANULE + len, 0, granules_of(len) * BLOCK_STORE_GRANULE - len);
+        ents[i] = entry_make(codec, (uint32_t)len, total);
+        total += granules_of(len);
+    }
+
+    uint64_t start = 0;
+    if (total) {
+        pthread_mutex_lock(&bs->mutex);
+        start = alloc_run(bs, total);
+        pthread_mutex_unlock(&bs->mutex);
+        if (start == UINT64_MAX) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (pwrite_all(bs->fd, buf, total * BLOCK_STORE_GRANULE, bs->data_start + start * BLOCK_STORE_GRANULE) != 0) {
+            int err = errno;
+            pthread_mutex_lock(&bs->mutex);
+            release_run(bs, start, total);
+            pthread_mutex_unlock(&bs->mutex);
+            errno = err;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&bs->mutex);
+    for (int i = 0; i < n; i++) {
+        uint64_t e = ents[i];
+        if (entry_stored(e)) e = entry_make(entry_codec(e), entry_len(e), start + entry_pos(e));
+        uint64_t old = bs->index[page + i];
+        __atomic_store_n(&bs->index[page + i], e, __ATOMIC_RELEASE);
+        bs->index_dirty[(page + i) / INDEX_BLOCK_ENTRIES] = 1;
+        if (entry_stored(old)) pending_push(bs, old);
+        bs->stats.pages[entry_codec(e)]++;
+    }
+    bs->stats.page_bytes += (uint64_t)n * bs->page_size;
+    bs->stats.stored_bytes += total * BLOCK_STORE_GRANULE;
+    bs->stats.write_calls += total > 0;
+    bs->dirty = 1;
+    // Rewritten pages only give their space back at a sync, which is left
+    // to whoever checks block_store_sync_wanted(): the writer may hold locks
+    // of its own
+    if (bs->pending_granules > bs->used / 4 + SYNC_SLACK_GRANULES) __atomic_store_n(&bs->sync_wanted, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&bs->mutex);
+    return (ssize_t)n * bs->page_size;
+}
+
+// Write whole pages at a page-aligned offset. The pages are compressed and
+// packed into one run per batch of up to bs->batch pages, written with one
+// pwrite(); zero and same-filled pages take no space. Pages past the
+// capacity are not written: the write is short, or fails with EFBIG if none
+// fit.
+ssize_t block_store_writev(block_store_t *bs, const struct iovec *iov, int n, uint64_t off) {
+    if (off % bs->page_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t page = off / bs->page_size;
+    if (page >= bs->capacity) {
+        errno = EFBIG;
+        return -1;
+    }
+    int fit = bs->capacity - page < (uint64_t)n ? (int)(bs->capacity - page) : n;
+    for (int i = 0; i < fit; i++) {
+        if (iov[i].iov_len != bs->page_size) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    block_store_scratch_t *sc = scratch_take(bs);
+    if (!sc) return -1;
+    ssize_t done = 0;
+    for (int i = 0; i < fit;) {
+        int k = fit - i < (int)bs->batch ? fit - i : (int)bs->batch;
+        ssize_t r = write_batch(bs, sc, iov + i, k, page + i);
+        if (r < 0) {
+            // Batches already written stay written; the write is short
+            if (done == 0) done = -1;
+            break;
+        }
+        done += r;
+        i += k;
+    }
+    scratch_put(bs, sc);
+    return done;
+}
+
+// Whether enough rewritten space waits on a sync that one is worth running.
+// Cheap, for a flusher to poll outside its own locks.
+int block_store_sync_wanted(block_store_t *bs) {
+    return __atomic_load_n(&bs->sync_wanted, __ATOMIC_RELAXED);
+}
+
+// Set the budget new pages are compressed with and the pool that compresses
+// them; either takes effect from the next write, also while writes are
+// running. The pool must outlive the store or be replaced first.
+void block_store_set_compression(block_store_t *bs, int budget, compress_pool_t *pool) {
+    __atomic_store_n(&bs->budget, budget, __ATOMIC_RELAXED);
+    __atomic_store_n(&bs->pool, pool, __ATOMIC_RELEASE);
+}
+
+// Make every completed write durable: the data first, then the index blocks
+// that changed. Runs freed before the index was taken become reusable.
+// Returns -1 with errno set if the file could not be synced.
+int block_store_sync(block_store_t *bs) {
+    pthread_mutex_lock(&bs->sync_mutex);
+    pthread_mutex_lock(&bs->mutex);
+    if (!bs->dirty) {
+        pthread_mutex_unlock(&bs->mutex);
+        pthread_mutex_unlock(&bs->sync_mutex);
+        return 0;
+    }
+    uint64_t nblocks = (bs->capacity + INDEX_BLOCK_ENTRIES - 1) / INDEX_BLOCK_ENTRIES;
+    uint64_t ndirty = 0;
+    for (uint64_t b = 0; b < nblocks; b++) {
+        ndirty += bs->index_dirty[b];
+    }
+    // The copy buffers are kept between syncs, grown to the most blocks
+    // one has written
+    if (ndirty > bs->sync_cap) {
+        uint64_t *blocks = realloc(bs->sync_blocks, ndirty * sizeof(uint64_t));
+        if (blocks) bs->sync_blocks = blocks;
+        char *copy = blocks ? realloc(bs->sync_copy, ndirty * BLOCK_STORE_HEADER) : NULL;
+        if (!copy) {
+            pthread_mutex_unlock(&bs->mutex);
+            pthread_mutex_unlock(&bs->sync_mutex);
+            errno = ENOMEM;
+            return -1;
+        }
+        bs->sync_copy = copy;
+        bs->sync_cap = ndirty;
+    }
+    uint64_t *blocks = bs->sync_blocks;
+    char *copy = bs->sync_copy;
+    // A consistent copy of the changed blocks, and the runs it stops using
+    uint64_t k = 0;
+    for (uint64_t b = 0; b < nblocks; b++) {
+        if (!bs->index_dirty[b]) continue;
+        bs->index_dirty[b] = 0;
+        uint64_t entries = b == nblocks - 1 ? bs->capacity - b * INDEX_BLOCK_ENTRIES : INDEX_BLOCK_ENTRIES;
+        memcpy(copy + k * BLOCK_STORE_HEADER, bs->index + b * INDEX_BLOCK_ENTRIES, entries * sizeof(uint64_t));
+        blocks[k++] = b;
+    }
+    uint64_t *freed = bs->pending;
+    uint64_t nfreed = bs->npending;
+    uint64_t freed_cap = bs->pending_cap;
+    uint64_t freed_granules = bs->pending_granules;
+    bs->pending = bs->pending_spare;
+    bs->pending_cap = bs->spare_cap;
+    bs->pending_spare = NULL;
+    bs->spare_cap = 0;
+    bs->npending = bs->pending_granules = 0;
+    bs->dirty = 0;
+    __atomic_store_n(&bs->sync_wanted, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&bs->mutex);
+
+    int rc = fdatasync(bs->fd);
+    for (uint64_t i = 0; i < ndirty && rc == 0; i++) {
+        uint64_t b = blocks[i];
+        uint64_t entries = b == nblocks - 1 ? bs->capacity - b * INDEX_BLOCK_ENTRIES : INDEX_BLOCK_ENTRIES;
+        rc = pwrite_all(bs->fd, copy + i * BLOCK_STORE_HEADER, entries * sizeof(uint64_t),
+                        BLOCK_STORE_HEADER + b * BLOCK_STORE_HEADER);
+    }
+    if (rc == 0) rc = fdatasync(bs->fd);
+    int err = errno;
+
+    if (rc == 0) {
+        pthread_rwlock_wrlock(&bs->reuse);
+        pthread_mutex_lock(&bs->mutex);
+        for (uint64_t i = 0; i < nfreed; i++) {
+            release_run(bs, freed[i] >> PENDING_LEN_BITS, freed[i] & ((1u << PENDING_LEN_BITS) - 1));
+        }
+        bs->stats.syncs++;
+        // The list just drained is refilled after the next sync
+        free(bs->pending_spare);
+        bs->pending_spare = freed;
+        bs->spare_cap = freed_cap;
+        pthread_mutex_unlock(&bs->mutex);
+        pthread_rwlock_unlock(&bs->reuse);
+    } else {
+        // Nothing is released; the blocks are written again by the next sync
+        pthread_mutex_lock(&bs->mutex);
+        for (uint64_t i = 0; i < ndirty; i++) {
+            bs->index_dirty[blocks[i]] = 1;
+        }
+        bs->dirty = 1;
+        for (uint64_t i = 0; i < nfreed; i++) {
+            if (bs->npending == bs->pending_cap) {
+                uint64_t cap = bs->pending_cap ? 2 * bs->pending_cap : 256;
+                uint64_t *pending = realloc(bs->pending, cap * sizeof(uint64_t));
+                if (!pending) break;
+                bs->pending = pending;
+                bs->pending_cap = cap;
+            }
+            bs->pending[bs->npending++] = freed[i];
+        }
+        bs->pending_granules += freed_granules;
+        pthread_mutex_unlock(&bs->mutex);
+        free(freed);
+    }
+    pthread_mutex_unlock(&bs->sync_mutex);
+    errno = err;
+    return rc == 0 ? 0 : -1;
+}
+
+// Read up to n stored pages spread evenly over the store into buf, for
+// training a compression dictionary. Returns the number read.
+uint32_t block_store_sample(block_store_t *bs, char *buf, uint32_t n) {
+    uint64_t stored = 0;
+    for (uint64_t p = 0; p < bs->capacity; p++) {
+        stored += entry_stored(__atomic_load_n(&bs->index[p], __ATOMIC_ACQUIRE));
+    }
+    if (stored == 0 || n == 0) return 0;
+    uint64_t step = stored / n ? stored / n : 1;
+    uint32_t got = 0;
+    uint64_t seen = 0;
+    for (uint64_t p = 0; p < bs->capacity && got < n; p++) {
+        if (!entry_stored(__atomic_load_n(&bs->index[p], __ATOMIC_ACQUIRE))) continue;
+        if (seen++ % step) continue;
+        struct iovec iov = { buf + (size_t)got * bs->page_size, bs->page_size };
+        if (block_store_readv(bs, &iov, 1, p * bs->page_size) == (ssize_t)bs->page_size) got++;
+    }
+    return got;
+}
+
+// Bytes the store takes on disk: superblock, index and the data area
+uint64_t block_store_disk_bytes(block_store_t *bs) {
+    return bs->data_start + bs->granules * BLOCK_STORE_GRANULE;
+}
+
+// Sync and release the store; the file stays open
+int block_store_close(block_store_t *bs) {
+    int rc = block_store_sync(bs);
+    pthread_rwlock_destroy(&bs->reuse);
+    pthread_mutex_destroy(&bs->sync_mutex);
+    pthread_mutex_destroy(&bs->mutex);
+    pthread_cond_destroy(&bs->scratch_cond);
+    pthread_mutex_destroy(&bs->scratch_mutex);
+    for (int i = 0; i < BLOCK_STORE_SCRATCH; i++) {
+        free(bs->scratch[i].src);
+        free(bs->scratch[i].tags);
+        free(bs->scratch[i].ents);
+        free(bs->scratch[i].cmp);
+        free(bs->scratch[i].buf);
+    }
+    free(bs->index);
+    free(bs->index_dirty);
+    free(bs->bitmap);
+    free(bs->pending);
+    free(bs->pending_spare);
+    free(bs->sync_blocks);
+    free(bs->sync_copy);
+    memset(bs, 0, sizeof(*bs));
+    bs->fd = -1;
+    return rc;
+}
@@ -0,0 +1,90 @@
+#ifndef BLOCK_STORE_H
+#define BLOCK_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "compress.h"
+#include "compress_pool.h"
+
+#define BLOCK_STORE_GRANULE 256 // allocation unit of the packed data area
+#define BLOCK_STORE_HEADER 4096 // superblock, the index follows it
+#define BLOCK_STORE_SCRATCH 8   // reads and writes that run at once without waiting for buffers
+#define BLOCK_STORE_BATCH_BYTES (1u << 20) // page bytes a read or write handles at a time
+#define BLOCK_STORE_BATCH_MAX 64           // and pages
+
+typedef struct {
+    uint64_t pages[COMPRESS_CODECS]; // pages written, by codec
+    uint64_t page_bytes;     // bytes of pages written
+    uint64_t stored_bytes;   // bytes of those written to the data area
+    uint64_t write_calls;    // pwrite() calls for page data
+    uint64_t syncs;          // index syncs
+} block_store_stats_t;
+
+// Buffers a read or write works in, allocated on first use and kept
+typedef struct {
+    const char **src;       // pages handed to compression
+    compress_tag_t *tags;
+    uint64_t *ents;
+    char *cmp;              // compression outputs of compress_bound(page_size)
+    char *buf;              // packed run, page_size + BLOCK_STORE_GRANULE per page
+} block_store_scratch_t;
+
+// A file holding fixed-size pages compressed and packed. An index maps each
+// page to (codec, length, granule) and is kept in memory, with the codec ids
+// of compress.h; zero and same-filled pages live in their entry alone and
+// cost no I/O. The data area is handed out in granules by a bitmap
+// allocator. A page is never overwritten in place: a write packs the new
+// images of a batch into one run, then points the index at them. The run a
+// page used before is only reused after the index no longer referring to it
+// has been synced, so the file on disk always holds a consistent index as of
+// the last block_store_sync().
+typedef struct {
+    int fd;
+    uint32_t page_size;
+    uint64_t capacity;          // pages the index can map
+    uint64_t data_start;        // file offset of granule 0
+    uint64_t *index;            // entry per page
+    uint8_t *index_dirty;       // per index block of BLOCK_STORE_HEADER bytes
+    uint64_t *bitmap;           // granules in use
+    uint64_t granules;          // granules the bitmap covers, the data area's end
+    uint64_t bitmap_words;      // allocated words of bitmap
+    uint64_t cursor;            // next-fit search start
+    uint64_t used;              // granules in use, pending ones included
+    uint64_t *pending;          // runs (start << 24 | granules) freed since the last sync
+    uint64_t npending;
+    uint64_t pending_cap;
+    uint64_t pending_granules;
+    uint64_t *pending_spare;    // list drained by the last sync, kept for reuse
+    uint64_t spare_cap;
+    int dirty;                  // index changed since the last sync
+    int sync_wanted;            // pending space worth a sync, see block_store_sync_wanted()
+    int budget;                 // COMPRESS_BUDGET_* of new pages, BALANCED after open
+    compress_pool_t *pool;      // compresses write batches in parallel, NULL = in the writer
+    pthread_mutex_t mutex;      // index, allocator and pending runs
+    pthread_mutex_t sync_mutex; // one sync at a time
+    pthread_rwlock_t reuse;     // readers hold it shared, so runs are not reused under them
+    uint32_t batch;             // pages a read or write handles at a time
+    block_store_scratch_t scratch[BLOCK_STORE_SCRATCH];
+    uint32_t scratch_free;      // bit per scratch set not in use
+    pthread_mutex_t scratch_mutex;
+    pthread_cond_t scratch_cond;
+    uint64_t *sync_blocks;      // index blocks a sync writes, under sync_mutex
+    char *sync_copy;            // and their copy
+    uint64_t sync_cap;
+    block_store_stats_t stats;
+} block_store_t;
+
+int block_store_open(block_store_t *bs, int fd, uint32_t page_size, uint64_t capacity);
+ssize_t block_store_readv(block_store_t *bs, const struct iovec *iov, int n, uint64_t off);
+ssize_t block_store_writev(block_store_t *bs, const struct iovec *iov, int n, uint64_t off);
+void block_store_set_compression(block_store_t *bs, int budget, compress_pool_t *pool);
+int block_store_sync(block_store_t *bs);
+int block_store_sync_wanted(block_store_t *bs);
+uint32_t block_store_sample(block_store_t *bs, char *buf, uint32_t n);
+uint64_t block_store_disk_bytes(block_store_t *bs);
+int block_store_close(block_store_t *bs);
+
+#endif // BLOCK_STORE_H
@@ -3,7 +3,9 @@
 // это связано с конфигурацией includePath в VSCode. 
 // Пожалуйста, обновите includePath, выбрав команду "C/C++: Select IntelliSense Configuration..." 
 // или добавив необходимые пути в настройки c_cpp_properties.json.
+#define _GNU_SOURCE // O_DIRECT
 #include "cache.h"
+#include "numa_node.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -11,28 +13,59 @@
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/uio.h>
 
-// Cache statistics for monitoring performance
-static size_t cache_hits = 0;
-static size_t cache_misses = 0;
-static pthread_mutex_t stats_mutex;
+// Statistics slot of the calling thread, assigned on first use
+static __thread int stats_slot = -1;
+static __thread unsigned stats_tick;
+// Set on the warm-up thread: its prefetches are not workload hits or misses
+static __thread int stats_muted;
+static unsigned stats_next_slot;
 
-// Improved hash function using FNV-1a to reduce collisions
-static size_t hash_func(uint64_t off) {
+// FNV-1a to reduce collisions, followed by a final avalanche so that both the
+// low bits (index tag and group) and the high bits (shard) are well mixed
+static uint64_t hash_func(uint64_t key) {
     const uint64_t FNV_PRIME = 1099511628211ULL;
     const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
     uint64_t hash = FNV_OFFSET_BASIS;
-    uint8_t *bytes = (uint8_t*)&off;
-    for (size_t i = 0; i < sizeof(off); i++) {
+    uint8_t *bytes = (uint8_t*)&key;
+    for (size_t i = 0; i < sizeof(key); i++) {
         hash ^= bytes[i];
         hash *= FNV_PRIME;
     }
-    return (hash / PAGE_SIZE) % HASH_SIZE;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
 }
 
-// Calculate mutex group for a hash index
-static size_t mutex_group(size_t h) {
-    return h % MUTEX_GROUPS;
+// Pages of different backing objects never share a key
+static inline uint64_t cache_key(uint32_t obj, uint64_t off) {
+    return (uint64_t)obj << CACHE_KEY_SHIFT | off;
+}
+
+static inline uint64_t key_offset(uint64_t key) {
+    return key & (((uint64_t)1 << CACHE_KEY_SHIFT) - 1);
+}
+
+static inline uint64_t frame_key(const cache_frame_t *f) {
+    return cache_key(f->obj, f->offset);
+}
+
+// NUMA node a page is homed on: objects are striped across the nodes in
+// numa_stripe chunks, so a thread working on one stripe stays node-local
+int cache_home_node(const cache_t *c, uint64_t off) {
+    if (c->numa_nodes <= 1 || !c->numa_stripe) return 0;
+    return (int)(off / c->numa_stripe % c->numa_nodes);
+}
+
+// Shard that owns a page: one of its home node's shards, picked by hash
+static cache_shard_t *shard_for(cache_t *c, uint64_t off, uint64_t h) {
+    if (c->numa_nodes <= 1 || !c->numa_stripe) return &c->shard[(h >> 32) % c->nshards];
+    int node = cache_home_node(c, off);
+    uint32_t count = (c->nshards - node + c->numa_nodes - 1) / c->numa_nodes;
+    return &c->shard[node + (h >> 32) % count * c->numa_nodes];
 }
 
 // Log cache-related errors or information
@@ -44,192 +77,2354 @@ static void log_cache_message(const char *level, const char *message) {
     fprintf(stderr, "[%s] [%s] Cache: %s\n", timestamp, level, message);
 }
 
-// Display cache statistics for monitoring
-static void display_cache_stats(void) {
-    pthread_mutex_lock(&stats_mutex);
-    size_t total_requests = cache_hits + cache_misses;
-    double hit_ratio = total_requests > 0 ? (double)cache_hits / total_requests * 100.0 : 0.0;
-    fprintf(stderr, "[CACHE STATS] Hits: %zu, Misses: %zu, Hit Ratio: %.2f%%\n", 
-            cache_hits, cache_misses, hit_ratio);
-    pthread_mutex_unlock(&stats_mutex);
-}
-
-void cache_init(cache_t *c) {
-    for (int i = 0; i < HASH_SIZE; i++) {
-        c->hash[i] = NULL;
-    }
-    for (int i = 0; i < MUTEX_GROUPS; i++) {
-        pthread_mutex_init(&c->mutex[i], NULL);
-    }
-    c->lru_head = NULL;
-    c->lru_tail = NULL;
-    c->entry_count = 0;
-    pthread_mutex_init(&c->lru_mutex, NULL);
-    pthread_mutex_init(&stats_mutex, NULL);
-    log_cache_message("INFO", "Cache initialized");
-}
-
-char* cache_get(cache_t *c, int fd, uint64_t off, int write) {
-    size_t h = hash_func(off);
-    size_t mg = mutex_group(h);
-    pthread_mutex_lock(&c->mutex[mg]);
-    cache_entry_t *e = c->hash[h];
-    while (e) {
-        if (e->offset == off) {
-            if (write) e->dirty = 1;
-            e->last_access = time(NULL);
-            pthread_mutex_lock(&c->lru_mutex);
-            // Move to the front of LRU list (recently used)
-            if (e != c->lru_head) {
-                if (e->prev) e->prev->next = e->next;
-                if (e->next) e->next->prev = e->prev;
-                if (e == c->lru_tail) c->lru_tail = e->prev;
-                e->next = c->lru_head;
-                e->prev = NULL;
-                if (c->lru_head) c->lru_head->prev = e;
-                c->lru_head = e;
-                if (!c->lru_tail) c->lru_tail = e;
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static cache_stats_t *thread_stats(cache_t *c) {
+    if (stats_slot < 0) {
+        stats_slot = __atomic_fetch_add(&stats_next_slot, 1, __ATOMIC_RELAXED) % CACHE_STATS_SLOTS;
+    }
+    return &c->stats[stats_slot].s;
+}
+
+static unsigned hist_bucket(uint64_t ns) {
+    unsigned b = ns ? 64 - __builtin_clzll(ns) : 0;
+    return b < CACHE_HIST_BUCKETS ? b : CACHE_HIST_BUCKETS - 1;
+}
+
+// Start time for a sampled hit, 0 when this call is not timed
+static uint64_t stats_sample_start(void) {
+    return (++stats_tick & (CACHE_STATS_SAMPLE - 1)) == 0 ? now_ns() : 0;
+}
+
+// Counters live in the calling thread's slot, so the relaxed adds stay on a
+// cache line no other thread writes, unless more than CACHE_STATS_SLOTS
+// threads share the cache
+static void count_hit(cache_t *c, uint64_t t0) {
+    if (stats_muted) return;
+    cache_stats_t *st = thread_stats(c);
+    __atomic_add_fetch(&st->hits, 1, __ATOMIC_RELAXED);
+    if (t0) __atomic_add_fetch(&st->hit_ns[hist_bucket(now_ns() - t0)], 1, __ATOMIC_RELAXED);
+}
+
+static void count_miss(cache_t *c, uint64_t t0) {
+    if (stats_muted) return;
+    cache_stats_t *st = thread_stats(c);
+    __atomic_add_fetch(&st->misses, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->miss_ns[hist_bucket(now_ns() - t0)], 1, __ATOMIC_RELAXED);
+}
+
+// Back off while a shard writer is inside its seqlock section
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Seqlock write side - caller holds the shard mutex. The full barrier orders the
+// odd store before the flag reads of the update, pairing with the reader fence.
+static void shard_write_begin(cache_shard_t *s) {
+    __atomic_add_fetch(&s->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static void shard_write_end(cache_shard_t *s) {
+    __atomic_add_fetch(&s->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Wake the flusher ahead of its periodic tick
+static void flusher_kick(cache_t *c) {
+    if (c->flusher_running) pthread_cond_signal(&c->flush_cond);
+}
+
+static void dirty_account(cache_t *c, uint32_t old_flags, uint32_t new_flags) {
+    if ((old_flags ^ new_flags) & CACHE_FRAME_DIRTY) {
+        if (new_flags & CACHE_FRAME_DIRTY) {
+            size_t n = __atomic_add_fetch(&c->dirty_count, 1, __ATOMIC_RELAXED);
+            if (n == c->dirty_high) flusher_kick(c);
+        } else {
+            __atomic_sub_fetch(&c->dirty_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Flag updates go through these helpers so that dirty_count always matches
+// the number of frames with CACHE_FRAME_DIRTY set
+static void frame_set_flags(cache_t *c, cache_frame_t *f, uint32_t flags) {
+    dirty_account(c, __atomic_exchange_n(&f->flags, flags, __ATOMIC_RELAXED), flags);
+}
+
+static void frame_mark_dirty(cache_t *c, cache_frame_t *f) {
+    uint32_t old = __atomic_fetch_or(&f->flags, CACHE_FRAME_DIRTY, __ATOMIC_RELAXED);
+    dirty_account(c, old, old | CACHE_FRAME_DIRTY);
+}
+
+static void frame_clear_dirty(cache_t *c, cache_frame_t *f) {
+    uint32_t old = __atomic_fetch_and(&f->flags, ~CACHE_FRAME_DIRTY, __ATOMIC_RELAXED);
+    dirty_account(c, old, old & ~CACHE_FRAME_DIRTY);
+}
+
+// Replacement list helpers - caller holds the shard mutex
+static void lru_push_head(cache_t *c, cache_shard_t *s, int list, uint32_t idx) {
+    cache_frame_t *f = &c->frames[idx];
+    cache_list_t *l = &s->list[list];
+    f->list = list;
+    f->lru_prev = CACHE_NIL;
+    f->lru_next = l->head;
+    if (l->head != CACHE_NIL) c->frames[l->head].lru_prev = idx;
+    l->head = idx;
+    if (l->tail == CACHE_NIL) l->tail = idx;
+    l->len++;
+}
+
+static void lru_unlink(cache_t *c, cache_shard_t *s, uint32_t idx) {
+    cache_frame_t *f = &c->frames[idx];
+    cache_list_t *l = &s->list[f->list];
+    if (f->lru_prev != CACHE_NIL) c->frames[f->lru_prev].lru_next = f->lru_next;
+    else l->head = f->lru_next;
+    if (f->lru_next != CACHE_NIL) c->frames[f->lru_next].lru_prev = f->lru_prev;
+    else l->tail = f->lru_prev;
+    l->len--;
+}
+
+static void lru_move_head(cache_t *c, cache_shard_t *s, int list, uint32_t idx) {
+    if (c->frames[idx].list == list && s->list[list].head == idx) return;
+    lru_unlink(c, s, idx);
+    lru_push_head(c, s, list, idx);
+}
+
+// ARC ghost list helpers - caller holds the shard mutex
+static void ghost_unlink(cache_shard_t *s, uint32_t g) {
+    cache_ghost_t *e = &s->ghosts[g];
+    cache_list_t *l = &s->ghost[e->list];
+    if (e->prev != CACHE_NIL) s->ghosts[e->prev].next = e->next;
+    else l->head = e->next;
+    if (e->next != CACHE_NIL) s->ghosts[e->next].prev = e->prev;
+    else l->tail = e->prev;
+    l->len--;
+}
+
+static void ghost_drop(cache_shard_t *s, uint32_t g) {
+    ghost_unlink(s, g);
+    cache_index_erase(&s->ghost_index, s->ghosts[g].key, (uint32_t)hash_func(s->ghosts[g].key));
+    s->ghosts[g].next = s->ghost_free;
+    s->ghost_free = g;
+}
+
+// Remember an evicted key. The ghost lists together track at most one
+// shard's worth of keys, trimming B1 first while T1 + B1 fills the shard.
+static void ghost_push(cache_shard_t *s, int list, uint64_t key, uint64_t h) {
+    if (s->ghost[CACHE_GHOST_B1].len + s->ghost[CACHE_GHOST_B2].len >= s->limit || s->ghost_free == CACHE_NIL) {
+        int trim = s->ghost[CACHE_GHOST_B2].len == 0 ||
+                   (s->ghost[CACHE_GHOST_B1].len > 0 && s->list[CACHE_LIST_T1].len + s->ghost[CACHE_GHOST_B1].len >= s->limit)
+                   ? CACHE_GHOST_B1 : CACHE_GHOST_B2;
+        if (s->ghost[trim].tail == CACHE_NIL) return;
+        ghost_drop(s, s->ghost[trim].tail);
+    }
+    uint32_t g = s->ghost_free;
+    cache_ghost_t *e = &s->ghosts[g];
+    if (cache_index_insert(&s->ghost_index, key, (uint32_t)h, g) != 0) return;
+    s->ghost_free = e->next;
+    cache_list_t *l = &s->ghost[list];
+    e->key = key;
+    e->list = list;
+    e->prev = CACHE_NIL;
+    e->next = l->head;
+    if (l->head != CACHE_NIL) s->ghosts[l->head].prev = g;
+    l->head = g;
+    if (l->tail == CACHE_NIL) l->tail = g;
+    l->len++;
+}
+
+// Return a frame to the shard free list - caller holds the shard mutex
+static void free_push(cache_t *c, cache_shard_t *s, uint32_t idx) {
+    frame_set_flags(c, &c->frames[idx], 0);
+    c->frames[idx].lru_next = s->free_head;
+    s->free_head = idx;
+}
+
+// Backing file I/O. O_DIRECT fails misaligned requests with EINVAL, such as a
+// partial block at the end of the file on some filesystems; they are retried
+// through the object's buffered descriptor. A block store does its own.
+static ssize_t object_readv(cache_t *c, int obj, const struct iovec *iov, int n, uint64_t off) {
+    if (c->objects[obj].store) return block_store_readv(c->objects[obj].store, iov, n, off);
+    ssize_t r = preadv(c->objects[obj].fd, iov, n, off);
+    if (r < 0 && errno == EINVAL && c->objects[obj].buffered_fd >= 0) r = preadv(c->objects[obj].buffered_fd, iov, n, off);
+    return r;
+}
+
+static ssize_t object_writev(cache_t *c, int obj, const struct iovec *iov, int n, uint64_t off) {
+    if (c->objects[obj].store) return block_store_writev(c->objects[obj].store, iov, n, off);
+    ssize_t r = pwritev(c->objects[obj].fd, iov, n, off);
+    if (r < 0 && errno == EINVAL && c->objects[obj].buffered_fd >= 0) r = pwritev(c->objects[obj].buffered_fd, iov, n, off);
+    return r;
+}
+
+static ssize_t object_read(cache_t *c, int obj, void *buf, uint64_t off) {
+    struct iovec iov = { buf, c->page_size };
+    return object_readv(c, obj, &iov, 1, off);
+}
+
+static ssize_t object_write(cache_t *c, int obj, const void *buf, uint64_t off) {
+    struct iovec iov = { (void*)buf, c->page_size };
+    return object_writev(c, obj, &iov, 1, off);
+}
+
+// Write a dirty frame back to disk with detailed error handling. Returns -1
+// if the page did not reach the file.
+static int write_back(cache_t *c, uint32_t idx) {
+    cache_frame_t *f = &c->frames[idx];
+    ssize_t write_result = object_write(c, f->obj, page_pool_frame(&c->pool, idx), f->offset);
+    if (write_result < 0) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Failed to write dirty page at offset %lu (errno: %d)", f->offset, errno);
+        log_cache_message("ERROR", msg);
+    } else if (write_result != (ssize_t)c->page_size) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Partial write at offset %lu (wrote %zd bytes instead of %zu)", f->offset, write_result, c->page_size);
+        log_cache_message("WARNING", msg);
+    }
+    // Reset dirty flag after write attempt
+    frame_clear_dirty(c, f);
+    return write_result == (ssize_t)c->page_size ? 0 : -1;
+}
+
+// Write back a dirty page demoted from the compressed tier
+static int ztier_write_back(void *arg, uint64_t key, const char *page) {
+    cache_t *c = arg;
+    int obj = (int)(key >> CACHE_KEY_SHIFT);
+    uint64_t off = key_offset(key);
+    ssize_t write_result = object_write(c, obj, page, off);
+    if (write_result != (ssize_t)c->page_size) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Failed to write demoted page at offset %lu (errno: %d)", off, write_result < 0 ? errno : 0);
+        log_cache_message("ERROR", msg);
+        return -1;
+    }
+    return 0;
+}
+
+// Fill a frame from where evicted pages are kept: the shard's compressed tier,
+// then the ring cache - caller holds the shard mutex. Returns 1 if the page
+// was found; *dirty then tells whether it still has to reach the disk.
+static int victim_fill(cache_t *c, cache_shard_t *s, uint64_t key, uint64_t h, char *data, int *dirty) {
+    int rc = cache_ztier_load(&s->ztier, key, (uint32_t)h, data, dirty);
+    if (rc < 0) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Compressed copy of the page at offset %lu is corrupt%s",
+                 key_offset(key), *dirty ? ", its unwritten changes are lost" : "");
+        log_cache_message("ERROR", msg);
+        *dirty = 0;
+    }
+    if (rc > 0) return 1;
+    // The ring only holds pages that were clean when they were evicted
+    *dirty = 0;
+    return c->victim_ring && ring_lookup(key, data);
+}
+
+// Take a frame away from pinners before detaching it - caller holds the shard
+// mutex. Fails while any handle is outstanding; a pin that races with a
+// successful claim sees CACHE_PIN_EVICTING and backs off.
+static int frame_claim(cache_frame_t *f) {
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(&f->pins, &expected, CACHE_PIN_EVICTING, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// Clear the claim once the frame left the index. Pinners that backed off may
+// still be undoing their increment, so only the bit is cleared.
+static void frame_release(cache_frame_t *f) {
+    __atomic_fetch_and(&f->pins, ~CACHE_PIN_EVICTING, __ATOMIC_RELEASE);
+}
+
+// Least recently used clean frame of a list that can be evicted right now,
+// restricted to one backing object unless obj is negative. The first dirty
+// one seen is kept in *fallback if that is still unset.
+static uint32_t list_candidate(cache_t *c, const cache_list_t *l, int obj, uint32_t *fallback) {
+    for (uint32_t idx = l->tail; idx != CACHE_NIL; idx = c->frames[idx].lru_prev) {
+        cache_frame_t *f = &c->frames[idx];
+        if (obj >= 0 && f->obj != (uint32_t)obj) continue;
+        uint32_t flags = __atomic_load_n(&f->flags, __ATOMIC_RELAXED);
+        if ((flags & CACHE_FRAME_FLUSHING) || __atomic_load_n(&f->pins, __ATOMIC_RELAXED)) continue;
+        if (!(flags & CACHE_FRAME_DIRTY)) return idx;
+        if (*fallback == CACHE_NIL) *fallback = idx;
+    }
+    return CACHE_NIL;
+}
+
+// W-TinyLFU: once the window is full, its LRU page competes with the main
+// area's LRU page and the one with the lower estimated frequency goes, so a
+// scan only ever displaces other pages seen once.
+static uint32_t pick_victim_tinylfu(cache_t *c, cache_shard_t *s, uint32_t *fallback) {
+    uint32_t cand = list_candidate(c, &s->list[CACHE_LIST_WINDOW], -1, fallback);
+    uint32_t victim = list_candidate(c, &s->list[CACHE_LIST_PROBATION], -1, fallback);
+    if (victim == CACHE_NIL) victim = list_candidate(c, &s->list[CACHE_LIST_PROTECTED], -1, fallback);
+    if (cand == CACHE_NIL || s->list[CACHE_LIST_WINDOW].len < s->window_max) {
+        return victim != CACHE_NIL ? victim : cand;
+    }
+    if (victim == CACHE_NIL) return cand;
+    uint64_t cand_key = frame_key(&c->frames[cand]), victim_key = frame_key(&c->frames[victim]);
+    if (cache_sketch_estimate(&s->sketch, hash_func(cand_key)) > cache_sketch_estimate(&s->sketch, hash_func(victim_key))) {
+        lru_move_head(c, s, CACHE_LIST_PROBATION, cand);
+        return victim;
+    }
+    return cand;
+}
+
+// ARC: evict from T1 while it is above its adaptive target, else from T2
+static uint32_t pick_victim_arc(cache_t *c, cache_shard_t *s, uint32_t *fallback) {
+    int from = s->list[CACHE_LIST_T1].len > 0 && (s->list[CACHE_LIST_T1].len > s->arc_p || s->list[CACHE_LIST_T2].len == 0)
+               ? CACHE_LIST_T1 : CACHE_LIST_T2;
+    uint32_t victim = list_candidate(c, &s->list[from], -1, fallback);
+    if (victim == CACHE_NIL) victim = list_candidate(c, &s->list[from ^ 1], -1, fallback);
+    return victim;
+}
+
+// Victim among one object's pages, for quota enforcement: the lists are
+// walked from the least valuable segment up, without the policy's admission
+// or adaptation steps
+static uint32_t pick_victim_object(cache_t *c, cache_shard_t *s, int obj, uint32_t *fallback) {
+    static const int tinylfu_order[CACHE_LISTS] = { CACHE_LIST_PROBATION, CACHE_LIST_WINDOW, CACHE_LIST_PROTECTED };
+    for (int i = 0; i < CACHE_LISTS; i++) {
+        int l = c->policy == CACHE_POLICY_TINYLFU ? tinylfu_order[i] : i;
+        uint32_t victim = list_candidate(c, &s->list[l], obj, fallback);
+        if (victim != CACHE_NIL) return victim;
+    }
+    return CACHE_NIL;
+}
+
+// Pick and claim a victim frame in the shard, only among the pages of 'obj'
+// unless it is negative - caller holds the shard mutex.
+// Clean frames are preferred so that a miss does not wait on a write; a dirty
+// frame is only returned when the shard has no clean candidate at all, and
+// pinned frames or frames under write-back are never returned. While a log
+// checkpoint runs dirty frames are not returned either.
+static uint32_t pick_victim(cache_t *c, cache_shard_t *s, int obj) {
+    uint32_t fallback = CACHE_NIL;
+    if (c->policy != CACHE_POLICY_CLOCK) {
+        uint32_t idx;
+        if (obj >= 0) idx = pick_victim_object(c, s, obj, &fallback);
+        else if (c->policy == CACHE_POLICY_TINYLFU) idx = pick_victim_tinylfu(c, s, &fallback);
+        else if (c->policy == CACHE_POLICY_ARC) idx = pick_victim_arc(c, s, &fallback);
+        else idx = list_candidate(c, &s->list[CACHE_LIST_LRU], -1, &fallback);
+        if (idx != CACHE_NIL && frame_claim(&c->frames[idx])) return idx;
+    } else {
+        // Second chance: clear reference bits until an unreferenced frame comes up.
+        // Two sweeps always reach every frame with its bit cleared.
+        for (uint32_t n = 0; n < 2 * s->limit; n++) {
+            uint32_t idx = s->first + s->hand;
+            s->hand = (s->hand + 1) % s->limit;
+            cache_frame_t *f = &c->frames[idx];
+            uint32_t flags = __atomic_load_n(&f->flags, __ATOMIC_RELAXED);
+            if (!(flags & CACHE_FRAME_USED) || (flags & CACHE_FRAME_FLUSHING)) continue;
+            if (obj >= 0 && f->obj != (uint32_t)obj) continue;
+            if (__atomic_load_n(&f->pins, __ATOMIC_RELAXED)) continue;
+            if (__atomic_load_n(&f->ref, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&f->ref, 0, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (!(flags & CACHE_FRAME_DIRTY)) {
+                if (frame_claim(f)) return idx;
+                continue;
+            }
+            if (fallback == CACHE_NIL) fallback = idx;
+        }
+    }
+    if (fallback == CACHE_NIL) return CACHE_NIL;
+    // Only dirty candidates left - the flusher is behind
+    flusher_kick(c);
+    // A dirty page moving to the tier could slip past the checkpoint's passes,
+    // and the checkpoint is writing it home anyway
+    if (__atomic_load_n(&c->wal_checkpointing, __ATOMIC_ACQUIRE)) return CACHE_NIL;
+    return frame_claim(&c->frames[fallback]) ? fallback : CACHE_NIL;
+}
+
+// Remove a claimed resident frame from the index. With 'demote' the page is
+// offered to the compressed tier first; whatever the tier does not take is
+// written back if dirty and kept in the ring cache when that is enabled.
+// Caller holds the shard mutex.
+static void detach_frame(cache_t *c, cache_shard_t *s, uint32_t idx, int demote) {
+    cache_frame_t *f = &c->frames[idx];
+    uint64_t key = frame_key(f);
+    shard_write_begin(s);
+    cache_index_erase(&s->index, key, (uint32_t)hash_func(key));
+    if (c->policy != CACHE_POLICY_CLOCK) lru_unlink(c, s, idx);
+    shard_write_end(s);
+    if (c->policy == CACHE_POLICY_ARC) {
+        ghost_push(s, f->list == CACHE_LIST_T1 ? CACHE_GHOST_B1 : CACHE_GHOST_B2, key, hash_func(key));
+    }
+    // Readers that set the dirty bit before the seqlock went odd are seen here
+    int dirty = (__atomic_load_n(&f->flags, __ATOMIC_RELAXED) & CACHE_FRAME_DIRTY) != 0;
+    // With a write-ahead log a dirty page is already logged and goes to the
+    // tier unwritten, the flusher or the checkpoint writes it home from there.
+    // Only a frame dropped by a shrink during a checkpoint is written here.
+    if (dirty && __atomic_load_n(&c->wal_checkpointing, __ATOMIC_ACQUIRE)) demote = 0;
+    // The tier keeps a dirty page dirty and writes it when demoting it in turn
+    if (demote && cache_ztier_store(&s->ztier, key, (uint32_t)hash_func(key), page_pool_frame(&c->pool, idx), dirty)) {
+        dirty = 0;
+        demote = 0;
+    }
+    if (dirty) {
+        // The tier may have refused it for a dirty tail of its own
+        flusher_kick(c);
+        // A page that could not be written is not kept as if it were clean
+        if (write_back(c, idx) != 0) demote = 0;
+        __atomic_add_fetch(&c->flush_stats.sync_evictions, 1, __ATOMIC_RELAXED);
+    }
+    if (demote && c->victim_ring) cache_to_ring(key, page_pool_frame(&c->pool, idx));
+    frame_set_flags(c, f, 0);
+    s->entry_count--;
+    s->obj_pages[f->obj]--;
+    frame_release(f);
+}
+
+// Detach a frame that has to go regardless of the policy, waiting for its
+// pins to be released. The shard mutex is dropped while waiting, so the page
+// may be evicted meanwhile; returns 1 if this call detached it.
+static int detach_wait(cache_t *c, cache_shard_t *s, uint32_t idx, int demote) {
+    cache_frame_t *f = &c->frames[idx];
+    uint64_t key = frame_key(f);
+    while ((f->flags & CACHE_FRAME_USED) && frame_key(f) == key) {
+        if (frame_claim(f)) {
+            detach_frame(c, s, idx, demote);
+            return 1;
+        }
+        pthread_mutex_unlock(&s->mutex);
+        sched_yield();
+        pthread_mutex_lock(&s->mutex);
+    }
+    return 0;
+}
+
+// Detach a victim frame - caller holds the shard mutex
+static uint32_t evict_locked(cache_t *c, cache_shard_t *s, int obj) {
+    uint32_t idx = pick_victim(c, s, obj);
+    if (idx != CACHE_NIL) detach_frame(c, s, idx, 1);
+    return idx;
+}
+
+// Segment sizes for the shard's current limit - caller holds the shard mutex
+static void policy_resize(cache_t *c, cache_shard_t *s) {
+    s->window_max = s->limit * CACHE_WINDOW_PCT / 100;
+    if (s->window_max == 0) s->window_max = 1;
+    uint32_t main_size = s->limit > s->window_max ? s->limit - s->window_max : 1;
+    s->protected_max = main_size * CACHE_PROTECTED_PCT / 100;
+    if (s->arc_p > s->limit) s->arc_p = s->limit;
+    if (c->policy == CACHE_POLICY_TINYLFU) {
+        while (s->list[CACHE_LIST_PROTECTED].len > s->protected_max) {
+            lru_move_head(c, s, CACHE_LIST_PROBATION, s->list[CACHE_LIST_PROTECTED].tail);
+        }
+    }
+}
+
+// Record a hit on a resident frame - caller holds the shard mutex
+static void policy_hit(cache_t *c, cache_shard_t *s, uint32_t idx, uint64_t h) {
+    cache_frame_t *f = &c->frames[idx];
+    switch (c->policy) {
+    case CACHE_POLICY_LRU:
+        // Move to the front of LRU list (recently used)
+        lru_move_head(c, s, CACHE_LIST_LRU, idx);
+        break;
+    case CACHE_POLICY_CLOCK:
+        __atomic_store_n(&f->ref, 1, __ATOMIC_RELAXED);
+        break;
+    case CACHE_POLICY_TINYLFU:
+        cache_sketch_increment(&s->sketch, h);
+        if (f->list == CACHE_LIST_WINDOW) {
+            lru_move_head(c, s, CACHE_LIST_WINDOW, idx);
+            break;
+        }
+        // A second hit in the main area promotes the page; protected overflow
+        // goes back on probation rather than out of the cache
+        lru_move_head(c, s, CACHE_LIST_PROTECTED, idx);
+        if (s->list[CACHE_LIST_PROTECTED].len > s->protected_max) {
+            lru_move_head(c, s, CACHE_LIST_PROBATION, s->list[CACHE_LIST_PROTECTED].tail);
+        }
+        break;
+    case CACHE_POLICY_ARC:
+        lru_move_head(c, s, CACHE_LIST_T2, idx);
+        break;
+    }
+}
+
+// Account a miss and return the list the page will be inserted on - caller
+// holds the shard mutex. Only called once a frame is held and the index has
+// been checked since, so a page another thread loaded meanwhile counts as the
+// hit it turned out to be rather than as a miss.
+static int policy_miss(cache_t *c, cache_shard_t *s, uint64_t key, uint64_t h) {
+    if (c->policy == CACHE_POLICY_TINYLFU) {
+        cache_sketch_increment(&s->sketch, h);
+        return CACHE_LIST_WINDOW;
+    }
+    if (c->policy != CACHE_POLICY_ARC) return CACHE_LIST_LRU;
+    uint32_t g = cache_index_find(&s->ghost_index, key, (uint32_t)h);
+    if (g == CACHE_INDEX_NONE) return CACHE_LIST_T1;
+    // A ghost hit means the list it was evicted from was too small
+    uint32_t b1 = s->ghost[CACHE_GHOST_B1].len, b2 = s->ghost[CACHE_GHOST_B2].len;
+    if (s->ghosts[g].list == CACHE_GHOST_B1) {
+        uint32_t delta = b2 > b1 ? b2 / b1 : 1;
+        s->arc_p = s->arc_p + delta < s->limit ? s->arc_p + delta : s->limit;
+    } else {
+        uint32_t delta = b1 > b2 ? b1 / b2 : 1;
+        s->arc_p = s->arc_p > delta ? s->arc_p - delta : 0;
+    }
+    ghost_drop(s, g);
+    return CACHE_LIST_T2;
+}
+
+// Link a newly filled frame - caller holds the shard mutex
+static void policy_insert(cache_t *c, cache_shard_t *s, uint32_t idx, int list) {
+    if (c->policy == CACHE_POLICY_CLOCK) return;
+    lru_push_head(c, s, list, idx);
+    // While the shard still has free frames the window overflows straight
+    // into probation, there is nothing to evict yet
+    if (c->policy == CACHE_POLICY_TINYLFU && s->list[CACHE_LIST_WINDOW].len > s->window_max) {
+        lru_move_head(c, s, CACHE_LIST_PROBATION, s->list[CACHE_LIST_WINDOW].tail);
+    }
+}
+
+static int shard_policy_init(cache_t *c, cache_shard_t *s) {
+    for (int l = 0; l < CACHE_LISTS; l++) {
+        s->list[l] = (cache_list_t){ CACHE_NIL, CACHE_NIL, 0 };
+    }
+    s->ghost[CACHE_GHOST_B1] = s->ghost[CACHE_GHOST_B2] = (cache_list_t){ CACHE_NIL, CACHE_NIL, 0 };
+    s->sketch.table = NULL;
+    s->ghosts = NULL;
+    memset(&s->ghost_index, 0, sizeof(s->ghost_index));
+    s->ghost_free = CACHE_NIL;
+    s->arc_p = 0;
+    policy_resize(c, s);
+    if (c->policy == CACHE_POLICY_TINYLFU) {
+        return cache_sketch_init(&s->sketch, s->nframes);
+    }
+    if (c->policy == CACHE_POLICY_ARC) {
+        s->ghosts = malloc(s->nframes * sizeof(cache_ghost_t));
+        if (!s->ghosts || cache_index_init(&s->ghost_index, s->nframes) != 0) return -1;
+        for (uint32_t g = s->nframes; g-- > 0;) {
+            s->ghosts[g].next = s->ghost_free;
+            s->ghost_free = g;
+        }
+    }
+    return 0;
+}
+
+static void shard_policy_destroy(cache_shard_t *s) {
+    cache_sketch_destroy(&s->sketch);
+    cache_index_destroy(&s->ghost_index);
+    free(s->ghosts);
+    s->ghosts = NULL;
+}
+
+static int dirty_ref_cmp(const void *a, const void *b) {
+    const cache_dirty_ref_t *x = a, *y = b;
+    if (x->obj != y->obj) return x->obj < y->obj ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Take ownership of a collected dirty page for writing, provided the frame
+// still holds it. Clears the dirty bit, so a write racing with the flush
+// re-dirties the page and it goes out again in a later round.
+static int flush_claim(cache_t *c, const cache_dirty_ref_t *r) {
+    cache_shard_t *s = shard_for(c, r->offset, hash_func(cache_key(r->obj, r->offset)));
+    cache_frame_t *f = &c->frames[r->frame];
+    int claimed = 0;
+    pthread_mutex_lock(&s->mutex);
+    uint32_t flags = __atomic_load_n(&f->flags, __ATOMIC_RELAXED);
+    if ((flags & (CACHE_FRAME_USED | CACHE_FRAME_DIRTY | CACHE_FRAME_FLUSHING)) == (CACHE_FRAME_USED | CACHE_FRAME_DIRTY) &&
+        f->offset == r->offset && f->obj == r->obj) {
+        __atomic_fetch_or(&f->flags, CACHE_FRAME_FLUSHING, __ATOMIC_RELAXED);
+        frame_clear_dirty(c, f);
+        claimed = 1;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return claimed;
+}
+
+// Write one run of contiguous claimed pages with a single pwritev().
+// Returns the number of pages that did not reach the file.
+static int flush_submit(cache_t *c, const cache_dirty_ref_t *run, int n) {
+    struct iovec iov[CACHE_FLUSH_BATCH];
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = page_pool_frame(&c->pool, run[i].frame);
+        iov[i].iov_len = c->page_size;
+    }
+    uint64_t t0 = now_ns();
+    ssize_t expected = (ssize_t)n * c->page_size;
+    ssize_t write_result = object_writev(c, run[0].obj, iov, n, run[0].offset);
+    uint64_t elapsed = now_ns() - t0;
+    if (write_result != expected) {
+        char msg[256];
+        if (write_result < 0) {
+            snprintf(msg, sizeof(msg), "Failed to flush %d pages at offset %lu (errno: %d)", n, run[0].offset, errno);
+            log_cache_message("ERROR", msg);
+        } else {
+            snprintf(msg, sizeof(msg), "Partial flush at offset %lu (wrote %zd bytes instead of %zd)", run[0].offset, write_result, expected);
+            log_cache_message("WARNING", msg);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        cache_frame_t *f = &c->frames[run[i].frame];
+        // Keep pages that did not reach the disk dirty so they are retried
+        if (write_result < (ssize_t)((i + 1) * c->page_size)) frame_mark_dirty(c, f);
+        __atomic_fetch_and(&f->flags, ~CACHE_FRAME_FLUSHING, __ATOMIC_RELEASE);
+    }
+    if (write_result > 0) {
+        __atomic_add_fetch(&c->flush_stats.pages_flushed, write_result / c->page_size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->flush_stats.bytes_flushed, write_result, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&c->flush_stats.write_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->flush_stats.flush_ns, elapsed, __ATOMIC_RELAXED);
+    return write_result < 0 ? n : n - (int)(write_result / c->page_size);
+}
+
+// Write back up to 'budget' dirty pages, of one object only unless obj is
+// negative. Pages are taken in (object, offset) order starting after the
+// previous round's position, like an elevator, and contiguous pages are merged
+// into pwritev() batches. No shard lock is held during I/O. Returns the number
+// of pages written; pages that failed are added to *failed if it is set.
+static size_t flush_dirty(cache_t *c, size_t budget, int obj, size_t *failed) {
+    pthread_mutex_lock(&c->flush_mutex);
+    // Snapshot dirty frames with one pass over the compact metadata array
+    size_t n = 0;
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        pthread_mutex_lock(&s->mutex);
+        for (uint32_t idx = s->first; idx < s->first + s->limit; idx++) {
+            cache_frame_t *f = &c->frames[idx];
+            uint32_t flags = __atomic_load_n(&f->flags, __ATOMIC_RELAXED);
+            if (obj >= 0 && f->obj != (uint32_t)obj) continue;
+            if ((flags & (CACHE_FRAME_USED | CACHE_FRAME_DIRTY | CACHE_FRAME_FLUSHING)) == (CACHE_FRAME_USED | CACHE_FRAME_DIRTY)) {
+                c->flush_list[n].obj = f->obj;
+                c->flush_list[n].frame = idx;
+                c->flush_list[n].offset = f->offset;
+                n++;
+            }
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+    qsort(c->flush_list, n, sizeof(cache_dirty_ref_t), dirty_ref_cmp);
+    cache_dirty_ref_t cursor = { c->flush_cursor_obj, 0, c->flush_cursor_off };
+    size_t start = 0;
+    while (start < n && dirty_ref_cmp(&c->flush_list[start], &cursor) <= 0) start++;
+    cache_dirty_ref_t run[CACHE_FLUSH_BATCH];
+    int run_len = 0;
+    size_t written = 0, lost = 0;
+    for (size_t k = 0; k < n && written < budget; k++) {
+        const cache_dirty_ref_t *r = &c->flush_list[(start + k) % n];
+        if (!flush_claim(c, r)) continue;
+        if (run_len > 0 && (run_len == CACHE_FLUSH_BATCH || r->obj != run[0].obj ||
+                            r->offset != run[run_len - 1].offset + c->page_size)) {
+            lost += flush_submit(c, run, run_len);
+            run_len = 0;
+        }
+        run[run_len++] = *r;
+        written++;
+        c->flush_cursor_obj = r->obj;
+        c->flush_cursor_off = r->offset;
+    }
+    if (run_len > 0) lost += flush_submit(c, run, run_len);
+    pthread_mutex_unlock(&c->flush_mutex);
+    if (failed) *failed += lost;
+    return written - lost;
+}
+
+static int wal_checkpoint(cache_t *c);
+
+// Sync the block stores whose rewritten space is waiting on a sync to be
+// reused. Writers only flag it, since they may hold a shard mutex - no lock
+// held here.
+static void sync_stores(cache_t *c) {
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        if (__atomic_load_n(&c->objects[o].fd, __ATOMIC_ACQUIRE) < 0) continue;
+        block_store_t *store = c->objects[o].store;
+        if (!store || !block_store_sync_wanted(store) || block_store_sync(store) == 0) continue;
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Failed to sync the block store of object %d (errno: %d)", o, errno);
+        log_cache_message("WARNING", msg);
+    }
+}
+
+// Write the dirty pages of the compressed tiers back, oldest first, so that
+// stores keep finding a clean tail to demote. Pages are decompressed under the
+// shard mutex and written without it; a miss on a page being written waits
+// (cache_ztier_busy()), so no newer copy reaches the file first. 'pages' holds
+// CACHE_FLUSH_BATCH pages.
+static void clean_ztier(cache_t *c, char *pages) {
+    uint64_t keys[CACHE_FLUSH_BATCH];
+    uint32_t ids[CACHE_FLUSH_BATCH];
+    int ok[CACHE_FLUSH_BATCH];
+    // No unregister may drop the entries of a file being written
+    pthread_mutex_lock(&c->flush_mutex);
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        if (!s->ztier.budget) continue;
+        // One pass from the oldest entry; failed writes wait for the next round
+        uint32_t from = CACHE_ZTIER_NIL;
+        pthread_mutex_lock(&s->mutex);
+        for (;;) {
+            uint32_t n = cache_ztier_clean_take(&s->ztier, &from, CACHE_FLUSH_BATCH, keys, ids, pages);
+            pthread_mutex_unlock(&s->mutex);
+            int failed = 0;
+            for (uint32_t k = 0; k < n; k++) {
+                ok[k] = ztier_write_back(c, keys[k], pages + (size_t)k * c->page_size) == 0;
+                failed |= !ok[k];
+            }
+            pthread_mutex_lock(&s->mutex);
+            cache_ztier_clean_done(&s->ztier, ids, ok, n);
+            if (n < CACHE_FLUSH_BATCH || failed) break;
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+    pthread_mutex_unlock(&c->flush_mutex);
+}
+
+// Tell the compressed tiers whether the flusher cleans them
+static void ztier_defer(cache_t *c, int deferred) {
+    for (int i = 0; i < c->nshards; i++) {
+        pthread_mutex_lock(&c->shard[i].mutex);
+        c->shard[i].ztier.deferred = deferred;
+        pthread_mutex_unlock(&c->shard[i].mutex);
+    }
+}
+
+static void *flusher_main(void *arg) {
+    cache_t *c = arg;
+    // Written back directly, so aligned for files opened with O_DIRECT
+    char *zpages = c->shard[0].ztier.budget ? aligned_alloc(c->page_size, CACHE_FLUSH_BATCH * c->page_size) : NULL;
+    if (zpages) ztier_defer(c, 1);
+    pthread_mutex_lock(&c->flush_wait_mutex);
+    while (!c->flusher_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)(c->flush_interval_ms % 1000) * 1000000L;
+        ts.tv_sec += c->flush_interval_ms / 1000 + ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&c->flush_cond, &c->flush_wait_mutex, &ts);
+        if (c->flusher_stop) break;
+        pthread_mutex_unlock(&c->flush_wait_mutex);
+        // Keep the dirty share between the watermarks
+        size_t dirty = __atomic_load_n(&c->dirty_count, __ATOMIC_RELAXED);
+        if (dirty > c->dirty_low) flush_dirty(c, dirty - c->dirty_low, -1, NULL);
+        if (zpages) clean_ztier(c, zpages);
+        sync_stores(c);
+        // Retire log space before writers find both halves full
+        if (c->durability == CACHE_DURABILITY_WAL && cache_wal_fill(&c->wal) > c->wal.half / 2) wal_checkpoint(c);
+        pthread_mutex_lock(&c->flush_wait_mutex);
+    }
+    pthread_mutex_unlock(&c->flush_wait_mutex);
+    if (zpages) ztier_defer(c, 0);
+    free(zpages);
+    return NULL;
+}
+
+// fdatasync() the objects flagged in 'objs', and the write-ahead log when
+// there is one - no lock held. A failure sticks to the object or the log, so
+// later barriers on it fail too.
+static void commit_sync(cache_t *c, const uint8_t *objs) {
+    if (c->durability == CACHE_DURABILITY_WAL) {
+        int failed = __atomic_load_n(&c->wal.sync_error, __ATOMIC_RELAXED);
+        uint64_t t0 = now_ns();
+        int rc = cache_wal_sync(&c->wal);
+        __atomic_add_fetch(&c->flush_stats.commit_ns, now_ns() - t0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->flush_stats.commit_syncs, 1, __ATOMIC_RELAXED);
+        if (rc != 0 && !failed) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Write-ahead log failed (errno: %d), writes are no longer durable", c->wal.sync_error);
+            log_cache_message("ERROR", msg);
+        }
+    }
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        if (!objs[o]) continue;
+        int fd = __atomic_load_n(&c->objects[o].fd, __ATOMIC_ACQUIRE);
+        if (fd < 0) continue;
+        uint64_t t0 = now_ns();
+        block_store_t *store = c->objects[o].store;
+        int rc = store ? block_store_sync(store) : fdatasync(fd);
+        __atomic_add_fetch(&c->flush_stats.commit_ns, now_ns() - t0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->flush_stats.commit_syncs, 1, __ATOMIC_RELAXED);
+        if (rc != 0 && __atomic_exchange_n(&c->objects[o].sync_error, errno, __ATOMIC_RELAXED) == 0) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "fdatasync failed for object %d (errno: %d), its writes are no longer durable", o, errno);
+            log_cache_message("ERROR", msg);
+        }
+    }
+}
+
+// Group commit: writers queue a barrier ticket and the committer serves every
+// ticket handed out so far with one fdatasync() per object. Barriers that
+// arrive during a sync are batched into the next one.
+static void *committer_main(void *arg) {
+    cache_t *c = arg;
+    uint8_t objs[CACHE_MAX_OBJECTS];
+    pthread_mutex_lock(&c->commit_mutex);
+    while (!c->committer_stop || c->commit_done < c->commit_seq) {
+        if (c->commit_done == c->commit_seq) {
+            pthread_cond_wait(&c->commit_cond, &c->commit_mutex);
+            continue;
+        }
+        uint64_t target = c->commit_seq;
+        memcpy(objs, c->commit_pending, sizeof(objs));
+        memset(c->commit_pending, 0, sizeof(c->commit_pending));
+        pthread_mutex_unlock(&c->commit_mutex);
+        commit_sync(c, objs);
+        pthread_mutex_lock(&c->commit_mutex);
+        c->commit_done = target;
+        pthread_cond_broadcast(&c->commit_done_cond);
+    }
+    pthread_mutex_unlock(&c->commit_mutex);
+    return NULL;
+}
+
+// Durability barrier: returns once the writes already issued to the objects
+// flagged in 'objs' are on stable storage, or -1 if that cannot be promised
+static int commit_wait(cache_t *c, const uint8_t *objs) {
+    __atomic_add_fetch(&c->flush_stats.commit_waits, 1, __ATOMIC_RELAXED);
+    if (c->committer_running) {
+        pthread_mutex_lock(&c->commit_mutex);
+        for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+            if (objs[o]) c->commit_pending[o] = 1;
+        }
+        uint64_t ticket = ++c->commit_seq;
+        pthread_cond_signal(&c->commit_cond);
+        while (c->commit_done < ticket) {
+            pthread_cond_wait(&c->commit_done_cond, &c->commit_mutex);
+        }
+        pthread_mutex_unlock(&c->commit_mutex);
+    } else {
+        commit_sync(c, objs);
+    }
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        if (objs[o] && __atomic_load_n(&c->objects[o].sync_error, __ATOMIC_RELAXED)) return -1;
+    }
+    if (c->durability == CACHE_DURABILITY_WAL && __atomic_load_n(&c->wal.sync_error, __ATOMIC_RELAXED)) return -1;
+    return 0;
+}
+
+// Recompute the watermarks for the current capacity
+static void set_watermarks(cache_t *c) {
+    c->dirty_low = c->capacity * c->dirty_low_pct / 100;
+    c->dirty_high = c->capacity * c->dirty_high_pct / 100;
+    if (c->dirty_high <= c->dirty_low) c->dirty_high = c->dirty_low + 1;
+}
+
+// Split a frame count across shards, never leaving a shard without frames
+static uint32_t shard_share(const cache_t *c, size_t entries, int i) {
+    uint32_t share = entries / c->nshards + ((size_t)i < entries % c->nshards);
+    return share ? share : 1;
+}
+
+void cache_config_default(cache_config_t *cfg) {
+    cfg->policy = CACHE_DEFAULT_POLICY;
+    cfg->durability = CACHE_DURABILITY;
+    cfg->cache_bytes = (size_t)MAX_CACHE_ENTRIES * PAGE_SIZE;
+    cfg->page_size = PAGE_SIZE;
+    cfg->shards = MUTEX_GROUPS;
+    cfg->capacity = 0;
+    cfg->flusher = 1;
+    cfg->dirty_low_pct = CACHE_DIRTY_LOW_PCT;
+    cfg->dirty_high_pct = CACHE_DIRTY_HIGH_PCT;
+    cfg->flush_interval_ms = CACHE_FLUSH_INTERVAL_MS;
+    cfg->numa = CACHE_NUMA;
+    cfg->numa_stripe = 0;
+    cfg->ztier_bytes = (size_t)CACHE_ZTIER_MB * 1024 * 1024;
+    cfg->ztier_codec = CACHE_ZTIER_CODEC;
+    cfg->victim_ring = CACHE_VICTIM_RING;
+    cfg->wal_path = CACHE_WAL_PATH;
+    cfg->wal_bytes = (size_t)CACHE_WAL_MB * 1024 * 1024;
+    cfg->manifest_path = CACHE_MANIFEST_PATH;
+    cfg->warmup_mb_per_s = CACHE_WARMUP_MB_S;
+}
+
+// Parse a size such as 4096, 64K or 2M
+static int parse_size(const char *v, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(v, &end, 10);
+    if (end == v || errno != 0) return -1;
+    if (*end == 'K' || *end == 'k') {
+        n <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        n <<= 20;
+        end++;
+    }
+    if (*end != '\0') return -1;
+    *out = (size_t)n;
+    return 0;
+}
+
+// Override the cache geometry from a KEY=VALUE file such as config.cfg (the
+// same file core_manager.sh sources): CACHE_MB, CACHE_PAGE_SIZE and
+// CACHE_SHARDS, plus CACHE_DURABILITY (writeback, writethrough, group or wal)
+// and CACHE_WAL_MB.
+// Other keys and '#' comments are skipped; the values are
+// checked by cache_init(). Returns -1 if the file cannot be read or a value is
+// malformed.
+int cache_config_load(cache_config_t *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        char msg[512];
+        snprintf(msg, sizeof(msg), "Cannot open cache configuration %s (errno: %d)", path, errno);
+        log_cache_message("ERROR", msg);
+        return -1;
+    }
+    char line[256];
+    int rc = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *eq = strchr(line, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        char key[64], value[64];
+        if (sscanf(line, " %63s", key) != 1 || sscanf(eq + 1, " %63s", value) != 1) continue;
+        if (strcmp(key, "CACHE_DURABILITY") == 0) {
+            static const char *modes[] = { "writeback", "writethrough", "group", "wal" };
+            int m = 0;
+            while (m < 4 && strcmp(value, modes[m]) != 0) m++;
+            if (m < 4) {
+                cfg->durability = (cache_durability_t)m;
+            } else {
+                char msg[192];
+                snprintf(msg, sizeof(msg), "Unknown durability mode '%s' in %s (writeback, writethrough, group or wal)", value, path);
+                log_cache_message("ERROR", msg);
+                rc = -1;
+            }
+            continue;
+        }
+        size_t n;
+        int known = strcmp(key, "CACHE_MB") == 0 || strcmp(key, "CACHE_PAGE_SIZE") == 0 || strcmp(key, "CACHE_SHARDS") == 0 ||
+                    strcmp(key, "CACHE_WAL_MB") == 0;
+        if (!known) continue;
+        if (parse_size(value, &n) != 0) {
+            char msg[192];
+            snprintf(msg, sizeof(msg), "Malformed value '%s' for %s in %s", value, key, path);
+            log_cache_message("ERROR", msg);
+            rc = -1;
+        } else if (strcmp(key, "CACHE_MB") == 0) {
+            cfg->cache_bytes = n * 1024 * 1024;
+        } else if (strcmp(key, "CACHE_PAGE_SIZE") == 0) {
+            cfg->page_size = n;
+        } else if (strcmp(key, "CACHE_WAL_MB") == 0) {
+            cfg->wal_bytes = n * 1024 * 1024;
+        } else {
+            cfg->shards = n > UINT32_MAX ? UINT32_MAX : (unsigned)n;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+static void warmup_start(cache_t *c);
+
+int cache_init(cache_t *c, const cache_config_t *cfg) {
+    cache_config_t defaults;
+    if (!cfg) {
+        cache_config_default(&defaults);
+        cfg = &defaults;
+    }
+    if ((unsigned)cfg->policy > CACHE_POLICY_ARC) {
+        log_cache_message("ERROR", "Unknown replacement policy");
+        return -1;
+    }
+    if ((unsigned)cfg->durability > CACHE_DURABILITY_WAL) {
+        log_cache_message("ERROR", "Unknown durability mode");
+        return -1;
+    }
+    size_t page_size = cfg->page_size ? cfg->page_size : PAGE_SIZE;
+    size_t cache_bytes = cfg->cache_bytes ? cfg->cache_bytes : (size_t)MAX_CACHE_ENTRIES * PAGE_SIZE;
+    unsigned nshards = cfg->shards ? cfg->shards : MUTEX_GROUPS;
+    if (page_size < CACHE_MIN_PAGE_SIZE || page_size > CACHE_MAX_PAGE_SIZE || (page_size & (page_size - 1))) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Invalid page size %zu (a power of two from %d to %d bytes)", page_size,
+                 CACHE_MIN_PAGE_SIZE, CACHE_MAX_PAGE_SIZE);
+        log_cache_message("ERROR", msg);
+        return -1;
+    }
+    if (nshards > CACHE_MAX_SHARDS || cache_bytes / page_size < nshards || cache_bytes / page_size >= CACHE_NIL) {
+        char msg[160];
+        snprintf(msg, sizeof(msg), "Invalid cache geometry (%zu bytes in %zu byte pages over %u shards)", cache_bytes,
+                 page_size, nshards);
+        log_cache_message("ERROR", msg);
+        return -1;
+    }
+    c->page_size = page_size;
+    c->nframes = (uint32_t)(cache_bytes / page_size);
+    c->nshards = (int)nshards;
+    c->durability = cfg->durability;
+    c->wal.fd = -1;
+    // Pages a crash left in the log are written home before the files are used
+    if (c->durability == CACHE_DURABILITY_WAL) {
+        size_t wal_bytes = cfg->wal_bytes ? cfg->wal_bytes : (size_t)CACHE_WAL_MB * 1024 * 1024;
+        if (!cfg->wal_path || cache_wal_open(&c->wal, cfg->wal_path, wal_bytes, (uint32_t)page_size) != 0) {
+            char msg[512];
+            snprintf(msg, sizeof(msg), "Cannot use write-ahead log %s (errno: %d)%s", cfg->wal_path ? cfg->wal_path : "(none)",
+                     errno, c->wal.stats.replay_lost ? ", some logged pages could not be written home" : "");
+            log_cache_message("ERROR", msg);
+            return -1;
+        }
+        if (c->wal.stats.replayed) {
+            char msg[512];
+            snprintf(msg, sizeof(msg), "Replayed %lu pages from write-ahead log %s", c->wal.stats.replayed, cfg->wal_path);
+            log_cache_message("INFO", msg);
+        }
+    }
+    c->shard = aligned_alloc(64, nshards * sizeof(cache_shard_t));
+    if (!c->shard) {
+        cache_wal_close(&c->wal, 0);
+        log_cache_message("ERROR", "Failed to allocate cache shards");
+        return -1;
+    }
+    memset(c->shard, 0, nshards * sizeof(cache_shard_t));
+    c->policy = cfg->policy;
+    c->numa_nodes = cfg->numa ? numa_node_count() : 1;
+    if (c->numa_nodes > c->nshards) c->numa_nodes = c->nshards;
+    c->numa_stripe = cfg->numa_stripe;
+    size_t capacity = cfg->capacity ? cfg->capacity : c->nframes;
+    if (capacity > c->nframes) capacity = c->nframes;
+    c->capacity = capacity;
+    c->dirty_count = 0;
+    c->flusher_running = 0;
+    c->flusher_stop = 0;
+    c->dirty_low_pct = cfg->dirty_low_pct;
+    c->dirty_high_pct = cfg->dirty_high_pct;
+    c->flush_interval_ms = cfg->flush_interval_ms ? cfg->flush_interval_ms : CACHE_FLUSH_INTERVAL_MS;
+    c->flush_cursor_obj = 0;
+    c->flush_cursor_off = 0;
+    memset(&c->flush_stats, 0, sizeof(c->flush_stats));
+    c->victim_ring = cfg->victim_ring;
+    // Without ring_cache_init() or ring_cache_open() there is no ring to keep pages in
+    if (c->victim_ring && ring_slot_size() != c->page_size) {
+        if (ring_slot_size()) log_cache_message("WARNING", "Ring cache slots do not match the page size, evicted pages are not kept in it");
+        c->victim_ring = 0;
+    }
+    c->committer_running = 0;
+    c->committer_stop = 0;
+    c->commit_seq = 0;
+    c->commit_done = 0;
+    memset(c->commit_pending, 0, sizeof(c->commit_pending));
+    set_watermarks(c);
+    // All data frames come from one preallocated pool sized by the cache budget;
+    // the configured capacity may use less of it and grow later
+    // With several nodes the pool is faulted in shard by shard once each slice
+    // is bound to its node
+    int pool_flags = (CACHE_HUGEPAGES ? PAGE_POOL_HUGE : 0) | (c->numa_nodes > 1 ? PAGE_POOL_LAZY : 0);
+    if (page_pool_init(&c->pool, c->nframes, c->page_size, pool_flags) != 0) {
+        free(c->shard);
+        cache_wal_close(&c->wal, 0);
+        log_cache_message("ERROR", "Failed to allocate cache page pool");
+        return -1;
+    }
+    c->frames = calloc(c->nframes, sizeof(cache_frame_t));
+    c->flush_list = malloc(c->nframes * sizeof(cache_dirty_ref_t));
+    c->stats = aligned_alloc(64, CACHE_STATS_SLOTS * sizeof(cache_stats_slot_t));
+    if (!c->frames || !c->flush_list || !c->stats) {
+        free(c->frames);
+        free(c->flush_list);
+        free(c->stats);
+        free(c->shard);
+        page_pool_destroy(&c->pool);
+        cache_wal_close(&c->wal, 0);
+        log_cache_message("ERROR", "Failed to allocate cache frame metadata");
+        return -1;
+    }
+    memset(c->stats, 0, CACHE_STATS_SLOTS * sizeof(cache_stats_slot_t));
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        c->objects[o].fd = -1;
+        c->objects[o].buffered_fd = -1;
+        c->objects[o].store = NULL;
+        c->objects[o].sync_error = 0;
+        c->objects[o].quota = 0;
+    }
+    // Split the pool into contiguous per-shard frame ranges
+    uint32_t first = 0;
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        s->seq = 0;
+        s->first = first;
+        s->nframes = shard_share(c, c->nframes, i);
+        s->node = i % c->numa_nodes;
+        if (c->numa_nodes > 1 && page_pool_bind(&c->pool, s->first, s->nframes, s->node) != 0) {
+            log_cache_message("WARNING", "Failed to bind cache shard to its NUMA node");
+        }
+        s->limit = shard_share(c, capacity, i);
+        if (s->limit > s->nframes) s->limit = s->nframes;
+        s->index.table = NULL;
+        if (cache_ztier_init(&s->ztier, cfg->ztier_bytes / c->nshards, cfg->ztier_codec, c->page_size, ztier_write_back, c) != 0 ||
+            cache_index_init(&s->index, s->limit) != 0 || shard_policy_init(c, s) != 0) {
+            cache_ztier_destroy(&s->ztier);
+            cache_index_destroy(&s->index);
+            shard_policy_destroy(s);
+            while (i-- > 0) {
+                cache_ztier_destroy(&c->shard[i].ztier);
+                cache_index_destroy(&c->shard[i].index);
+                shard_policy_destroy(&c->shard[i]);
+                pthread_mutex_destroy(&c->shard[i].mutex);
+            }
+            free(c->frames);
+            free(c->flush_list);
+            free(c->stats);
+            free(c->shard);
+            page_pool_destroy(&c->pool);
+            cache_wal_close(&c->wal, 0);
+            log_cache_message("ERROR", "Failed to allocate cache index");
+            return -1;
+        }
+        pthread_mutex_init(&s->mutex, NULL);
+        s->free_head = CACHE_NIL;
+        for (uint32_t idx = first + s->limit; idx-- > first;) {
+            free_push(c, s, idx);
+        }
+        s->hand = 0;
+        s->entry_count = 0;
+        memset(s->obj_pages, 0, sizeof(s->obj_pages));
+        first += s->nframes;
+    }
+    pthread_mutex_init(&c->object_mutex, NULL);
+    pthread_mutex_init(&c->warmup_mutex, NULL);
+    pthread_cond_init(&c->warmup_cond, NULL);
+    c->manifest_path = cfg->manifest_path ? strdup(cfg->manifest_path) : NULL;
+    c->warmup_rate = (uint64_t)(cfg->warmup_mb_per_s ? cfg->warmup_mb_per_s : CACHE_WARMUP_MB_S) * 1024 * 1024;
+    c->warmup_running = 0;
+    c->warmup_stop = 0;
+    memset(&c->warmup, 0, sizeof(c->warmup));
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        c->warmup_map[o] = -1;
+    }
+    pthread_mutex_init(&c->flush_mutex, NULL);
+    pthread_mutex_init(&c->flush_wait_mutex, NULL);
+    pthread_cond_init(&c->flush_cond, NULL);
+    pthread_mutex_init(&c->wal_checkpoint_mutex, NULL);
+    c->wal_checkpointing = 0;
+    if (cfg->flusher) {
+        if (pthread_create(&c->flusher, NULL, flusher_main, c) == 0) {
+            c->flusher_running = 1;
+        } else {
+            log_cache_message("WARNING", "Failed to start flusher thread, dirty pages are written on eviction");
+        }
+    }
+    pthread_mutex_init(&c->commit_mutex, NULL);
+    pthread_cond_init(&c->commit_cond, NULL);
+    pthread_cond_init(&c->commit_done_cond, NULL);
+    if (c->durability == CACHE_DURABILITY_GROUP || c->durability == CACHE_DURABILITY_WAL) {
+        if (pthread_create(&c->committer, NULL, committer_main, c) == 0) {
+            c->committer_running = 1;
+        } else {
+            log_cache_message("WARNING", "Failed to start committer thread, every barrier syncs on its own");
+        }
+    }
+    char msg[224];
+    char ztier[48] = "";
+    if (c->shard[0].ztier.budget) snprintf(ztier, sizeof(ztier), ", %zu MB compressed tier", cfg->ztier_bytes >> 20);
+    static const char *policy_names[] = { "LRU", "CLOCK", "W-TinyLFU", "ARC" };
+    static const char *durability_names[] = { "write-back", "write-through", "group commit", "write-ahead log" };
+    snprintf(msg, sizeof(msg), "Cache initialized (%zu of %u %zu KB frames in %d shards on %d NUMA node(s), %s, %s%s%s%s%s)", capacity,
+             c->nframes, c->page_size >> 10, c->nshards, c->numa_nodes, policy_names[c->policy], durability_names[c->durability],
+             c->pool.huge ? ", huge pages" : "", c->flusher_running ? ", background flush" : "", ztier,
+             c->victim_ring ? ", victim ring" : "");
+    log_cache_message("INFO", msg);
+    if (c->manifest_path) warmup_start(c);
+    return 0;
+}
+
+// Pages prefetched per cache_get_range() call during warm-up
+#define WARMUP_BATCH 32
+
+// Hotness of a resident page for the manifest - caller holds the shard mutex
+static uint32_t frame_heat(cache_t *c, cache_shard_t *s, uint32_t idx) {
+    cache_frame_t *f = &c->frames[idx];
+    switch (c->policy) {
+    case CACHE_POLICY_TINYLFU:
+        return cache_sketch_estimate(&s->sketch, hash_func(frame_key(f))) + (f->list == CACHE_LIST_PROTECTED);
+    case CACHE_POLICY_ARC:
+        return f->list == CACHE_LIST_T2 ? 2 : 1;
+    case CACHE_POLICY_CLOCK:
+        return 1 + __atomic_load_n(&f->ref, __ATOMIC_RELAXED);
+    default:
+        return 1;
+    }
+}
+
+// Write the resident set of the registered objects to the manifest
+static void manifest_save(cache_t *c) {
+    cache_manifest_t m;
+    m.objects = calloc(CACHE_MAX_OBJECTS, sizeof(cache_manifest_object_t));
+    m.entries = malloc(c->nframes * sizeof(cache_manifest_entry_t));
+    m.nobjects = 0;
+    m.nentries = 0;
+    if (!m.objects || !m.entries) {
+        cache_manifest_free(&m);
+        log_cache_message("WARNING", "No memory for the hot-set manifest");
+        return;
+    }
+    int known[CACHE_MAX_OBJECTS] = {0};
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        struct stat st;
+        if (c->objects[o].fd < 0 || fstat(c->objects[o].fd, &st) != 0) continue;
+        m.objects[m.nobjects++] = (cache_manifest_object_t){ st.st_dev, st.st_ino, o, 0 };
+        known[o] = 1;
+    }
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        pthread_mutex_lock(&s->mutex);
+        for (uint32_t idx = s->first; idx < s->first + s->limit; idx++) {
+            cache_frame_t *f = &c->frames[idx];
+            if ((f->flags & (CACHE_FRAME_USED | CACHE_FRAME_LOADING)) != CACHE_FRAME_USED || !known[f->obj]) continue;
+            m.entries[m.nentries++] = (cache_manifest_entry_t){ f->offset, f->obj, frame_heat(c, s, idx) };
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+    // A warm-up cut short by shutdown hands its unread pages on, so a quick
+    // restart does not shrink the hot set
+    for (uint32_t i = 0; i < c->warmup.nentries && m.nentries < c->nframes; i++) {
+        cache_manifest_entry_t e = c->warmup.entries[i];
+        int obj = c->warmup_map[e.obj];
+        if (obj < 0 || !known[obj]) continue;
+        e.obj = obj;
+        m.entries[m.nentries++] = e;
+    }
+    char msg[256];
+    if (cache_manifest_write(c->manifest_path, &m, c->page_size) != 0) {
+        snprintf(msg, sizeof(msg), "Failed to write hot-set manifest %s (errno: %d)", c->manifest_path, errno);
+        log_cache_message("WARNING", msg);
+    } else {
+        snprintf(msg, sizeof(msg), "Saved %u hot pages to %s", m.nentries, c->manifest_path);
+        log_cache_message("INFO", msg);
+    }
+    cache_manifest_free(&m);
+}
+
+static int heat_cmp(const void *a, const void *b) {
+    const cache_manifest_entry_t *x = a, *y = b;
+    return x->heat < y->heat ? 1 : x->heat > y->heat ? -1 : 0;
+}
+
+static int manifest_order_cmp(const void *a, const void *b) {
+    const cache_manifest_entry_t *x = a, *y = b;
+    if (x->obj != y->obj) return x->obj < y->obj ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int warmup_all_mapped(const cache_t *c) {
+    for (uint32_t i = 0; i < c->warmup.nobjects; i++) {
+        if (c->warmup_map[c->warmup.objects[i].obj] < 0) return 0;
+    }
+    return 1;
+}
+
+// Wait on the warm-up condition until 'until' (monotonic ns) or a wake-up -
+// caller holds warmup_mutex
+static void warmup_sleep(cache_t *c, uint64_t until) {
+    uint64_t now = now_ns();
+    if (now >= until) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t ns = (uint64_t)ts.tv_nsec + (until - now);
+    ts.tv_sec += ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    pthread_cond_timedwait(&c->warmup_cond, &c->warmup_mutex, &ts);
+}
+
+// Prefetch the previous run's hot set in file order, under the bandwidth
+// cap. Pages of a file are read once the file has been registered; files
+// that do not show up within CACHE_WARMUP_WAIT_MS are skipped.
+static void *warmup_main(void *arg) {
+    cache_t *c = arg;
+    stats_muted = 1;
+    uint64_t t0 = now_ns();
+    pthread_mutex_lock(&c->warmup_mutex);
+    uint64_t deadline = t0 + (uint64_t)CACHE_WARMUP_WAIT_MS * 1000000ULL;
+    while (!c->warmup_stop && !warmup_all_mapped(c) && now_ns() < deadline) {
+        warmup_sleep(c, deadline);
+    }
+    uint64_t start = now_ns(), bytes = 0;
+    size_t prefetched = 0;
+    uint32_t total = c->warmup.nentries;
+    cache_page_t batch[WARMUP_BATCH];
+    for (uint32_t i = 0; i < c->warmup.nentries && !c->warmup_stop;) {
+        const cache_manifest_entry_t *e = &c->warmup.entries[i];
+        uint32_t n = 1;
+        while (i + n < c->warmup.nentries && n < WARMUP_BATCH && c->warmup.entries[i + n].obj == e->obj &&
+               c->warmup.entries[i + n].offset == e->offset + (uint64_t)n * c->page_size) {
+            n++;
+        }
+        // Re-read on every batch: the object may have been unregistered while
+        // the mutex was released
+        int obj = c->warmup_map[e->obj];
+        if (obj >= 0) {
+            if (cache_get_range(c, obj, e->offset, n, 0, batch) == 0) {
+                cache_unpin_range(c, batch, n);
+                prefetched += n;
+            }
+            bytes += (uint64_t)n * c->page_size;
+            warmup_sleep(c, start + bytes * 1000000000ULL / c->warmup_rate);
+        }
+        i += n;
+        if (c->warmup_stop) {
+            // Keep what is left for the manifest written by cache_destroy()
+            memmove(c->warmup.entries, c->warmup.entries + i, (size_t)(c->warmup.nentries - i) * sizeof(cache_manifest_entry_t));
+            c->warmup.nentries -= i;
+        }
+    }
+    if (!c->warmup_stop) cache_manifest_free(&c->warmup);
+    pthread_mutex_unlock(&c->warmup_mutex);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Warm-up prefetched %zu of %u hot pages in %lu ms", prefetched, total, (now_ns() - t0) / 1000000);
+    log_cache_message("INFO", msg);
+    return NULL;
+}
+
+// Load the previous run's manifest and start prefetching it in the background
+static void warmup_start(cache_t *c) {
+    if (cache_manifest_read(c->manifest_path, &c->warmup, c->page_size) != 0) {
+        log_cache_message("INFO", "No usable hot-set manifest, starting cold");
+        return;
+    }
+    cache_manifest_t *m = &c->warmup;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < m->nentries; i++) {
+        if (m->entries[i].obj < CACHE_MAX_OBJECTS && !(m->entries[i].offset >> CACHE_KEY_SHIFT)) m->entries[n++] = m->entries[i];
+    }
+    m->nentries = n;
+    for (uint32_t i = 0; i < m->nobjects; i++) {
+        if (m->objects[i].obj >= CACHE_MAX_OBJECTS) m->objects[i--] = m->objects[--m->nobjects];
+    }
+    // Only the hottest pages that fit are worth reading, then in file order
+    if (m->nentries > c->capacity) {
+        qsort(m->entries, m->nentries, sizeof(cache_manifest_entry_t), heat_cmp);
+        m->nentries = c->capacity;
+    }
+    qsort(m->entries, m->nentries, sizeof(cache_manifest_entry_t), manifest_order_cmp);
+    if (m->nentries == 0) {
+        cache_manifest_free(m);
+        return;
+    }
+    if (pthread_create(&c->warmup_thread, NULL, warmup_main, c) != 0) {
+        log_cache_message("WARNING", "Failed to start warm-up thread");
+        cache_manifest_free(m);
+        return;
+    }
+    c->warmup_running = 1;
+}
+
+// Map a newly registered file to the manifest's view of it
+static void warmup_match(cache_t *c, int obj, int fd) {
+    struct stat st;
+    if (!c->warmup_running || fstat(fd, &st) != 0) return;
+    pthread_mutex_lock(&c->warmup_mutex);
+    for (uint32_t i = 0; i < c->warmup.nobjects; i++) {
+        const cache_manifest_object_t *mo = &c->warmup.objects[i];
+        if (mo->dev == (uint64_t)st.st_dev && mo->ino == (uint64_t)st.st_ino) c->warmup_map[mo->obj] = obj;
+    }
+    pthread_cond_broadcast(&c->warmup_cond);
+    pthread_mutex_unlock(&c->warmup_mutex);
+}
+
+// Stop prefetching into an object that is going away; waits for a batch in flight
+static void warmup_forget(cache_t *c, int obj) {
+    if (!c->warmup_running) return;
+    pthread_mutex_lock(&c->warmup_mutex);
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        if (c->warmup_map[o] == obj) c->warmup_map[o] = -1;
+    }
+    pthread_mutex_unlock(&c->warmup_mutex);
+}
+
+static int object_valid(const cache_t *c, int obj) {
+    return obj >= 0 && obj < CACHE_MAX_OBJECTS && c->objects[obj].fd >= 0;
+}
+
+static int object_register(cache_t *c, int fd, block_store_t *store, size_t quota) {
+    // An O_DIRECT file gets a buffered descriptor of its own for the
+    // requests direct I/O refuses
+    int buffered_fd = -1;
+    int fl = fcntl(fd, F_GETFL);
+    if (fl >= 0 && (fl & O_DIRECT)) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        buffered_fd = open(path, fl & O_ACCMODE);
+        if (buffered_fd < 0) log_cache_message("WARNING", "No buffered fallback for an O_DIRECT file, misaligned requests will fail");
+    }
+    int obj = -1;
+    pthread_mutex_lock(&c->object_mutex);
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        if (c->objects[o].fd == fd) {
+            pthread_mutex_unlock(&c->object_mutex);
+            if (buffered_fd >= 0) close(buffered_fd);
+            log_cache_message("ERROR", "Backing file is already registered");
+            return -1;
+        }
+        if (obj < 0 && c->objects[o].fd < 0) obj = o;
+    }
+    // Logged pages name their file by the path it has now
+    if (obj >= 0 && c->durability == CACHE_DURABILITY_WAL && cache_wal_file(&c->wal, obj, fd) != 0) {
+        pthread_mutex_unlock(&c->object_mutex);
+        if (buffered_fd >= 0) close(buffered_fd);
+        log_cache_message("ERROR", "Cannot name the backing file in the write-ahead log");
+        return -1;
+    }
+    if (obj >= 0) {
+        c->objects[obj].quota = quota;
+        c->objects[obj].buffered_fd = buffered_fd;
+        c->objects[obj].store = store;
+        // Blocks an earlier user of the id left in the ring must not be found
+        if (c->victim_ring) ring_object_open(obj, fd, cache_key(obj, 0), cache_key(obj + 1, 0));
+        __atomic_store_n(&c->objects[obj].fd, fd, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&c->object_mutex);
+    if (obj < 0) {
+        if (buffered_fd >= 0) close(buffered_fd);
+        log_cache_message("ERROR", "No free backing object slot");
+        return -1;
+    }
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Registered fd %d as object %d (quota: %zu pages%s)", fd, obj, quota,
+             store ? ", block store" : fl >= 0 && (fl & O_DIRECT) ? ", direct I/O" : "");
+    log_cache_message("INFO", msg);
+    warmup_match(c, obj, fd);
+    return obj;
+}
+
+// Register a backing file and return its object id, or -1. The file must
+// stay open until the object is unregistered or the cache destroyed.
+int cache_register(cache_t *c, int fd, size_t quota) {
+    return object_register(c, fd, NULL, quota);
+}
+
+// Register a block store as a backing object: pages are read and written
+// through it, compressed. The store must stay open until the object is
+// unregistered or the cache destroyed.
+int cache_register_store(cache_t *c, block_store_t *bs, size_t quota) {
+    // Replay writes logged pages home in place, which a store cannot take
+    if (c->durability == CACHE_DURABILITY_WAL) {
+        log_cache_message("ERROR", "A block store cannot be backed by the write-ahead log");
+        return -1;
+    }
+    if (bs->page_size != c->page_size) {
+        log_cache_message("ERROR", "Block store page size differs from the cache page size");
+        return -1;
+    }
+    return object_register(c, bs->fd, bs, quota);
+}
+
+// Limit the pages one object may keep resident, 0 for no limit. The quota is
+// split across shards like the capacity and enforced on the object's misses.
+int cache_set_quota(cache_t *c, int obj, size_t quota) {
+    if (!object_valid(c, obj)) return -1;
+    c->objects[obj].quota = quota;
+    return 0;
+}
+
+// Write back every dirty page of one object, or of all objects when obj is
+// negative. Returns -1 if some page could not be written.
+int cache_flush(cache_t *c, int obj) {
+    if (obj >= 0 && !object_valid(c, obj)) return -1;
+    size_t failed = 0;
+    flush_dirty(c, SIZE_MAX, obj, &failed);
+    // Dirty pages held compressed are written from the tier
+    uint64_t lo = obj >= 0 ? cache_key(obj, 0) : 0, hi = obj >= 0 ? cache_key(obj + 1, 0) : UINT64_MAX;
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        pthread_mutex_lock(&s->mutex);
+        if (cache_ztier_flush(&s->ztier, lo, hi) != 0) failed++;
+        pthread_mutex_unlock(&s->mutex);
+    }
+    return failed ? -1 : 0;
+}
+
+// Make the writes to one object, or to all objects when obj is negative,
+// durable: dirty pages are written back and the files fdatasync()ed, through
+// the committer in group commit mode. Returns -1 if some page could not be
+// written or synced.
+int cache_sync(cache_t *c, int obj) {
+    int rc = cache_flush(c, obj);
+    if (obj >= 0 && !object_valid(c, obj)) return -1;
+    uint8_t objs[CACHE_MAX_OBJECTS];
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        objs[o] = obj < 0 ? object_valid(c, o) : o == obj;
+    }
+    if (commit_wait(c, objs) != 0) rc = -1;
+    return rc;
+}
+
+// Retire the closed half of the write-ahead log, closing the active one first
+// if there is none. Every page logged in it was marked dirty before it was
+// logged, so writing all dirty pages home and syncing the files covers it.
+// Evicted dirty pages wait in the compressed tier: the tier is written first
+// and no dirty page enters it until the frames have been written as well.
+// Returns -1 if that failed; the half then stays closed.
+static int wal_checkpoint(cache_t *c) {
+    pthread_mutex_lock(&c->wal_checkpoint_mutex);
+    int rc = 0;
+    if (cache_wal_close_half(&c->wal)) {
+        __atomic_store_n(&c->wal_checkpointing, 1, __ATOMIC_RELEASE);
+        for (int i = 0; i < c->nshards; i++) {
+            cache_shard_t *s = &c->shard[i];
+            pthread_mutex_lock(&s->mutex);
+            if (cache_ztier_flush(&s->ztier, 0, UINT64_MAX) != 0) rc = -1;
+            pthread_mutex_unlock(&s->mutex);
+        }
+        if (cache_flush(c, -1) != 0) rc = -1;
+        __atomic_store_n(&c->wal_checkpointing, 0, __ATOMIC_RELEASE);
+        uint8_t objs[CACHE_MAX_OBJECTS];
+        for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+            objs[o] = object_valid(c, o);
+        }
+        commit_sync(c, objs);
+        for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+            if (objs[o] && __atomic_load_n(&c->objects[o].sync_error, __ATOMIC_RELAXED)) rc = -1;
+        }
+        if (rc == 0) cache_wal_retire(&c->wal);
+    }
+    pthread_mutex_unlock(&c->wal_checkpoint_mutex);
+    return rc;
+}
+
+// Flush and drop all pages of an object and free its id. The caller must have
+// stopped using the id and released its pins.
+int cache_unregister(cache_t *c, int obj) {
+    if (!object_valid(c, obj)) return -1;
+    warmup_forget(c, obj);
+    int rc = cache_flush(c, obj);
+    // No flush round may hold frames that are about to be dropped
+    pthread_mutex_lock(&c->flush_mutex);
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        pthread_mutex_lock(&s->mutex);
+        for (uint32_t idx = s->first; idx < s->first + s->nframes && s->obj_pages[obj]; idx++) {
+            cache_frame_t *f = &c->frames[idx];
+            if (!(f->flags & CACHE_FRAME_USED) || f->obj != (uint32_t)obj) continue;
+            if (detach_wait(c, s, idx, 0) && idx < s->first + s->limit) free_push(c, s, idx);
+        }
+        cache_ztier_purge(&s->ztier, cache_key(obj, 0), cache_key(obj + 1, 0));
+        pthread_mutex_unlock(&s->mutex);
+    }
+    if (c->victim_ring) ring_invalidate(cache_key(obj, 0), cache_key(obj + 1, 0));
+    pthread_mutex_unlock(&c->flush_mutex);
+    // Checkpoints only sync registered files, so the logged pages of this one
+    // are made durable at home before it goes
+    if (c->durability == CACHE_DURABILITY_WAL) {
+        uint8_t objs[CACHE_MAX_OBJECTS] = {0};
+        objs[obj] = 1;
+        commit_sync(c, objs);
+        if (__atomic_load_n(&c->objects[obj].sync_error, __ATOMIC_RELAXED)) rc = -1;
+        cache_wal_file(&c->wal, obj, -1);
+    }
+    pthread_mutex_lock(&c->object_mutex);
+    if (c->objects[obj].buffered_fd >= 0) close(c->objects[obj].buffered_fd);
+    c->objects[obj].buffered_fd = -1;
+    c->objects[obj].store = NULL;
+    c->objects[obj].fd = -1;
+    c->objects[obj].sync_error = 0;
+    c->objects[obj].quota = 0;
+    pthread_mutex_unlock(&c->object_mutex);
+    return rc;
+}
+
+// Lock-free hit path for CLOCK: a seqlock-validated index lookup plus a
+// reference bit store. With 'pin' the frame is pinned before the seqlock is
+// validated, so a frame that was evicted and reused in between is released
+// again. Returns CACHE_NIL on a miss.
+static uint32_t lookup_clock(cache_t *c, cache_shard_t *s, uint64_t h, uint64_t key, int write, int pin) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            cpu_relax();
+            continue;
+        }
+        uint32_t idx = cache_index_find(&s->index, key, (uint32_t)h);
+        // A torn probe can yield any value; only touch metadata that exists
+        if (idx >= c->pool.nframes) idx = CACHE_NIL;
+        cache_frame_t *f = idx != CACHE_NIL ? &c->frames[idx] : NULL;
+        // A page still being read is waited for on the locked path
+        if (f && (__atomic_load_n(&f->flags, __ATOMIC_ACQUIRE) & CACHE_FRAME_LOADING)) return CACHE_NIL;
+        if (f) {
+            if (pin && (__atomic_fetch_add(&f->pins, 1, __ATOMIC_SEQ_CST) & CACHE_PIN_EVICTING)) {
+                // Lost to an eviction in progress; the locked path waits it out
+                __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELAXED);
+                return CACHE_NIL;
             }
-            pthread_mutex_unlock(&c->lru_mutex);
-            pthread_mutex_unlock(&c->mutex[mg]);
-            // Increment cache hit counter
-            pthread_mutex_lock(&stats_mutex);
-            cache_hits++;
-            pthread_mutex_unlock(&stats_mutex);
-            // Periodically display stats (every 100 hits for simplicity)
-            if (cache_hits % 100 == 0) {
-                display_cache_stats();
+            if (!__atomic_load_n(&f->ref, __ATOMIC_RELAXED)) __atomic_store_n(&f->ref, 1, __ATOMIC_RELAXED);
+            if (write && !(__atomic_load_n(&f->flags, __ATOMIC_RELAXED) & CACHE_FRAME_DIRTY)) frame_mark_dirty(c, f);
+        }
+        // Order the flag updates before re-reading seq, so an eviction that
+        // started after this point is guaranteed to see the dirty bit
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) return idx;
+        if (f && pin) __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Wait for another thread's read to fill a frame found in the index.
+// Called with the shard mutex held and returns without it: 1 with the frame
+// pinned if it holds 'key' once loaded, 0 if the read failed and the lookup
+// has to start over (the mutex is then held again).
+static int wait_loading(cache_shard_t *s, cache_frame_t *f, uint64_t key) {
+    __atomic_add_fetch(&f->pins, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->mutex);
+    uint32_t flags;
+    while ((flags = __atomic_load_n(&f->flags, __ATOMIC_ACQUIRE)) & CACHE_FRAME_LOADING) {
+        sched_yield();
+    }
+    if ((flags & CACHE_FRAME_USED) && frame_key(f) == key) return 1;
+    __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&s->mutex);
+    return 0;
+}
+
+// Drop a LOADING frame whose read failed. Threads waiting on it see the page
+// gone and look it up again; the frame is reused once they let go of it.
+static void loading_abort(cache_t *c, uint32_t idx) {
+    cache_frame_t *f = &c->frames[idx];
+    uint64_t key = frame_key(f);
+    uint64_t h = hash_func(key);
+    cache_shard_t *s = shard_for(c, f->offset, h);
+    pthread_mutex_lock(&s->mutex);
+    shard_write_begin(s);
+    cache_index_erase(&s->index, key, (uint32_t)h);
+    if (c->policy != CACHE_POLICY_CLOCK) lru_unlink(c, s, idx);
+    shard_write_end(s);
+    frame_set_flags(c, f, 0);
+    s->entry_count--;
+    s->obj_pages[f->obj]--;
+    __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELEASE);
+    // Waiters release their pins without the shard mutex
+    while (!frame_claim(f)) sched_yield();
+    frame_release(f);
+    if (idx < s->first + s->limit) free_push(c, s, idx);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+// Publish a taken frame under its key - caller holds the shard mutex. On
+// failure the frame goes back to the free list.
+static int frame_install(cache_t *c, cache_shard_t *s, uint32_t idx, int obj, uint64_t off, uint64_t h,
+                         uint32_t flags, int list, int pin) {
+    cache_frame_t *f = &c->frames[idx];
+    shard_write_begin(s);
+    f->offset = off;
+    f->obj = obj;
+    frame_set_flags(c, f, flags);
+    __atomic_store_n(&f->ref, 0, __ATOMIC_RELAXED);
+    if (pin) __atomic_add_fetch(&f->pins, 1, __ATOMIC_RELAXED);
+    if (cache_index_insert(&s->index, cache_key(obj, off), (uint32_t)h, idx) != 0) {
+        shard_write_end(s);
+        log_cache_message("ERROR", "Failed to grow cache index");
+        if (pin) __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELAXED);
+        free_push(c, s, idx);
+        return -1;
+    }
+    policy_insert(c, s, idx, list);
+    shard_write_end(s);
+    s->entry_count++;
+    s->obj_pages[obj]++;
+    return 0;
+}
+
+// Take a free frame of the shard for a page of 'obj', evicting once the slice
+// is exhausted. An object at its quota replaces one of its own pages instead,
+// as long as one is evictable. When every candidate is pinned or under
+// write-back, wait briefly for them instead of failing the miss. Caller holds
+// the shard mutex; it may be dropped and retaken, so the caller must look the
+// key up again afterwards.
+static uint32_t take_frame(cache_t *c, cache_shard_t *s, int obj) {
+    size_t quota = c->objects[obj].quota;
+    if (quota && s->obj_pages[obj] >= shard_share(c, quota, s - c->shard)) {
+        uint32_t idx = evict_locked(c, s, obj);
+        if (idx != CACHE_NIL && idx < s->first + s->limit) return idx;
+    }
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        uint32_t idx = s->free_head;
+        if (idx != CACHE_NIL) {
+            s->free_head = c->frames[idx].lru_next;
+            return idx;
+        }
+        idx = evict_locked(c, s, -1);
+        // A frame above the limit is left over from a shrink and stays unused
+        if (idx != CACHE_NIL && idx < s->first + s->limit) return idx;
+        if (idx != CACHE_NIL) continue;
+        pthread_mutex_unlock(&s->mutex);
+        sched_yield();
+        pthread_mutex_lock(&s->mutex);
+    }
+    return CACHE_NIL;
+}
+
+// Find or load a page and return its frame, pinned if 'pin' is set.
+// Returns CACHE_NIL on failure.
+static uint32_t cache_lookup(cache_t *c, int obj, uint64_t off, int write, int pin) {
+    if (obj < 0 || obj >= CACHE_MAX_OBJECTS || c->objects[obj].fd < 0 || off >> CACHE_KEY_SHIFT) {
+        log_cache_message("ERROR", "Page request for an unregistered object or out of range offset");
+        return CACHE_NIL;
+    }
+    uint64_t t0 = stats_sample_start();
+    uint64_t key = cache_key(obj, off);
+    uint64_t h = hash_func(key);
+    cache_shard_t *s = shard_for(c, off, h);
+    if (c->policy == CACHE_POLICY_CLOCK) {
+        uint32_t idx = lookup_clock(c, s, h, key, write, pin);
+        if (idx != CACHE_NIL) {
+            count_hit(c, t0);
+            return idx;
+        }
+    }
+    pthread_mutex_lock(&s->mutex);
+    uint32_t idx = CACHE_NIL;
+    for (;;) {
+        uint32_t hit = cache_index_find(&s->index, key, (uint32_t)h);
+        if (hit != CACHE_NIL) {
+            // LRU hit, or another thread filled the page since the lock-free lookup
+            if (idx != CACHE_NIL) free_push(c, s, idx);
+            idx = CACHE_NIL;
+            cache_frame_t *f = &c->frames[hit];
+            if (__atomic_load_n(&f->flags, __ATOMIC_ACQUIRE) & CACHE_FRAME_LOADING) {
+                if (wait_loading(s, f, key)) {
+                    if (write) frame_mark_dirty(c, f);
+                    if (!pin) __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELEASE);
+                    count_hit(c, t0);
+                    return hit;
+                }
+                continue;
             }
-            return e->data;
-        }
-        e = e->next;
-    }
-    // Cache miss - load from disk
-    cache_entry_t *ne = malloc(sizeof(*ne));
-    if (!ne) {
-        pthread_mutex_unlock(&c->mutex[mg]);
-        log_cache_message("ERROR", "Failed to allocate memory for cache entry");
-        // Increment cache miss counter
-        pthread_mutex_lock(&stats_mutex);
-        cache_misses++;
-        pthread_mutex_unlock(&stats_mutex);
-        return NULL;
-    }
-    ne->offset = off;
-    ne->dirty = write;
-    ne->last_access = time(NULL);
-    ne->next = c->hash[h];
-    ne->prev = NULL;
-    if (c->hash[h]) c->hash[h]->prev = ne;
-    c->hash[h] = ne;
+            // Resident frames are never claimed while the shard mutex is free
+            if (pin) __atomic_add_fetch(&f->pins, 1, __ATOMIC_RELAXED);
+            if (write) frame_mark_dirty(c, f);
+            policy_hit(c, s, hit, h);
+            pthread_mutex_unlock(&s->mutex);
+            count_hit(c, t0);
+            return hit;
+        }
+        if (idx != CACHE_NIL) {
+            if (!cache_ztier_busy(&s->ztier, key, (uint32_t)h)) break;
+            // The flusher is writing the tier's copy home - load it after that.
+            // A shrink may rebuild the free list meanwhile, so no frame is held.
+            free_push(c, s, idx);
+            idx = CACHE_NIL;
+            pthread_mutex_unlock(&s->mutex);
+            sched_yield();
+            pthread_mutex_lock(&s->mutex);
+            continue;
+        }
+        // Cache miss - every miss is timed, from here if this call was not sampled
+        if (!t0) t0 = now_ns();
+        // take_frame() may drop the mutex, so check the index again
+        idx = take_frame(c, s, obj);
+        if (idx == CACHE_NIL) {
+            pthread_mutex_unlock(&s->mutex);
+            log_cache_message("ERROR", "No evictable cache frame available");
+            count_miss(c, t0);
+            return CACHE_NIL;
+        }
+    }
+    int list = policy_miss(c, s, key, h);
+    char *data = page_pool_frame(&c->pool, idx);
+    // A page held by the compressed tier or the ring cache is filled right away
+    int zdirty = 0;
+    if (victim_fill(c, s, key, h, data, &zdirty)) {
+        int rc = frame_install(c, s, idx, obj, off, h, CACHE_FRAME_USED | (write || zdirty ? CACHE_FRAME_DIRTY : 0), list, pin);
+        pthread_mutex_unlock(&s->mutex);
+        count_miss(c, t0);
+        return rc == 0 ? idx : CACHE_NIL;
+    }
+    // Otherwise the frame is indexed as LOADING and pinned, and the page is
+    // read without the shard mutex; misses on the same page wait for it
+    if (frame_install(c, s, idx, obj, off, h, CACHE_FRAME_USED | CACHE_FRAME_LOADING, list, 1) != 0) {
+        pthread_mutex_unlock(&s->mutex);
+        count_miss(c, t0);
+        return CACHE_NIL;
+    }
+    pthread_mutex_unlock(&s->mutex);
     // Read page from disk with detailed error handling
-    ssize_t read_result = pread(fd, ne->data, PAGE_SIZE, off);
+    ssize_t read_result = object_read(c, obj, data, off);
     if (read_result < 0) {
         char msg[256];
         snprintf(msg, sizeof(msg), "Failed to read page from disk at offset %lu (errno: %d)", off, errno);
         log_cache_message("ERROR", msg);
-        free(ne);
-        if (c->hash[h] == ne) c->hash[h] = ne->next;
-        if (ne->next) ne->next->prev = NULL;
-        pthread_mutex_unlock(&c->mutex[mg]);
-        // Increment cache miss counter
-        pthread_mutex_lock(&stats_mutex);
-        cache_misses++;
-        pthread_mutex_unlock(&stats_mutex);
-        return NULL;
-    } else if (read_result != PAGE_SIZE) {
+        loading_abort(c, idx);
+        count_miss(c, t0);
+        return CACHE_NIL;
+    } else if (read_result != (ssize_t)c->page_size) {
         char msg[256];
-        snprintf(msg, sizeof(msg), "Partial read from disk at offset %lu (read %zd bytes instead of %d)", off, read_result, PAGE_SIZE);
+        snprintf(msg, sizeof(msg), "Partial read from disk at offset %lu (read %zd bytes instead of %zu)", off, read_result, c->page_size);
         log_cache_message("WARNING", msg);
         // Fill the remaining part of the buffer with zeros to avoid undefined behavior
-        memset(ne->data + read_result, 0, PAGE_SIZE - read_result);
-    }
-    // Add to LRU list
-    pthread_mutex_lock(&c->lru_mutex);
-    ne->next = c->lru_head;
-    ne->prev = NULL;
-    if (c->lru_head) c->lru_head->prev = ne;
-    c->lru_head = ne;
-    if (!c->lru_tail) c->lru_tail = ne;
-    c->entry_count++;
-    // Check if eviction is needed
-    if (c->entry_count > MAX_CACHE_ENTRIES) {
-        cache_evict(c, fd);
-    }
-    pthread_mutex_unlock(&c->lru_mutex);
-    pthread_mutex_unlock(&c->mutex[mg]);
-    // Increment cache miss counter
-    pthread_mutex_lock(&stats_mutex);
-    cache_misses++;
-    pthread_mutex_unlock(&stats_mutex);
-    return ne->data;
+        memset(data + read_result, 0, c->page_size - read_result);
+    }
+    cache_frame_t *f = &c->frames[idx];
+    if (write) frame_mark_dirty(c, f);
+    __atomic_fetch_and(&f->flags, ~CACHE_FRAME_LOADING, __ATOMIC_RELEASE);
+    if (!pin) __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELEASE);
+    count_miss(c, t0);
+    return idx;
 }
 
-void cache_evict(cache_t *c, int fd) {
-    // Evict the least recently used entry
-    if (!c->lru_tail) return;
-    cache_entry_t *evict = c->lru_tail;
-    size_t h = hash_func(evict->offset);
-    size_t mg = mutex_group(h);
-    pthread_mutex_lock(&c->mutex[mg]);
-    // Remove from hash table
-    if (evict->prev) evict->prev->next = evict->next;
-    if (evict->next) evict->next->prev = evict->prev;
-    if (c->hash[h] == evict) c->hash[h] = evict->next;
-    // If entry is dirty, write back to disk with detailed error handling
-    if (evict->dirty) {
-        ssize_t write_result = pwrite(fd, evict->data, PAGE_SIZE, evict->offset);
-        if (write_result < 0) {
+// The returned pointer is only valid until the frame is evicted, which another
+// thread's miss may do at any time; use cache_pin() to keep the page resident.
+char* cache_get(cache_t *c, int obj, uint64_t off, int write) {
+    uint32_t idx = cache_lookup(c, obj, off, write, 0);
+    return idx != CACHE_NIL ? page_pool_frame(&c->pool, idx) : NULL;
+}
+
+// Pin a page for in-place access. The frame is neither evicted nor reused
+// until cache_unpin(); pinning with 'write' marks the page dirty.
+int cache_pin(cache_t *c, int obj, uint64_t off, int write, cache_page_t *page) {
+    uint32_t idx = cache_lookup(c, obj, off, write, 1);
+    if (idx == CACHE_NIL) {
+        page->data = NULL;
+        return -1;
+    }
+    page->data = page_pool_frame(&c->pool, idx);
+    page->offset = off;
+    page->obj = obj;
+    page->frame = idx;
+    page->write = write;
+    return 0;
+}
+
+// Write the written pages of a release in write-through and group commit
+// modes, one pwritev() per run of contiguous pages of an object, and flag the
+// objects written in 'objs'. Pages are cleaned before the write, so a writer
+// racing with it dirties them again. Returns -1 if some page did not reach
+// the file; it stays dirty for the flusher.
+static int commit_write(cache_t *c, const cache_page_t *pages, uint32_t n, uint8_t *objs) {
+    struct iovec iov[CACHE_FLUSH_BATCH];
+    int rc = 0;
+    for (uint32_t i = 0; i < n;) {
+        if (!pages[i].data || !pages[i].write) {
+            i++;
+            continue;
+        }
+        const cache_page_t *first = &pages[i];
+        uint32_t run = 0;
+        while (i + run < n && run < CACHE_FLUSH_BATCH && pages[i + run].data && pages[i + run].write &&
+               pages[i + run].obj == first->obj && pages[i + run].offset == first->offset + (uint64_t)run * c->page_size) {
+            frame_clear_dirty(c, &c->frames[pages[i + run].frame]);
+            iov[run].iov_base = pages[i + run].data;
+            iov[run].iov_len = c->page_size;
+            run++;
+        }
+        ssize_t expected = (ssize_t)(run * c->page_size);
+        ssize_t write_result = object_writev(c, first->obj, iov, run, first->offset);
+        if (write_result != expected) {
             char msg[256];
-            snprintf(msg, sizeof(msg), "Failed to write dirty page at offset %lu (errno: %d)", evict->offset, errno);
+            snprintf(msg, sizeof(msg), "Failed to commit %u pages at offset %lu (wrote %zd bytes, errno: %d)", run, first->offset,
+                     write_result, write_result < 0 ? errno : 0);
             log_cache_message("ERROR", msg);
-        } else if (write_result != PAGE_SIZE) {
-            char msg[256];
-            snprintf(msg, sizeof(msg), "Partial write to disk at offset %lu (wrote %zd bytes instead of %d)", evict->offset, write_result, PAGE_SIZE);
-            log_cache_message("WARNING", msg);
+            for (uint32_t k = 0; k < run; k++) {
+                if (write_result < (ssize_t)((k + 1) * c->page_size)) frame_mark_dirty(c, &c->frames[pages[i + k].frame]);
+            }
+            rc = -1;
         }
-        evict->dirty = 0; // Reset dirty flag after write attempt
+        if (write_result > 0) __atomic_add_fetch(&c->flush_stats.commit_pages, write_result / c->page_size, __ATOMIC_RELAXED);
+        objs[first->obj] = 1;
+        i += run;
     }
-    free(evict);
-    c->entry_count--;
-    // Update LRU tail
-    c->lru_tail = c->lru_tail->prev;
-    if (c->lru_tail) c->lru_tail->next = NULL;
-    pthread_mutex_unlock(&c->mutex[mg]);
+    return rc;
 }
 
-void cache_destroy(cache_t *c, int fd) {
-    for (int i = 0; i < HASH_SIZE; i++) {
-        size_t mg = mutex_group(i);
-        pthread_mutex_lock(&c->mutex[mg]);
-        cache_entry_t *e = c->hash[i];
-        while (e) {
-            cache_entry_t *n = e->next;
-            if (e->dirty) {
-                ssize_t write_result = pwrite(fd, e->data, PAGE_SIZE, e->offset);
-                if (write_result < 0) {
-                    char msg[256];
-                    snprintf(msg, sizeof(msg), "Failed to write dirty page at offset %lu during shutdown (errno: %d)", e->offset, errno);
-                    log_cache_message("ERROR", msg);
-                } else if (write_result != PAGE_SIZE) {
-                    char msg[256];
-                    snprintf(msg, sizeof(msg), "Partial write during shutdown at offset %lu (wrote %zd bytes instead of %d)", e->offset, write_result, PAGE_SIZE);
-                    log_cache_message("WARNING", msg);
-                }
-                e->dirty = 0; // Reset dirty flag after write attempt
+// Append the written pages of a release to the write-ahead log. They are
+// marked dirty first, so the checkpoint that retires their half writes them
+// home. When both halves are full a checkpoint is run right here. Returns -1
+// if some page could not be logged.
+static int wal_log(cache_t *c, const cache_page_t *pages, uint32_t n) {
+    cache_wal_page_t recs[CACHE_RANGE_MAX];
+    uint32_t i = 0;
+    while (i < n) {
+        uint32_t k = 0;
+        for (; i < n && k < CACHE_RANGE_MAX; i++) {
+            if (!pages[i].data || !pages[i].write) continue;
+            frame_mark_dirty(c, &c->frames[pages[i].frame]);
+            recs[k++] = (cache_wal_page_t){ pages[i].obj, pages[i].offset, pages[i].data };
+        }
+        for (uint32_t done = 0; done < k;) {
+            int logged = cache_wal_append(&c->wal, recs + done, k - done);
+            if (logged < 0 || (done + logged < k && wal_checkpoint(c) != 0)) {
+                char msg[128];
+                snprintf(msg, sizeof(msg), "Failed to log %u written pages (errno: %d)", k - done, c->wal.sync_error);
+                log_cache_message("ERROR", msg);
+                return -1;
+            }
+            done += (uint32_t)logged;
+        }
+    }
+    return 0;
+}
+
+// Does not take the shard mutex, so a handle may be released from any thread.
+// In write-through, group commit and write-ahead log modes releasing a write
+// pin returns once the page is on stable storage, or -1 if it could not be
+// made durable.
+int cache_unpin(cache_t *c, cache_page_t *page) {
+    return cache_unpin_range(c, page, 1);
+}
+
+// Release a set of handles. In the durable modes their written pages share
+// the writes and a single barrier.
+int cache_unpin_range(cache_t *c, cache_page_t *pages, uint32_t npages) {
+    int durable = c->durability != CACHE_DURABILITY_WRITEBACK;
+    uint8_t objs[CACHE_MAX_OBJECTS] = {0};
+    int rc = 0;
+    if (c->durability == CACHE_DURABILITY_WAL) {
+        rc = wal_log(c, pages, npages);
+    } else if (durable) {
+        rc = commit_write(c, pages, npages, objs);
+    }
+    int written = 0;
+    for (uint32_t i = 0; i < npages; i++) {
+        cache_page_t *page = &pages[i];
+        if (!page->data) continue;
+        cache_frame_t *f = &c->frames[page->frame];
+        // A flush may have written the page while it was still being modified
+        if (page->write && !durable) frame_mark_dirty(c, f);
+        written |= page->write;
+        __atomic_sub_fetch(&f->pins, 1, __ATOMIC_RELEASE);
+        page->data = NULL;
+    }
+    // The pins are gone, so eviction is not held up by the barrier
+    if (durable && written && commit_wait(c, objs) != 0) rc = -1;
+    return rc;
+}
+
+// Outcome of range_claim()
+enum { RANGE_HIT, RANGE_FILLED, RANGE_MISS, RANGE_BUSY, RANGE_FAIL };
+
+// Pin one page of a range. A resident page is pinned as it is, and one held
+// by the compressed tier or the ring cache is filled from there right away (FILLED); any other
+// missing page gets a frame that is indexed as LOADING and pinned, for the
+// caller to read into. A page another thread is still loading is reported as BUSY without
+// waiting, so the caller can first issue the reads it owes others.
+static int range_claim(cache_t *c, int obj, uint64_t off, uint32_t *out) {
+    uint64_t key = cache_key(obj, off);
+    uint64_t h = hash_func(key);
+    cache_shard_t *s = shard_for(c, off, h);
+    if (c->policy == CACHE_POLICY_CLOCK) {
+        uint32_t hit = lookup_clock(c, s, h, key, 0, 1);
+        if (hit != CACHE_NIL) {
+            *out = hit;
+            return RANGE_HIT;
+        }
+    }
+    pthread_mutex_lock(&s->mutex);
+    uint32_t idx = CACHE_NIL;
+    for (;;) {
+        uint32_t hit = cache_index_find(&s->index, key, (uint32_t)h);
+        if (hit != CACHE_NIL) {
+            if (idx != CACHE_NIL) free_push(c, s, idx);
+            cache_frame_t *f = &c->frames[hit];
+            if (__atomic_load_n(&f->flags, __ATOMIC_ACQUIRE) & CACHE_FRAME_LOADING) {
+                pthread_mutex_unlock(&s->mutex);
+                return RANGE_BUSY;
             }
-            free(e);
-            e = n;
+            __atomic_add_fetch(&f->pins, 1, __ATOMIC_RELAXED);
+            policy_hit(c, s, hit, h);
+            pthread_mutex_unlock(&s->mutex);
+            *out = hit;
+            return RANGE_HIT;
+        }
+        if (idx != CACHE_NIL) {
+            if (!cache_ztier_busy(&s->ztier, key, (uint32_t)h)) break;
+            // The flusher is writing the tier's copy home - load it after that.
+            // A shrink may rebuild the free list meanwhile, so no frame is held.
+            free_push(c, s, idx);
+            idx = CACHE_NIL;
+            pthread_mutex_unlock(&s->mutex);
+            sched_yield();
+            pthread_mutex_lock(&s->mutex);
+            continue;
+        }
+        idx = take_frame(c, s, obj);
+        if (idx == CACHE_NIL) {
+            pthread_mutex_unlock(&s->mutex);
+            log_cache_message("ERROR", "No evictable cache frame available");
+            return RANGE_FAIL;
+        }
+    }
+    int list = policy_miss(c, s, key, h);
+    int zdirty = 0;
+    int filled = victim_fill(c, s, key, h, page_pool_frame(&c->pool, idx), &zdirty);
+    uint32_t flags = filled ? (zdirty ? CACHE_FRAME_DIRTY : 0) : CACHE_FRAME_LOADING;
+    int rc = frame_install(c, s, idx, obj, off, h, CACHE_FRAME_USED | flags, list, 1);
+    pthread_mutex_unlock(&s->mutex);
+    if (rc != 0) return RANGE_FAIL;
+    *out = idx;
+    return filled ? RANGE_FILLED : RANGE_MISS;
+}
+
+// Read a run of contiguous LOADING pages with one preadv() and publish them
+static int range_fill(cache_t *c, int obj, cache_page_t *pages, uint32_t n) {
+    struct iovec iov[CACHE_RANGE_MAX];
+    for (uint32_t i = 0; i < n; i++) {
+        iov[i].iov_base = pages[i].data;
+        iov[i].iov_len = c->page_size;
+    }
+    ssize_t expected = (ssize_t)n * c->page_size;
+    ssize_t read_result = object_readv(c, obj, iov, n, pages[0].offset);
+    if (read_result < 0) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Failed to read %u pages from disk at offset %lu (errno: %d)", n, pages[0].offset, errno);
+        log_cache_message("ERROR", msg);
+        for (uint32_t i = 0; i < n; i++) {
+            loading_abort(c, pages[i].frame);
+            pages[i].data = NULL;
+        }
+        return -1;
+    }
+    if (read_result != expected) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "Partial read from disk at offset %lu (read %zd bytes instead of %zd)", pages[0].offset, read_result, expected);
+        log_cache_message("WARNING", msg);
+        // Zero whatever lies past the end of the data
+        for (uint32_t i = read_result / c->page_size; i < n; i++) {
+            size_t keep = i == read_result / c->page_size ? read_result % c->page_size : 0;
+            memset(pages[i].data + keep, 0, c->page_size - keep);
+        }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        cache_frame_t *f = &c->frames[pages[i].frame];
+        __atomic_fetch_and(&f->flags, ~CACHE_FRAME_LOADING, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Issue the reads for all LOADING pages in [*pending, upto), one preadv()
+// per contiguous run
+static int range_flush(cache_t *c, int obj, cache_page_t *pages, const uint8_t *state,
+                       uint32_t *pending, uint32_t upto) {
+    int rc = 0;
+    uint32_t i = *pending;
+    while (i < upto) {
+        if (state[i] != RANGE_MISS) {
+            i++;
+            continue;
+        }
+        uint32_t end = i;
+        while (end < upto && state[end] == RANGE_MISS) end++;
+        if (range_fill(c, obj, &pages[i], end - i) != 0) rc = -1;
+        i = end;
+    }
+    *pending = upto;
+    return rc;
+}
+
+// Pin npages consecutive pages starting at off. Resident pages are pinned in
+// place and the misses are read with one preadv() per contiguous run, instead
+// of a pread() each. Every page must be released with cache_unpin() (or
+// cache_unpin_range()). Returns 0, or -1 with no page left pinned.
+int cache_get_range(cache_t *c, int obj, uint64_t off, uint32_t npages, int write, cache_page_t *pages) {
+    if (!object_valid(c, obj) || npages == 0 || npages > CACHE_RANGE_MAX ||
+        (off + (uint64_t)npages * c->page_size - 1) >> CACHE_KEY_SHIFT) {
+        log_cache_message("ERROR", "Invalid page range request");
+        return -1;
+    }
+    uint64_t t0 = now_ns();
+    uint8_t state[CACHE_RANGE_MAX];
+    uint32_t pending = 0, claimed = 0;
+    int rc = 0;
+    for (; claimed < npages; claimed++) {
+        uint64_t page_off = off + (uint64_t)claimed * c->page_size;
+        uint32_t idx;
+        int st;
+        while ((st = range_claim(c, obj, page_off, &idx)) == RANGE_BUSY) {
+            // Never wait for another reader while holding unread frames of our own
+            if (range_flush(c, obj, pages, state, &pending, claimed) != 0) rc = -1;
+            sched_yield();
+        }
+        if (st == RANGE_FAIL) {
+            rc = -1;
+            break;
+        }
+        pages[claimed].data = page_pool_frame(&c->pool, idx);
+        pages[claimed].offset = page_off;
+        pages[claimed].obj = obj;
+        pages[claimed].frame = idx;
+        pages[claimed].write = write;
+        state[claimed] = st;
+    }
+    if (range_flush(c, obj, pages, state, &pending, claimed) != 0) rc = -1;
+    for (uint32_t i = 0; i < claimed; i++) {
+        if (state[i] != RANGE_HIT) count_miss(c, t0);
+        else count_hit(c, 0);
+    }
+    if (rc != 0) {
+        // Nothing was handed out or changed, so the pins go without the
+        // durable release and the pages stay as clean or dirty as they were
+        for (uint32_t i = 0; i < claimed; i++) {
+            if (!pages[i].data) continue;
+            __atomic_sub_fetch(&c->frames[pages[i].frame].pins, 1, __ATOMIC_RELEASE);
+            pages[i].data = NULL;
+        }
+        return -1;
+    }
+    // Pages are only dirtied once the whole range is handed out
+    for (uint32_t i = 0; write && i < npages; i++) {
+        frame_mark_dirty(c, &c->frames[pages[i].frame]);
+    }
+    return 0;
+}
+
+void cache_evict(cache_t *c, int fd) {
+    (void)fd; // frames remember their own backing file
+    // Evict one frame from the fullest shard and return it to the shard free list
+    cache_shard_t *s = &c->shard[0];
+    for (int i = 1; i < c->nshards; i++) {
+        if (c->shard[i].entry_count > s->entry_count) s = &c->shard[i];
+    }
+    pthread_mutex_lock(&s->mutex);
+    uint32_t idx = evict_locked(c, s, -1);
+    if (idx != CACHE_NIL && idx < s->first + s->limit) free_push(c, s, idx);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+int cache_set_capacity(cache_t *c, int fd, size_t entries) {
+    (void)fd; // frames remember their own backing file
+    if (entries == 0 || entries > c->nframes) {
+        log_cache_message("ERROR", "Requested capacity exceeds the page pool");
+        return -1;
+    }
+    // No flush round may hold frames that are about to be dropped
+    pthread_mutex_lock(&c->flush_mutex);
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        uint32_t limit = shard_share(c, entries, i);
+        if (limit > s->nframes) limit = s->nframes;
+        pthread_mutex_lock(&s->mutex);
+        // Grow the index first so that inserts at the new size never rehash
+        shard_write_begin(s);
+        int rc = cache_index_reserve(&s->index, limit);
+        shard_write_end(s);
+        if (rc != 0) {
+            pthread_mutex_unlock(&s->mutex);
+            pthread_mutex_unlock(&c->flush_mutex);
+            log_cache_message("ERROR", "Failed to grow cache index");
+            return -1;
+        }
+        // Misses only use frames below the new limit from here on
+        uint32_t old_limit = s->limit;
+        s->limit = limit;
+        s->hand %= limit;
+        s->free_head = CACHE_NIL;
+        for (uint32_t idx = s->first + limit; idx-- > s->first;) {
+            if (!(c->frames[idx].flags & CACHE_FRAME_USED)) free_push(c, s, idx);
+        }
+        // Shrinking: evict everything resident above the new limit, waiting
+        // for pinned frames to be released
+        for (uint32_t idx = s->first + limit; idx < s->first + old_limit; idx++) {
+            detach_wait(c, s, idx, 1);
+        }
+        policy_resize(c, s);
+        pthread_mutex_unlock(&s->mutex);
+    }
+    c->capacity = entries;
+    set_watermarks(c);
+    pthread_mutex_unlock(&c->flush_mutex);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Cache capacity set to %zu frames", entries);
+    log_cache_message("INFO", msg);
+    return 0;
+}
+
+void cache_get_flush_stats(cache_t *c, cache_flush_stats_t *out) {
+    out->pages_flushed = __atomic_load_n(&c->flush_stats.pages_flushed, __ATOMIC_RELAXED);
+    out->bytes_flushed = __atomic_load_n(&c->flush_stats.bytes_flushed, __ATOMIC_RELAXED);
+    out->write_calls = __atomic_load_n(&c->flush_stats.write_calls, __ATOMIC_RELAXED);
+    out->flush_ns = __atomic_load_n(&c->flush_stats.flush_ns, __ATOMIC_RELAXED);
+    out->sync_evictions = __atomic_load_n(&c->flush_stats.sync_evictions, __ATOMIC_RELAXED);
+    out->commit_pages = __atomic_load_n(&c->flush_stats.commit_pages, __ATOMIC_RELAXED);
+    out->commit_waits = __atomic_load_n(&c->flush_stats.commit_waits, __ATOMIC_RELAXED);
+    out->commit_syncs = __atomic_load_n(&c->flush_stats.commit_syncs, __ATOMIC_RELAXED);
+    out->commit_ns = __atomic_load_n(&c->flush_stats.commit_ns, __ATOMIC_RELAXED);
+    out->dirty_pages = __atomic_load_n(&c->dirty_count, __ATOMIC_RELAXED);
+    out->dirty_ratio = c->capacity ? (double)out->dirty_pages / c->capacity : 0.0;
+    out->flush_mb_per_s = out->flush_ns ? (double)out->bytes_flushed / (1024.0 * 1024.0) / (out->flush_ns / 1e9) : 0.0;
+}
+
+void cache_get_stats(cache_t *c, cache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < CACHE_STATS_SLOTS; i++) {
+        const cache_stats_t *st = &c->stats[i].s;
+        out->hits += __atomic_load_n(&st->hits, __ATOMIC_RELAXED);
+        out->misses += __atomic_load_n(&st->misses, __ATOMIC_RELAXED);
+        for (int b = 0; b < CACHE_HIST_BUCKETS; b++) {
+            out->hit_ns[b] += __atomic_load_n(&st->hit_ns[b], __ATOMIC_RELAXED);
+            out->miss_ns[b] += __atomic_load_n(&st->miss_ns[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Totals over the shards' compressed tiers. pages * page_size / slab_bytes is
+// how many bytes of cached data each byte of the tier holds.
+void cache_get_ztier_stats(cache_t *c, cache_ztier_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        pthread_mutex_lock(&s->mutex);
+        out->stored += s->ztier.stats.stored;
+        out->hits += s->ztier.stats.hits;
+        out->rejected += s->ztier.stats.rejected;
+        out->demoted += s->ztier.stats.demoted;
+        out->written += s->ztier.stats.written;
+        out->write_errors += s->ztier.stats.write_errors;
+        out->dirty_refused += s->ztier.stats.dirty_refused;
+        out->pages += s->ztier.stats.pages;
+        out->bytes += s->ztier.stats.bytes;
+        out->slab_bytes += s->ztier.stats.slab_bytes;
+        out->filled += s->ztier.stats.filled;
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+// Write-ahead log counters, zeros unless the cache runs in CACHE_DURABILITY_WAL
+void cache_get_wal_stats(cache_t *c, cache_wal_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (c->durability != CACHE_DURABILITY_WAL || c->wal.fd < 0) return;
+    pthread_mutex_lock(&c->wal.mutex);
+    *out = c->wal.stats;
+    pthread_mutex_unlock(&c->wal.mutex);
+}
+
+// Upper bound in ns of the bucket holding quantile q (0..1) of a histogram
+uint64_t cache_stats_percentile(const uint64_t *hist, double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < CACHE_HIST_BUCKETS; b++) total += hist[b];
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * total), seen = 0;
+    for (int b = 0; b < CACHE_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) return b ? 1ULL << b : 1;
+    }
+    return UINT64_MAX;
+}
+
+void cache_destroy(cache_t *c, int fd) {
+    (void)fd; // frames remember their own backing file
+    if (c->warmup_running) {
+        pthread_mutex_lock(&c->warmup_mutex);
+        c->warmup_stop = 1;
+        pthread_cond_broadcast(&c->warmup_cond);
+        pthread_mutex_unlock(&c->warmup_mutex);
+        pthread_join(c->warmup_thread, NULL);
+        c->warmup_running = 0;
+    }
+    if (c->flusher_running) {
+        pthread_mutex_lock(&c->flush_wait_mutex);
+        c->flusher_stop = 1;
+        pthread_cond_signal(&c->flush_cond);
+        pthread_mutex_unlock(&c->flush_wait_mutex);
+        pthread_join(c->flusher, NULL);
+        c->flusher_running = 0;
+    }
+    if (c->committer_running) {
+        pthread_mutex_lock(&c->commit_mutex);
+        c->committer_stop = 1;
+        pthread_cond_signal(&c->commit_cond);
+        pthread_mutex_unlock(&c->commit_mutex);
+        pthread_join(c->committer, NULL);
+        c->committer_running = 0;
+    }
+    // Final flush goes through the same sorted, coalesced path as the flusher
+    flush_dirty(c, SIZE_MAX, -1, NULL);
+    size_t left = __atomic_load_n(&c->dirty_count, __ATOMIC_RELAXED);
+    cache_ztier_stats_t zst;
+    cache_get_ztier_stats(c, &zst);
+    cache_wal_stats_t wst;
+    memset(&wst, 0, sizeof(wst));
+    for (int i = 0; i < c->nshards; i++) {
+        uint64_t errors = c->shard[i].ztier.stats.write_errors;
+        cache_ztier_flush(&c->shard[i].ztier, 0, UINT64_MAX);
+        left += c->shard[i].ztier.stats.write_errors - errors;
+    }
+    if (left > 0) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "%zu dirty pages could not be written during shutdown", left);
+        log_cache_message("ERROR", msg);
+    }
+    // Everything written back is made durable before the files are released
+    uint8_t objs[CACHE_MAX_OBJECTS];
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        objs[o] = object_valid(c, o);
+    }
+    commit_sync(c, objs);
+    // With everything home and synced the log has nothing left to replay
+    if (c->durability == CACHE_DURABILITY_WAL) {
+        int clean = left == 0 && !c->wal.sync_error;
+        for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+            if (objs[o] && c->objects[o].sync_error) clean = 0;
         }
-        c->hash[i] = NULL;
-        pthread_mutex_unlock(&c->mutex[mg]);
+        cache_get_wal_stats(c, &wst);
+        cache_wal_close(&c->wal, clean);
+        if (!clean) log_cache_message("WARNING", "Write-ahead log kept for replay on the next start");
+    }
+    // The resident set is what the next start prefetches
+    if (c->manifest_path) manifest_save(c);
+    // Ring blocks stay valid for a restart that finds the files as they are
+    // now, so a block store writes its index before the file state is taken
+    for (int o = 0; c->victim_ring && o < CACHE_MAX_OBJECTS; o++) {
+        if (!object_valid(c, o)) continue;
+        if (c->objects[o].store) block_store_sync(c->objects[o].store);
+        ring_object_close(o, c->objects[o].fd);
+    }
+    for (int i = 0; i < c->nshards; i++) {
+        cache_shard_t *s = &c->shard[i];
+        pthread_mutex_destroy(&s->mutex);
+        cache_index_destroy(&s->index);
+        shard_policy_destroy(s);
+        cache_ztier_destroy(&s->ztier);
+        s->free_head = CACHE_NIL;
+        s->entry_count = 0;
+    }
+    for (int o = 0; o < CACHE_MAX_OBJECTS; o++) {
+        if (c->objects[o].buffered_fd >= 0) close(c->objects[o].buffered_fd);
+        c->objects[o].buffered_fd = -1;
+    }
+    pthread_mutex_destroy(&c->object_mutex);
+    pthread_mutex_destroy(&c->warmup_mutex);
+    pthread_cond_destroy(&c->warmup_cond);
+    free(c->manifest_path);
+    c->manifest_path = NULL;
+    cache_manifest_free(&c->warmup);
+    pthread_mutex_destroy(&c->flush_mutex);
+    pthread_mutex_destroy(&c->flush_wait_mutex);
+    pthread_cond_destroy(&c->flush_cond);
+    pthread_mutex_destroy(&c->commit_mutex);
+    pthread_cond_destroy(&c->commit_cond);
+    pthread_cond_destroy(&c->commit_done_cond);
+    pthread_mutex_destroy(&c->wal_checkpoint_mutex);
+    free(c->flush_list);
+    c->flush_list = NULL;
+    cache_stats_t st;
+    cache_get_stats(c, &st);
+    free(c->stats);
+    c->stats = NULL;
+    free(c->frames);
+    c->frames = NULL;
+    page_pool_destroy(&c->pool);
+    char msg[160];
+    snprintf(msg, sizeof(msg), "Cache destroyed (hits: %lu, misses: %lu, hit ratio: %.2f%%, p99 miss: %lu ns)",
+             st.hits, st.misses, st.hits + st.misses ? (double)st.hits / (st.hits + st.misses) * 100.0 : 0.0,
+             cache_stats_percentile(st.miss_ns, 0.99));
+    log_cache_message("INFO", msg);
+    uint64_t waits = c->flush_stats.commit_waits, syncs = c->flush_stats.commit_syncs;
+    if (waits) {
+        snprintf(msg, sizeof(msg), "Commits: %lu barriers served by %lu fdatasync calls (%.1f per call), %lu pages written",
+                 waits, syncs, syncs ? (double)waits / syncs : 0.0, c->flush_stats.commit_pages);
+        log_cache_message("INFO", msg);
+    }
+    if (zst.stored) {
+        size_t held = zst.slab_bytes + zst.filled * sizeof(cache_zentry_t);
+        snprintf(msg, sizeof(msg), "Compressed tier: %lu pages stored, %lu hits, %lu demoted, %lu rejected, %zu zero or same-filled, %.2fx compression",
+                 zst.stored, zst.hits, zst.demoted, zst.rejected, zst.filled,
+                 held ? (double)zst.pages * c->page_size / held : 0.0);
+        log_cache_message("INFO", msg);
     }
-    for (int i = 0; i < MUTEX_GROUPS; i++) {
-        pthread_mutex_destroy(&c->mutex[i]);
+    if (wst.records) {
+        snprintf(msg, sizeof(msg), "Write-ahead log: %lu pages in %lu appends, %.2fx compression, %lu syncs, %lu checkpoints",
+                 wst.records, wst.appends, wst.log_bytes ? (double)wst.page_bytes / wst.log_bytes : 0.0, wst.syncs,
+                 wst.checkpoints);
+        log_cache_message("INFO", msg);
     }
-    pthread_mutex_destroy(&c->lru_mutex);
-    c->lru_head = NULL;
-    c->lru_tail = NULL;
-    c->entry_count = 0;
-    log_cache_message("INFO", "Cache destroyed");
+    free(c->shard);
+    c->shard = NULL;
 }
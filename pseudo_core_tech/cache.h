@@ -8,44 +8,369 @@
 #include <string.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
 // Константы
 #include "config.h"
+#include "page_pool.h"
+#include "cache_index.h"
+#include "cache_sketch.h"
+#include "cache_ztier.h"
+#include "cache_manifest.h"
+#include "ring_cache.h"
+#include "cache_wal.h"
+#include "block_store.h"
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE BLOCK_SIZE
 #endif
-#ifndef HASH_SIZE
-#define HASH_SIZE 2048
-#endif
 #ifndef MUTEX_GROUPS
 #define MUTEX_GROUPS 16
 #endif
 #ifndef MAX_CACHE_ENTRIES
 #define MAX_CACHE_ENTRIES 1024
 #endif
+// Limits of the geometry accepted by cache_init(); the macros above are only
+// the defaults
+#define CACHE_MIN_PAGE_SIZE 4096
+#define CACHE_MAX_PAGE_SIZE (2 * 1024 * 1024)
+#define CACHE_MAX_SHARDS 256
+#ifndef CACHE_HUGEPAGES
+#define CACHE_HUGEPAGES 0
+#endif
+#ifndef CACHE_DIRTY_LOW_PCT
+#define CACHE_DIRTY_LOW_PCT 5
+#endif
+#ifndef CACHE_DIRTY_HIGH_PCT
+#define CACHE_DIRTY_HIGH_PCT 20
+#endif
+#ifndef CACHE_FLUSH_INTERVAL_MS
+#define CACHE_FLUSH_INTERVAL_MS 100
+#endif
+#ifndef CACHE_STATS_SLOTS
+#define CACHE_STATS_SLOTS 64 // per-thread counter slots, threads beyond this share
+#endif
+#ifndef CACHE_STATS_SAMPLE
+#define CACHE_STATS_SAMPLE 16 // time one hit in this many (power of two)
+#endif
+#define CACHE_HIST_BUCKETS 32
+#ifndef CACHE_FLUSH_BATCH
+#define CACHE_FLUSH_BATCH 256 // pages per pwritev()
+#endif
+#ifndef CACHE_RANGE_MAX
+#define CACHE_RANGE_MAX 256     // pages per cache_get_range() call
+#endif
+#ifndef CACHE_MAX_OBJECTS
+#define CACHE_MAX_OBJECTS 16    // backing objects registered at once
+#endif
+#if CACHE_MAX_OBJECTS > CACHE_WAL_MAX_FILES
+#error "CACHE_MAX_OBJECTS exceeds the object ids the write-ahead log can name"
+#endif
+#define CACHE_KEY_SHIFT 48      // key = object id << 48 | byte offset
+#ifndef CACHE_NUMA
+#define CACHE_NUMA 0            // bind shard memory to NUMA nodes
+#endif
+#ifndef CACHE_DEFAULT_POLICY
+#define CACHE_DEFAULT_POLICY CACHE_POLICY_CLOCK
+#endif
+#ifndef CACHE_ZTIER_MB
+#define CACHE_ZTIER_MB 0        // compressed tier for evicted pages, 0 = off
+#endif
+#ifndef CACHE_MANIFEST_PATH
+#define CACHE_MANIFEST_PATH NULL // hot-set manifest for warm restarts, NULL = off
+#endif
+#ifndef CACHE_WAL_PATH
+#define CACHE_WAL_PATH NULL     // write-ahead log of CACHE_DURABILITY_WAL
+#endif
+#ifndef CACHE_WAL_MB
+#define CACHE_WAL_MB 64         // log size, split in two halves
+#endif
+#ifndef CACHE_WARMUP_MB_S
+#define CACHE_WARMUP_MB_S 64    // prefetch bandwidth of the warm-up
+#endif
+#ifndef CACHE_WARMUP_WAIT_MS
+#define CACHE_WARMUP_WAIT_MS 10000 // how long warm-up waits for the manifest's files
+#endif
+#ifndef CACHE_VICTIM_RING
+#define CACHE_VICTIM_RING 0     // evicted pages the compressed tier refuses go to the ring cache
+#endif
+#ifndef CACHE_DURABILITY
+#define CACHE_DURABILITY CACHE_DURABILITY_WRITEBACK
+#endif
+#ifndef CACHE_WINDOW_PCT
+#define CACHE_WINDOW_PCT 1      // TinyLFU admission window, share of capacity
+#endif
+#ifndef CACHE_PROTECTED_PCT
+#define CACHE_PROTECTED_PCT 80  // TinyLFU protected segment, share of the main area
+#endif
+
+#define CACHE_NIL UINT32_MAX
+
+// Frame flags
+#define CACHE_FRAME_USED  0x1
+#define CACHE_FRAME_DIRTY 0x2
+#define CACHE_FRAME_FLUSHING 0x4 // being written by the flusher, not evictable
+#define CACHE_FRAME_LOADING 0x8  // indexed, data still being read by a miss
+
+// Set in cache_frame_t.pins while the evictor owns the frame; pinners back off
+#define CACHE_PIN_EVICTING 0x80000000u
+
+// Per-shard replacement lists; which ones are used depends on the policy
+#define CACHE_LIST_LRU       0
+#define CACHE_LIST_WINDOW    0 // TinyLFU: recent arrivals
+#define CACHE_LIST_PROBATION 1 // TinyLFU: admitted, not yet hit again
+#define CACHE_LIST_PROTECTED 2 // TinyLFU: hit while on probation
+#define CACHE_LIST_T1        0 // ARC: seen once recently
+#define CACHE_LIST_T2        1 // ARC: seen at least twice recently
+#define CACHE_LISTS          3
+// ARC ghost lists: keys recently evicted from T1 and T2
+#define CACHE_GHOST_B1 0
+#define CACHE_GHOST_B2 1
 
-typedef struct cache_entry {
+// Replacement policy, chosen at cache_init() time
+typedef enum {
+    CACHE_POLICY_LRU,     // exact LRU per shard, hits relink under the shard mutex
+    CACHE_POLICY_CLOCK,   // second chance per shard, hits only set a reference bit
+    CACHE_POLICY_TINYLFU, // W-TinyLFU: LRU window, frequency-filtered SLRU main area
+    CACHE_POLICY_ARC      // adaptive replacement cache with ghost lists
+} cache_policy_t;
+
+// When pages written through cache_pin()/cache_get_range() reach stable
+// storage, chosen at cache_init() time
+typedef enum {
+    CACHE_DURABILITY_WRITEBACK,    // flusher and eviction write pages back, no fdatasync() until cache_sync()
+    CACHE_DURABILITY_WRITETHROUGH, // releasing a write pin writes the pages and calls fdatasync()
+    CACHE_DURABILITY_GROUP,        // as write-through, but one committer fdatasync() covers all waiting writers
+    CACHE_DURABILITY_WAL           // releasing a write pin appends the pages to a write-ahead log, synced by the
+                                   // committer; the flusher writes them home and checkpoints retire the log
+} cache_durability_t;
+
+typedef struct {
+    cache_policy_t policy;
+    cache_durability_t durability;
+    size_t cache_bytes;         // page pool budget, 0 = MAX_CACHE_ENTRIES pages
+    size_t page_size;           // power of two, 4 KB to 2 MB, 0 = PAGE_SIZE
+    unsigned shards;            // 0 = MUTEX_GROUPS
+    size_t capacity;            // resident frames, 0 = the whole pool
+    int flusher;                // run the background write-back thread
+    unsigned dirty_low_pct;     // flusher writes back down to this share of capacity
+    unsigned dirty_high_pct;    // crossing this share wakes the flusher immediately
+    unsigned flush_interval_ms; // periodic flusher wake-up
+    int numa;                   // spread shards over the NUMA nodes
+    uint64_t numa_stripe;       // bytes of each object homed on one node in turn, 0 = by hash
+    size_t ztier_bytes;         // compressed second-level tier, 0 = evicted pages are dropped
+    int ztier_codec;            // COMPRESS_BUDGET_* of the tier, FAST keeps hits cheap
+    int victim_ring;            // keep evicted pages the tier does not take in the ring cache,
+                                // which must be set up with ring_cache_init(page_size) first
+    const char *wal_path;       // write-ahead log for CACHE_DURABILITY_WAL, replayed by cache_init()
+    size_t wal_bytes;           // log size, 0 = CACHE_WAL_MB
+    const char *manifest_path;  // hot set saved by cache_destroy() and prefetched after cache_init()
+    unsigned warmup_mb_per_s;   // prefetch bandwidth cap, 0 = CACHE_WARMUP_MB_S
+} cache_config_t;
+
+// Write-back metrics, see cache_get_flush_stats()
+typedef struct {
+    uint64_t pages_flushed;
+    uint64_t bytes_flushed;
+    uint64_t write_calls;    // pwritev() batches issued by the flusher
+    uint64_t flush_ns;       // time spent in those calls
+    uint64_t sync_evictions; // dirty victims written back on the miss path
+    uint64_t commit_pages;   // pages written when a write pin was released
+    uint64_t commit_waits;   // durability barriers: releases and cache_sync() calls
+    uint64_t commit_syncs;   // fdatasync() calls serving them
+    uint64_t commit_ns;      // time spent in those calls
+    size_t dirty_pages;
+    double dirty_ratio;      // dirty_pages / capacity
+    double flush_mb_per_s;   // bytes_flushed over flush_ns
+} cache_flush_stats_t;
+
+// Hit/miss counters and service time histograms, see cache_get_stats().
+// Bucket i counts service times in [2^(i-1), 2^i) ns, the last bucket is open.
+// Every miss is timed; hits are sampled one in CACHE_STATS_SAMPLE.
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t hit_ns[CACHE_HIST_BUCKETS];
+    uint64_t miss_ns[CACHE_HIST_BUCKETS];
+} cache_stats_t;
+
+// One thread's share of the statistics, on its own cache lines
+typedef struct {
+    cache_stats_t s;
+} __attribute__((aligned(64))) cache_stats_slot_t;
+
+// Per-frame metadata, kept apart from the data frames in the page pool.
+// Links are frame indices, so the whole array stays compact and scan-friendly.
+// Fields touched by lock-free lookups (flags, ref, pins) are accessed with
+// __atomic builtins.
+typedef struct {
     uint64_t offset;
-    char data[PAGE_SIZE];
-    int dirty;
-    time_t last_access;
-    struct cache_entry *next;
-    struct cache_entry *prev;
-} cache_entry_t;
-
-typedef struct {
-    cache_entry_t *hash[HASH_SIZE];
-    pthread_mutex_t mutex[MUTEX_GROUPS];
-    pthread_mutex_t lru_mutex;
-    cache_entry_t *lru_head;
-    cache_entry_t *lru_tail;
+    uint32_t obj;      // backing object the page is read from and written to
+    uint32_t lru_next; // also links the free list
+    uint32_t lru_prev;
+    uint32_t flags;
+    uint32_t pins;     // outstanding cache_pin() handles, plus CACHE_PIN_EVICTING
+    uint8_t ref;       // CLOCK reference bit
+    uint8_t list;      // CACHE_LIST_* the frame is linked on
+} cache_frame_t;
+
+// Doubly linked list of frame (or ghost) indices
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t len;
+} cache_list_t;
+
+// Key evicted by ARC, remembered without its data
+typedef struct {
+    uint64_t key;
+    uint32_t next;     // also links the ghost free list
+    uint32_t prev;
+    uint8_t list;      // CACHE_GHOST_B1 or CACHE_GHOST_B2
+} cache_ghost_t;
+
+// Handle returned by cache_pin(). The frame cannot be evicted or reused until
+// the handle is passed to cache_unpin(), so data may be used in place.
+typedef struct {
+    char *data;        // page_size bytes of the cached page
+    uint64_t offset;
+    int obj;
+    uint32_t frame;
+    int write;         // pinned for writing, the page is dirtied again on unpin
+} cache_page_t;
+
+// Dirty page collected by the flusher
+typedef struct {
+    uint32_t obj;
+    uint32_t frame;
+    uint64_t offset;
+} cache_dirty_ref_t;
+
+// Backing file registered with cache_register(). Pages are keyed by
+// (object id, offset), so several files can share one cache.
+// A file opened with O_DIRECT bypasses the kernel page cache, so the cache is
+// the only copy of its pages in RAM; frames are page-aligned for it already.
+// An object registered with cache_register_store() keeps its pages compressed
+// in a block store and all its I/O goes through it.
+typedef struct {
+    int fd;            // -1 while the slot is free
+    int buffered_fd;   // same file without O_DIRECT for requests it rejects, or -1
+    block_store_t *store; // block store holding the pages, or NULL for a plain file
+    int sync_error;    // errno of a failed fdatasync(); sticky, since the kernel may
+                       // have dropped the dirty data it reported on
+    size_t quota;      // resident pages allowed, 0 = only bounded by capacity
+} cache_object_t;
+
+// A shard owns the keys hashing to it, their index and a contiguous slice of
+// the frame pool, so replacement never crosses shards.
+typedef struct {
+    pthread_mutex_t mutex; // serializes index and replacement updates
+    uint32_t seq;          // seqlock for lock-free readers, odd while updating
+    uint32_t first;        // pool slice [first, first + nframes)
+    uint32_t nframes;
+    uint32_t limit;        // frames usable at the current capacity, <= nframes
+    uint32_t free_head;
+    uint32_t hand;         // CLOCK hand, relative to first
+    int node;              // NUMA node holding the slice
+    cache_list_t list[CACHE_LISTS];
     size_t entry_count;
+    uint32_t obj_pages[CACHE_MAX_OBJECTS]; // resident pages per object
+    cache_index_t index;
+    // TinyLFU
+    cache_sketch_t sketch;
+    uint32_t window_max;
+    uint32_t protected_max;
+    // ARC
+    uint32_t arc_p;        // target size of T1
+    cache_ghost_t *ghosts; // nframes ghost entries
+    uint32_t ghost_free;
+    cache_list_t ghost[2];
+    cache_index_t ghost_index; // key -> ghost entry
+    // Compressed copies of pages evicted from this shard
+    cache_ztier_t ztier;
+} __attribute__((aligned(64))) cache_shard_t;
+
+// Geometry (page pool size, page size, shard count) is fixed by cache_init()
+typedef struct {
+    cache_shard_t *shard; // nshards shards
+    int nshards;
+    size_t page_size;
+    uint32_t nframes;     // frames in the page pool
+    cache_policy_t policy;
+    int numa_nodes;       // shard i lives on node i % numa_nodes
+    uint64_t numa_stripe;
+    page_pool_t pool;
+    int victim_ring;      // misses check the ring cache, evictions fill it
+    cache_frame_t *frames;
+    size_t capacity;
+    size_t dirty_count; // frames with CACHE_FRAME_DIRTY set, updated atomically
+    cache_stats_slot_t *stats; // CACHE_STATS_SLOTS slots, summed by cache_get_stats()
+    cache_object_t objects[CACHE_MAX_OBJECTS];
+    pthread_mutex_t object_mutex; // serializes registration
+    // Background write-back
+    pthread_t flusher;
+    int flusher_running;
+    int flusher_stop;
+    unsigned dirty_low_pct;
+    unsigned dirty_high_pct;
+    unsigned flush_interval_ms;
+    size_t dirty_low;  // watermarks in frames, derived from capacity
+    size_t dirty_high;
+    pthread_mutex_t flush_mutex; // held for a whole flush round
+    pthread_mutex_t flush_wait_mutex;
+    pthread_cond_t flush_cond;
+    cache_dirty_ref_t *flush_list;
+    uint32_t flush_cursor_obj;   // elevator position of the last round
+    uint64_t flush_cursor_off;
+    cache_flush_stats_t flush_stats;
+    // Durability
+    cache_durability_t durability;
+    pthread_t committer;          // group commit: issues the fdatasync() calls
+    int committer_running;
+    int committer_stop;
+    pthread_mutex_t commit_mutex;
+    pthread_cond_t commit_cond;   // wakes the committer
+    pthread_cond_t commit_done_cond; // wakes writers whose barrier has been served
+    uint64_t commit_seq;          // last barrier ticket handed out
+    uint64_t commit_done;         // tickets up to this one are on stable storage
+    uint8_t commit_pending[CACHE_MAX_OBJECTS]; // objects with writes since the last sync
+    cache_wal_t wal;              // CACHE_DURABILITY_WAL only
+    pthread_mutex_t wal_checkpoint_mutex;
+    int wal_checkpointing;        // a checkpoint is writing dirty pages home
+    // Warm restart
+    char *manifest_path;          // NULL when no manifest is kept
+    cache_manifest_t warmup;      // hot set left to prefetch, sorted by file and offset
+    int warmup_map[CACHE_MAX_OBJECTS]; // manifest object id -> registered id, -1 until seen
+    uint64_t warmup_rate;         // bytes per second
+    pthread_t warmup_thread;
+    int warmup_running;
+    int warmup_stop;
+    pthread_mutex_t warmup_mutex; // held while a prefetch batch is in flight
+    pthread_cond_t warmup_cond;
 } cache_t;
 
-void cache_init(cache_t *c);
-char* cache_get(cache_t *c, int fd, uint64_t offset, int write);
+void cache_config_default(cache_config_t *cfg);
+int cache_config_load(cache_config_t *cfg, const char *path);
+int cache_init(cache_t *c, const cache_config_t *cfg);
+int cache_home_node(const cache_t *c, uint64_t offset);
+int cache_register(cache_t *c, int fd, size_t quota);
+int cache_register_store(cache_t *c, block_store_t *bs, size_t quota);
+int cache_unregister(cache_t *c, int obj);
+int cache_set_quota(cache_t *c, int obj, size_t quota);
+int cache_flush(cache_t *c, int obj);
+int cache_sync(cache_t *c, int obj);
+char* cache_get(cache_t *c, int obj, uint64_t offset, int write);
+int cache_pin(cache_t *c, int obj, uint64_t offset, int write, cache_page_t *page);
+int cache_unpin(cache_t *c, cache_page_t *page);
+int cache_get_range(cache_t *c, int obj, uint64_t offset, uint32_t npages, int write, cache_page_t *pages);
+int cache_unpin_range(cache_t *c, cache_page_t *pages, uint32_t npages);
 void cache_evict(cache_t *c, int fd);
+int cache_set_capacity(cache_t *c, int fd, size_t entries);
+void cache_get_flush_stats(cache_t *c, cache_flush_stats_t *out);
+void cache_get_stats(cache_t *c, cache_stats_t *out);
+void cache_get_ztier_stats(cache_t *c, cache_ztier_stats_t *out);
+void cache_get_wal_stats(cache_t *c, cache_wal_stats_t *out);
+uint64_t cache_stats_percentile(const uint64_t *hist, double q);
 void cache_destroy(cache_t *c, int fd);
 
 #endif // CACHE_H
@@ -0,0 +1,212 @@
+// Индекс смещение -> фрейм для кэша PseudoCore
+#include "cache_index.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+
+// Match a control byte across one aligned group, one result bit per slot
+static inline uint32_t group_match(const uint8_t *g, uint8_t b) {
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_load_si128((const __m128i*)g);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < CACHE_INDEX_GROUP; i++) {
+        m |= (uint32_t)(g[i] == b) << i;
+    }
+    return m;
+#endif
+}
+
+// Slots that can take an insert: EMPTY and DELETED both have the top bit set
+static inline uint32_t group_match_free(const uint8_t *g) {
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)g));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < CACHE_INDEX_GROUP; i++) {
+        m |= (uint32_t)(g[i] >> 7) << i;
+    }
+    return m;
+#endif
+}
+
+static inline uint8_t hash_tag(uint32_t hash) {
+    return hash & 0x7F;
+}
+
+static inline uint32_t hash_group(uint32_t hash, uint32_t gmask) {
+    return (hash >> 7) & gmask;
+}
+
+// Smallest power-of-two group count keeping the load factor at or below 7/8
+static uint32_t groups_for(uint32_t entries) {
+    uint64_t slots = (uint64_t)entries * 8 / 7 + 1;
+    uint32_t groups = 1;
+    while ((uint64_t)groups * CACHE_INDEX_GROUP < slots) groups <<= 1;
+    return groups;
+}
+
+static void table_reset(cache_index_table_t *t) {
+    uint32_t capacity = (t->gmask + 1) * CACHE_INDEX_GROUP;
+    memset(t->ctrl, CTRL_EMPTY, capacity);
+    t->used = 0;
+    t->growth_left = capacity - capacity / 8;
+}
+
+static cache_index_table_t *table_alloc(uint32_t groups) {
+    cache_index_table_t *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    size_t capacity = (size_t)groups * CACHE_INDEX_GROUP;
+    // Control bytes first, then the slots starting on a cache line boundary
+    size_t ctrl_len = (capacity + 63) & ~(size_t)63;
+    t->ctrl = aligned_alloc(64, ctrl_len + capacity * sizeof(cache_slot_t));
+    if (!t->ctrl) {
+        free(t);
+        return NULL;
+    }
+    t->slots = (cache_slot_t*)(t->ctrl + ctrl_len);
+    t->gmask = groups - 1;
+    t->retired = NULL;
+    table_reset(t);
+    return t;
+}
+
+static void table_free(cache_index_table_t *t) {
+    free(t->ctrl);
+    free(t);
+}
+
+static void table_insert(cache_index_table_t *t, uint64_t key, uint32_t hash, uint32_t frame) {
+    uint32_t g = hash_group(hash, t->gmask);
+    for (uint32_t probe = 1;; probe++) {
+        uint8_t *ctrl = t->ctrl + (size_t)g * CACHE_INDEX_GROUP;
+        uint32_t m = group_match_free(ctrl);
+        if (m) {
+            int i = __builtin_ctz(m);
+            if (ctrl[i] == CTRL_EMPTY) t->growth_left--;
+            cache_slot_t *slot = &t->slots[(size_t)g * CACHE_INDEX_GROUP + i];
+            slot->key = key;
+            slot->frame = frame;
+            slot->hash = hash;
+            __atomic_store_n(&ctrl[i], hash_tag(hash), __ATOMIC_RELEASE);
+            t->used++;
+            return;
+        }
+        // Triangular probing visits every group of a power-of-two table
+        g = (g + probe) & t->gmask;
+    }
+}
+
+// Rebuild into a table large enough for 'entries', dropping tombstones.
+// Same-size rebuilds reuse the spare table so churn never leaks memory.
+static int rehash(cache_index_t *ix, uint32_t entries) {
+    cache_index_table_t *old = ix->table;
+    uint32_t groups = groups_for(entries);
+    if (groups < old->gmask + 1) groups = old->gmask + 1;
+    cache_index_table_t *t;
+    if (groups == old->gmask + 1 && ix->spare) {
+        t = ix->spare;
+        table_reset(t);
+    } else {
+        t = table_alloc(groups);
+        if (!t) return -1;
+    }
+    uint32_t capacity = (old->gmask + 1) * CACHE_INDEX_GROUP;
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (!(old->ctrl[i] & 0x80)) {
+            table_insert(t, old->slots[i].key, old->slots[i].hash, old->slots[i].frame);
+        }
+    }
+    __atomic_store_n(&ix->table, t, __ATOMIC_RELEASE);
+    if (groups == old->gmask + 1) {
+        ix->spare = old;
+    } else {
+        // Readers may still be probing the outgrown tables; keep them until destroy
+        old->retired = ix->retired;
+        ix->retired = old;
+        if (ix->spare) {
+            ix->spare->retired = ix->retired;
+            ix->retired = ix->spare;
+            ix->spare = NULL;
+        }
+    }
+    return 0;
+}
+
+int cache_index_init(cache_index_t *ix, uint32_t entries) {
+    ix->spare = NULL;
+    ix->retired = NULL;
+    ix->table = table_alloc(groups_for(entries));
+    return ix->table ? 0 : -1;
+}
+
+int cache_index_reserve(cache_index_t *ix, uint32_t entries) {
+    if (groups_for(entries) <= ix->table->gmask + 1) return 0;
+    return rehash(ix, entries);
+}
+
+uint32_t cache_index_find(const cache_index_t *ix, uint64_t key, uint32_t hash) {
+    const cache_index_table_t *t = __atomic_load_n(&ix->table, __ATOMIC_ACQUIRE);
+    uint32_t gmask = t->gmask;
+    uint32_t g = hash_group(hash, gmask);
+    uint8_t tag = hash_tag(hash);
+    for (uint32_t probe = 1; probe <= gmask + 1; probe++) {
+        const uint8_t *ctrl = t->ctrl + (size_t)g * CACHE_INDEX_GROUP;
+        for (uint32_t m = group_match(ctrl, tag); m; m &= m - 1) {
+            const cache_slot_t *slot = &t->slots[(size_t)g * CACHE_INDEX_GROUP + __builtin_ctz(m)];
+            if (slot->key == key) return slot->frame;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) break;
+        g = (g + probe) & gmask;
+    }
+    return CACHE_INDEX_NONE;
+}
+
+int cache_index_insert(cache_index_t *ix, uint64_t key, uint32_t hash, uint32_t frame) {
+    if (ix->table->growth_left == 0 && rehash(ix, ix->table->used + 1) != 0) return -1;
+    table_insert(ix->table, key, hash, frame);
+    return 0;
+}
+
+void cache_index_erase(cache_index_t *ix, uint64_t key, uint32_t hash) {
+    cache_index_table_t *t = ix->table;
+    uint32_t g = hash_group(hash, t->gmask);
+    uint8_t tag = hash_tag(hash);
+    for (uint32_t probe = 1; probe <= t->gmask + 1; probe++) {
+        uint8_t *ctrl = t->ctrl + (size_t)g * CACHE_INDEX_GROUP;
+        for (uint32_t m = group_match(ctrl, tag); m; m &= m - 1) {
+            int i = __builtin_ctz(m);
+            if (t->slots[(size_t)g * CACHE_INDEX_GROUP + i].key != key) continue;
+            // A group that still has an EMPTY slot has never been full, so no
+            // probe sequence continues past it and the slot can become EMPTY
+            if (group_match(ctrl, CTRL_EMPTY)) {
+                __atomic_store_n(&ctrl[i], CTRL_EMPTY, __ATOMIC_RELAXED);
+                t->growth_left++;
+            } else {
+                __atomic_store_n(&ctrl[i], CTRL_DELETED, __ATOMIC_RELAXED);
+            }
+            t->used--;
+            return;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) return;
+        g = (g + probe) & t->gmask;
+    }
+}
+
+void cache_index_destroy(cache_index_t *ix) {
+    while (ix->retired) {
+        cache_index_table_t *next = ix->retired->retired;
+        table_free(ix->retired);
+        ix->retired = next;
+    }
+    if (ix->spare) table_free(ix->spare);
+    if (ix->table) table_free(ix->table);
+    ix->table = NULL;
+    ix->spare = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef CACHE_INDEX_H
+#define CACHE_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_INDEX_NONE UINT32_MAX
+#define CACHE_INDEX_GROUP 16 // control bytes matched per SIMD compare
+
+// One 16-byte slot: four slots per cache line
+typedef struct {
+    uint64_t key;
+    uint32_t frame;
+    uint32_t hash; // low 32 bits of the key hash, reused on rehash
+} cache_slot_t;
+
+typedef struct cache_index_table {
+    uint8_t *ctrl;          // one control byte per slot: EMPTY, DELETED or a 7-bit tag
+    cache_slot_t *slots;
+    uint32_t gmask;         // number of groups - 1
+    uint32_t used;
+    uint32_t growth_left;   // inserts into EMPTY slots left before a rehash
+    struct cache_index_table *retired;
+} cache_index_table_t;
+
+// Open-addressing offset -> frame index (SwissTable-style groups of 16 control
+// bytes). find() may run concurrently with writers: tables are never freed or
+// shrunk while the index lives, so a torn probe reads valid memory and the
+// caller rejects it by its own seqlock. Writers must be serialized externally.
+typedef struct {
+    cache_index_table_t *table;  // current table, published with release
+    cache_index_table_t *spare;  // same size as table, reused to purge tombstones
+    cache_index_table_t *retired; // outgrown tables, freed by destroy
+} cache_index_t;
+
+int cache_index_init(cache_index_t *ix, uint32_t entries);
+int cache_index_reserve(cache_index_t *ix, uint32_t entries);
+uint32_t cache_index_find(const cache_index_t *ix, uint64_t key, uint32_t hash);
+int cache_index_insert(cache_index_t *ix, uint64_t key, uint32_t hash, uint32_t frame);
+void cache_index_erase(cache_index_t *ix, uint64_t key, uint32_t hash);
+void cache_index_destroy(cache_index_t *ix);
+
+#endif // CACHE_INDEX_H
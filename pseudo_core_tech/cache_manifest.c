@@ -0,0 +1,120 @@
+// Манифест горячих страниц кэша PseudoCore для теплого перезапуска
+#include "cache_manifest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MANIFEST_MAGIC "PCHOTSET"
+#define MANIFEST_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t nobjects;
+    uint32_t nentries;
+} manifest_header_t;
+
+static uint64_t checksum(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w <= 0) return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+// Write to a temporary file and rename it over the old manifest, so a crash
+// leaves either the previous manifest or the new one
+int cache_manifest_write(const char *path, const cache_manifest_t *m, uint32_t page_size) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    manifest_header_t hdr;
+    memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+    hdr.version = MANIFEST_VERSION;
+    hdr.page_size = page_size;
+    hdr.nobjects = m->nobjects;
+    hdr.nentries = m->nentries;
+    size_t objects_len = (size_t)m->nobjects * sizeof(cache_manifest_object_t);
+    size_t entries_len = (size_t)m->nentries * sizeof(cache_manifest_entry_t);
+    uint64_t sum = checksum(14695981039346656037ULL, &hdr, sizeof(hdr));
+    sum = checksum(sum, m->objects, objects_len);
+    sum = checksum(sum, m->entries, entries_len);
+    int rc = write_all(fd, &hdr, sizeof(hdr)) || write_all(fd, m->objects, objects_len) ||
+             write_all(fd, m->entries, entries_len) || write_all(fd, &sum, sizeof(sum)) || fsync(fd) ? -1 : 0;
+    close(fd);
+    if (rc == 0 && rename(tmp, path) == 0) return 0;
+    unlink(tmp);
+    return -1;
+}
+
+// Returns 0 with the manifest loaded, -1 if it is missing, unreadable, torn
+// or was written for another page size
+int cache_manifest_read(const char *path, cache_manifest_t *m, uint32_t page_size) {
+    memset(m, 0, sizeof(*m));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    manifest_header_t hdr;
+    uint64_t sum, stored;
+    if (read_all(fd, &hdr, sizeof(hdr)) != 0 || memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != MANIFEST_VERSION || hdr.page_size != page_size) {
+        close(fd);
+        return -1;
+    }
+    m->objects = malloc((size_t)hdr.nobjects * sizeof(cache_manifest_object_t) + 1);
+    m->entries = malloc((size_t)hdr.nentries * sizeof(cache_manifest_entry_t) + 1);
+    size_t objects_len = (size_t)hdr.nobjects * sizeof(cache_manifest_object_t);
+    size_t entries_len = (size_t)hdr.nentries * sizeof(cache_manifest_entry_t);
+    if (!m->objects || !m->entries || read_all(fd, m->objects, objects_len) != 0 ||
+        read_all(fd, m->entries, entries_len) != 0 || read_all(fd, &stored, sizeof(stored)) != 0) {
+        close(fd);
+        cache_manifest_free(m);
+        return -1;
+    }
+    close(fd);
+    sum = checksum(14695981039346656037ULL, &hdr, sizeof(hdr));
+    sum = checksum(sum, m->objects, objects_len);
+    sum = checksum(sum, m->entries, entries_len);
+    if (sum != stored) {
+        cache_manifest_free(m);
+        return -1;
+    }
+    m->nobjects = hdr.nobjects;
+    m->nentries = hdr.nentries;
+    return 0;
+}
+
+void cache_manifest_free(cache_manifest_t *m) {
+    free(m->objects);
+    free(m->entries);
+    m->objects = NULL;
+    m->entries = NULL;
+    m->nobjects = 0;
+    m->nentries = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_MANIFEST_H
+#define CACHE_MANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Backing file a manifest refers to, identified across restarts by device
+// and inode rather than by descriptor
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t obj;      // object id at the time the manifest was written
+    uint32_t reserved;
+} cache_manifest_object_t;
+
+// One hot page
+typedef struct {
+    uint64_t offset;
+    uint32_t obj;      // object id, matching a cache_manifest_object_t
+    uint32_t heat;     // policy-specific frequency estimate, higher is hotter
+} cache_manifest_entry_t;
+
+// Hot-set manifest written on shutdown and prefetched on the next start.
+// On disk: a header, the objects, the entries and a checksum over all of it,
+// replaced atomically with rename().
+typedef struct {
+    cache_manifest_object_t *objects;
+    uint32_t nobjects;
+    cache_manifest_entry_t *entries;
+    uint32_t nentries;
+} cache_manifest_t;
+
+int cache_manifest_write(const char *path, const cache_manifest_t *m, uint32_t page_size);
+int cache_manifest_read(const char *path, cache_manifest_t *m, uint32_t page_size);
+void cache_manifest_free(cache_manifest_t *m);
+
+#endif // CACHE_MANIFEST_H
@@ -0,0 +1,67 @@
+// Частотный скетч для политики вытеснения TinyLFU
+#include "cache_sketch.h"
+#include <stdlib.h>
+
+#define SKETCH_ROWS 4
+
+static const uint64_t row_seed[SKETCH_ROWS] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+// Counter of one row: word index in the upper bits, one of the row's four
+// nibbles in the lowest two
+static inline uint64_t row_hash(uint64_t hash, int row) {
+    uint64_t h = (hash ^ row_seed[row]) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+static inline unsigned counter_shift(uint64_t rh, int row) {
+    return (unsigned)(row * 4 + (rh & 3)) * 4;
+}
+
+int cache_sketch_init(cache_sketch_t *sk, uint32_t entries) {
+    uint32_t words = 1;
+    while (words < entries) words <<= 1;
+    sk->table = calloc(words, sizeof(uint64_t));
+    if (!sk->table) return -1;
+    sk->mask = words - 1;
+    sk->additions = 0;
+    // Ten samples per tracked entry, as in the TinyLFU paper
+    sk->sample = (entries ? entries : 1) * 10;
+    return 0;
+}
+
+void cache_sketch_increment(cache_sketch_t *sk, uint64_t hash) {
+    int added = 0;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        uint64_t rh = row_hash(hash, row);
+        uint64_t *w = &sk->table[(rh >> 32) & sk->mask];
+        unsigned shift = counter_shift(rh, row);
+        if (((*w >> shift) & 0xF) != 0xF) {
+            *w += 1ULL << shift;
+            added = 1;
+        }
+    }
+    if (added && ++sk->additions >= sk->sample) {
+        // Aging: halve every counter at once
+        for (uint32_t i = 0; i <= sk->mask; i++) {
+            sk->table[i] = (sk->table[i] >> 1) & 0x7777777777777777ULL;
+        }
+        sk->additions /= 2;
+    }
+}
+
+unsigned cache_sketch_estimate(const cache_sketch_t *sk, uint64_t hash) {
+    unsigned freq = 0xF;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        uint64_t rh = row_hash(hash, row);
+        unsigned v = (sk->table[(rh >> 32) & sk->mask] >> counter_shift(rh, row)) & 0xF;
+        if (v < freq) freq = v;
+    }
+    return freq;
+}
+
+void cache_sketch_destroy(cache_sketch_t *sk) {
+    free(sk->table);
+    sk->table = NULL;
+}
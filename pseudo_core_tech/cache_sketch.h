@@ -0,0 +1,22 @@
+#ifndef CACHE_SKETCH_H
+#define CACHE_SKETCH_H
+
+#include <stdint.h>
+
+// Count-min sketch of access frequencies with four rows of 4-bit counters,
+// used by the TinyLFU admission filter. Counters saturate at 15 and are all
+// halved once the sample period is reached, so old popularity fades out.
+// Not thread-safe: the caller serializes access.
+typedef struct {
+    uint64_t *table;     // 16 counters per word, each row owns 4 of them
+    uint32_t mask;       // number of words - 1
+    uint32_t additions;  // increments since the last halving
+    uint32_t sample;     // halve all counters after this many increments
+} cache_sketch_t;
+
+int cache_sketch_init(cache_sketch_t *sk, uint32_t entries);
+void cache_sketch_increment(cache_sketch_t *sk, uint64_t hash);
+unsigned cache_sketch_estimate(const cache_sketch_t *sk, uint64_t hash);
+void cache_sketch_destroy(cache_sketch_t *sk);
+
+#endif // CACHE_SKETCH_H
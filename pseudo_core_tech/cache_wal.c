@@ -0,0 +1,568 @@
+// Журнал упреждающей записи (WAL) грязных страниц кэша PseudoCore
+#define _GNU_SOURCE // posix_fallocate, readlink on /proc
+#include "cache_wal.h"
+#include "compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define WAL_MAGIC "PCWAL001"
+#define WAL_VERSION 1
+#define WAL_RECORD_MAGIC 0x4c415750u // "PWAL"
+#define WAL_PAGE 1                   // page image for obj at offset
+#define WAL_FILE 2                   // obj names the file dev/ino, payload is its path
+#define WAL_COMPRESSED 0x1           // payload is a compressed page image
+#define WAL_IOV 64                   // records per pwritev()
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t seq;      // 0 while the half holds nothing to replay
+    uint64_t sum;
+} wal_half_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t obj;
+    uint32_t len;         // payload bytes, padded to 8 in the log
+    uint64_t seq;         // sequence number of the half it was written to
+    uint64_t offset;      // WAL_PAGE: file offset, WAL_FILE: device
+    uint64_t ino;         // WAL_FILE: inode
+    uint64_t payload_sum;
+    uint64_t sum;         // over the header with sum = 0
+} wal_record_t;
+
+// Logged page found by the replay scan
+typedef struct {
+    uint32_t file;
+    uint32_t len;
+    uint16_t flags;
+    uint64_t offset;
+    uint64_t pos;      // payload position in the log
+    uint64_t order;    // log order
+} wal_replay_ref_t;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    char *path;
+    int fd;
+} wal_replay_file_t;
+
+static uint64_t wal_sum(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    for (; len > 0; p++, len--) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t record_size(size_t len) {
+    return sizeof(wal_record_t) + ((len + 7) & ~(size_t)7);
+}
+
+static void record_seal(wal_record_t *r, uint64_t seq) {
+    r->seq = seq;
+    r->sum = 0;
+    r->sum = wal_sum(14695981039346656037ULL, r, sizeof(*r));
+}
+
+static int record_valid(wal_record_t *r, uint64_t seq) {
+    uint64_t sum = r->sum;
+    r->sum = 0;
+    int ok = r->magic == WAL_RECORD_MAGIC && r->seq == seq && wal_sum(14695981039346656037ULL, r, sizeof(*r)) == sum;
+    r->sum = sum;
+    return ok;
+}
+
+static int header_write(cache_wal_t *w, int half, uint64_t seq) {
+    wal_half_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, WAL_MAGIC, sizeof(h.magic));
+    h.version = WAL_VERSION;
+    h.page_size = w->page_size;
+    h.seq = seq;
+    h.sum = wal_sum(14695981039346656037ULL, &h, sizeof(h));
+    return pwrite(w->fd, &h, sizeof(h), (off_t)(half * w->half)) == (ssize_t)sizeof(h) ? 0 : -1;
+}
+
+static int header_read(int fd, uint64_t half_size, int half, wal_half_header_t *h) {
+    if (pread(fd, h, sizeof(*h), (off_t)(half * half_size)) != (ssize_t)sizeof(*h)) return -1;
+    uint64_t sum = h->sum;
+    h->sum = 0;
+    int ok = memcmp(h->magic, WAL_MAGIC, sizeof(h->magic)) == 0 && h->version == WAL_VERSION && h->seq != 0 &&
+             h->page_size != 0 && wal_sum(14695981039346656037ULL, h, sizeof(*h)) == sum;
+    return ok ? 0 : -1;
+}
+
+static int replay_ref_cmp(const void *a, const void *b) {
+    const wal_replay_ref_t *x = a, *y = b;
+    if (x->file != y->file) return x->file < y->file ? -1 : 1;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Find the file a record names among those already seen, or add it
+static uint32_t replay_file(wal_replay_file_t **files, uint32_t *nfiles, uint64_t dev, uint64_t ino, const char *path) {
+    for (uint32_t i = 0; i < *nfiles; i++) {
+        if ((*files)[i].dev == dev && (*files)[i].ino == ino) return i;
+    }
+    wal_replay_file_t *grown = realloc(*files, (*nfiles + 1) * sizeof(wal_replay_file_t));
+    if (!grown) return UINT32_MAX;
+    *files = grown;
+    grown[*nfiles] = (wal_replay_file_t){ dev, ino, strdup(path), -1 };
+    return (*nfiles)++;
+}
+
+// Write the newest logged image of every page home, in file and offset order,
+// and sync the files. Halves are scanned oldest first, each up to its first
+// record that is torn or left from an earlier use of the half. Returns the
+// highest sequence number seen, or 0 when there was nothing to replay; pages
+// that could not be written are counted in stats.replay_lost.
+static uint64_t wal_replay(cache_wal_t *w, uint64_t half_size) {
+    wal_half_header_t hdr[2];
+    int valid[2];
+    for (int h = 0; h < 2; h++) {
+        valid[h] = header_read(w->fd, half_size, h, &hdr[h]) == 0;
+    }
+    int order[2] = { 0, 1 };
+    if (valid[0] && valid[1] && hdr[1].seq < hdr[0].seq) {
+        order[0] = 1;
+        order[1] = 0;
+    }
+    uint64_t max_seq = 0;
+    wal_replay_ref_t *refs = NULL;
+    size_t nrefs = 0, cap = 0;
+    wal_replay_file_t *files = NULL;
+    uint32_t nfiles = 0;
+    uint32_t page_size = 0;
+    char *payload = NULL;
+    for (int k = 0; k < 2; k++) {
+        int h = order[k];
+        if (!valid[h]) continue;
+        // All halves are replayed with one page size, a change of it is logged anew
+        if (page_size && hdr[h].page_size != page_size) continue;
+        page_size = hdr[h].page_size;
+        if (!payload && !(payload = malloc(page_size > PATH_MAX ? page_size : PATH_MAX))) break;
+        if (hdr[h].seq > max_seq) max_seq = hdr[h].seq;
+        uint32_t map[CACHE_WAL_MAX_FILES];
+        memset(map, 0xff, sizeof(map));
+        uint64_t base = (uint64_t)h * half_size, pos = CACHE_WAL_HEADER;
+        wal_record_t r;
+        while (pos + sizeof(r) <= half_size && pread(w->fd, &r, sizeof(r), (off_t)(base + pos)) == (ssize_t)sizeof(r)) {
+            if (!record_valid(&r, hdr[h].seq) || r.obj >= CACHE_WAL_MAX_FILES ||
+                r.len > (r.type == WAL_FILE ? PATH_MAX : page_size) || pos + record_size(r.len) > half_size) break;
+            if (pread(w->fd, payload, r.len, (off_t)(base + pos + sizeof(r))) != (ssize_t)r.len ||
+                wal_sum(14695981039346656037ULL, payload, r.len) != r.payload_sum) break;
+            if (r.type == WAL_FILE) {
+                payload[r.len ? r.len - 1 : 0] = '\0';
+                map[r.obj] = replay_file(&files, &nfiles, r.offset, r.ino, payload);
+            } else if (r.type == WAL_PAGE) {
+                if (nrefs == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    wal_replay_ref_t *grown = realloc(refs, cap * sizeof(wal_replay_ref_t));
+                    if (!grown) {
+                        w->stats.replay_lost++;
+                        break;
+                    }
+                    refs = grown;
+                }
+                if (map[r.obj] == UINT32_MAX) {
+                    w->stats.replay_lost++;
+                } else {
+                    refs[nrefs] = (wal_replay_ref_t){ map[r.obj], r.len, r.flags, r.offset, base + pos + sizeof(r), nrefs };
+                    nrefs++;
+                }
+            }
+            pos += record_size(r.len);
+        }
+    }
+    qsort(refs, nrefs, sizeof(wal_replay_ref_t), replay_ref_cmp);
+    char *page = page_size ? malloc(page_size) : NULL;
+    for (size_t i = 0; i < nrefs && page; i++) {
+        const wal_replay_ref_t *ref = &refs[i];
+        // Only the newest image of a page is written
+        if (i + 1 < nrefs && refs[i + 1].file == ref->file && refs[i + 1].offset == ref->offset) continue;
+        wal_replay_file_t *f = &files[ref->file];
+        if (f->fd == -1) {
+            struct stat st;
+            f->fd = f->path ? open(f->path, O_RDWR) : -1;
+            if (f->fd >= 0 && (fstat(f->fd, &st) != 0 || (uint64_t)st.st_dev != f->dev || (uint64_t)st.st_ino != f->ino)) {
+                close(f->fd);
+                f->fd = -1;
+            }
+            if (f->fd < 0) f->fd = -2;
+        }
+        int ok = f->fd >= 0 && pread(w->fd, payload, ref->len, (off_t)ref->pos) == (ssize_t)ref->len;
+        if (ok && (ref->flags & WAL_COMPRESSED)) {
+            ok = decompress_page(payload, ref->len, page, page_size) == (int)page_size;
+        } else if (ok) {
+            memcpy(page, payload, page_size);
+        }
+        if (ok && pwrite(f->fd, page, page_size, (off_t)ref->offset) == (ssize_t)page_size) {
+            w->stats.replayed++;
+        } else {
+            w->stats.replay_lost++;
+        }
+    }
+    if (nrefs && !page) w->stats.replay_lost += nrefs;
+    for (uint32_t i = 0; i < nfiles; i++) {
+        if (files[i].fd >= 0) {
+            if (fdatasync(files[i].fd) != 0) w->stats.replay_lost++;
+            close(files[i].fd);
+        }
+        free(files[i].path);
+    }
+    free(files);
+    free(refs);
+    free(page);
+    free(payload);
+    return max_seq;
+}
+
+static void scratch_release(cache_wal_t *w) {
+    for (int i = 0; i < CACHE_WAL_SCRATCH; i++) {
+        free(w->scratch[i].records);
+        free(w->scratch[i].compressed);
+        w->scratch[i].records = w->scratch[i].compressed = NULL;
+    }
+}
+
+// Open the log at path, replay what an unclean shutdown left in it and start
+// it afresh with 'bytes' bytes split in two halves. Returns -1 if the log
+// cannot be used, or if some logged page could not be written home; the log
+// is then left as it was, so that the pages are not lost.
+int cache_wal_open(cache_wal_t *w, const char *path, size_t bytes, uint32_t page_size) {
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    w->page_size = page_size;
+    w->half = bytes / 2 & ~(uint64_t)4095;
+    // A half takes at least a file record and a page of every object
+    if (w->half < CACHE_WAL_HEADER + 2 * (record_size(page_size) + record_size(PATH_MAX))) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    w->fd = fd;
+    uint64_t seq = 0;
+    if (st.st_size >= 2 * CACHE_WAL_HEADER) seq = wal_replay(w, (uint64_t)st.st_size / 2 & ~(uint64_t)4095);
+    if (w->stats.replay_lost) {
+        close(fd);
+        w->fd = -1;
+        errno = EIO;
+        return -1;
+    }
+    // Blocks are allocated up front, so a sync does not wait on block allocation
+    if ((uint64_t)st.st_size != 2 * w->half && ftruncate(fd, (off_t)(2 * w->half)) != 0) {
+        close(fd);
+        w->fd = -1;
+        return -1;
+    }
+    posix_fallocate(fd, 0, (off_t)(2 * w->half));
+    if (header_write(w, 0, seq + 1) != 0 || header_write(w, 1, 0) != 0 || fdatasync(fd) != 0) {
+        close(fd);
+        w->fd = -1;
+        return -1;
+    }
+    // Records are prepared in a bounded batch, whatever the page size
+    w->batch = CACHE_WAL_BATCH_BYTES / page_size;
+    if (w->batch == 0) w->batch = 1;
+    if (w->batch > WAL_IOV) w->batch = WAL_IOV;
+    for (int i = 0; i < CACHE_WAL_SCRATCH; i++) {
+        w->scratch[i].records = malloc((size_t)w->batch * record_size(page_size));
+        w->scratch[i].compressed = malloc((size_t)w->batch * compress_bound(page_size));
+        if (!w->scratch[i].records || !w->scratch[i].compressed) {
+            scratch_release(w);
+            close(fd);
+            w->fd = -1;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    w->scratch_free = (1u << CACHE_WAL_SCRATCH) - 1;
+    w->active = 0;
+    w->seq = seq + 1;
+    w->head = CACHE_WAL_HEADER;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_mutex_init(&w->scratch_mutex, NULL);
+    pthread_cond_init(&w->scratch_cond, NULL);
+    return 0;
+}
+
+// Name the file behind object id obj, or forget it when fd is negative.
+// Replay finds the file again by the path it had when it was registered.
+int cache_wal_file(cache_wal_t *w, uint32_t obj, int fd) {
+    if (obj >= CACHE_WAL_MAX_FILES) return -1;
+    char link[64], path[PATH_MAX];
+    struct stat st;
+    ssize_t len = -1;
+    if (fd >= 0) {
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        len = readlink(link, path, sizeof(path) - 1);
+        if (len < 0 || fstat(fd, &st) != 0) return -1;
+        path[len] = '\0';
+    }
+    pthread_mutex_lock(&w->mutex);
+    cache_wal_file_t *f = &w->files[obj];
+    free(f->path);
+    f->path = fd >= 0 ? strdup(path) : NULL;
+    f->dev = fd >= 0 ? (uint64_t)st.st_dev : 0;
+    f->ino = fd >= 0 ? (uint64_t)st.st_ino : 0;
+    w->logged[obj] = 0;
+    pthread_mutex_unlock(&w->mutex);
+    return fd >= 0 && !f->path ? -1 : 0;
+}
+
+// Make the other half active and leave this one closed - caller holds the mutex
+static int wal_switch(cache_wal_t *w) {
+    int next = !w->active;
+    if (header_write(w, next, w->seq + 1) != 0) return -1;
+    w->active = next;
+    w->seq++;
+    w->head = CACHE_WAL_HEADER;
+    w->closed = 1;
+    memset(w->logged, 0, sizeof(w->logged));
+    return 0;
+}
+
+// Write the gathered records at the head - caller holds the mutex
+static int wal_write(cache_wal_t *w, struct iovec *iov, int *cnt, size_t *len) {
+    if (*cnt == 0) return 0;
+    ssize_t written = pwritev(w->fd, iov, *cnt, (off_t)((uint64_t)w->active * w->half + w->head));
+    w->stats.appends++;
+    if (written != (ssize_t)*len) return -1;
+    w->head += *len;
+    w->stats.log_bytes += *len;
+    *cnt = 0;
+    *len = 0;
+    return 0;
+}
+
+// Take a free scratch set, waiting while every one is in use
+static cache_wal_scratch_t *scratch_take(cache_wal_t *w) {
+    pthread_mutex_lock(&w->scratch_mutex);
+    while (!w->scratch_free) {
+        pthread_cond_wait(&w->scratch_cond, &w->scratch_mutex);
+    }
+    int i = __builtin_ctz(w->scratch_free);
+    w->scratch_free &= ~(1u << i);
+    pthread_mutex_unlock(&w->scratch_mutex);
+    return &w->scratch[i];
+}
+
+static void scratch_put(cache_wal_t *w, cache_wal_scratch_t *sc) {
+    pthread_mutex_lock(&w->scratch_mutex);
+    w->scratch_free |= 1u << (sc - w->scratch);
+    pthread_cond_signal(&w->scratch_cond);
+    pthread_mutex_unlock(&w->scratch_mutex);
+}
+
+// Log up to w->batch pages prepared in sc, as cache_wal_append()
+static int wal_append_batch(cache_wal_t *w, cache_wal_scratch_t *sc, const cache_wal_page_t *pages, uint32_t n) {
+    // Compression and payload checksums are done before taking the mutex, the
+    // whole batch with one compression context
+    size_t bound = compress_bound(w->page_size);
+    size_t at[WAL_IOV + 1];
+    const char *src[WAL_IOV];
+    int lens[WAL_IOV];
+    char *buf = sc->records;
+    char *scratch = sc->compressed;
+    for (uint32_t i = 0; i < n; i++) {
+        src[i] = pages[i].data;
+    }
+    compress_pages(src, n, w->page_size, scratch, bound, lens, 1);
+    size_t pos = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        wal_record_t *r = (wal_record_t *)(buf + pos);
+        char *payload = buf + pos + sizeof(*r);
+        memset(r, 0, sizeof(*r));
+        r->magic = WAL_RECORD_MAGIC;
+        r->type = WAL_PAGE;
+        r->obj = pages[i].obj;
+        r->offset = pages[i].offset;
+        if (lens[i] > 0 && (size_t)lens[i] < w->page_size) {
+            memcpy(payload, scratch + i * bound, lens[i]);
+            r->len = (uint32_t)lens[i];
+            r->flags = WAL_COMPRESSED;
+        } else {
+            memcpy(payload, pages[i].data, w->page_size);
+            r->len = w->page_size;
+        }
+        memset(payload + r->len, 0, record_size(r->len) - sizeof(*r) - r->len);
+        r->payload_sum = wal_sum(14695981039346656037ULL, payload, r->len);
+        at[i] = pos;
+        pos += record_size(r->len);
+    }
+    at[n] = pos;
+
+    struct iovec iov[WAL_IOV];
+    int cnt = 0;
+    size_t len = 0;
+    uint32_t done = 0;
+    int rc = 0;
+    pthread_mutex_lock(&w->mutex);
+    for (; done < n && !w->sync_error; done++) {
+        wal_record_t *r = (wal_record_t *)(buf + at[done]);
+        size_t rlen = at[done + 1] - at[done];
+        if (r->obj >= CACHE_WAL_MAX_FILES || !w->files[r->obj].path) {
+            rc = -1;
+            break;
+        }
+        size_t flen = w->logged[r->obj] ? 0 : record_size(strlen(w->files[r->obj].path) + 1);
+        if (w->head + len + flen + rlen > w->half) {
+            if (wal_write(w, iov, &cnt, &len) != 0) {
+                rc = -1;
+                break;
+            }
+            if (w->closed) break;
+            if (wal_switch(w) != 0) {
+                rc = -1;
+                break;
+            }
+            flen = record_size(strlen(w->files[r->obj].path) + 1);
+        }
+        if (flen) {
+            // The file record goes first, it names the file for the replay
+            const cache_wal_file_t *f = &w->files[r->obj];
+            wal_record_t fr;
+            memset(&fr, 0, sizeof(fr));
+            fr.magic = WAL_RECORD_MAGIC;
+            fr.type = WAL_FILE;
+            fr.obj = r->obj;
+            fr.len = (uint32_t)strlen(f->path) + 1;
+            fr.offset = f->dev;
+            fr.ino = f->ino;
+            fr.payload_sum = wal_sum(14695981039346656037ULL, f->path, fr.len);
+            record_seal(&fr, w->seq);
+            static const char pad[8];
+            struct iovec fiov[3] = { { &fr, sizeof(fr) }, { f->path, fr.len }, { (void *)pad, flen - sizeof(fr) - fr.len } };
+            int fcnt = 3;
+            if (wal_write(w, iov, &cnt, &len) != 0 || wal_write(w, fiov, &fcnt, &flen) != 0) {
+                rc = -1;
+                break;
+            }
+            w->logged[r->obj] = 1;
+        }
+        record_seal(r, w->seq);
+        w->stats.compressed += r->flags & WAL_COMPRESSED;
+        iov[cnt].iov_base = r;
+        iov[cnt].iov_len = rlen;
+        cnt++;
+        len += rlen;
+        if (cnt == WAL_IOV && wal_write(w, iov, &cnt, &len) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (rc == 0 && wal_write(w, iov, &cnt, &len) != 0) rc = -1;
+    if (rc != 0 && !w->sync_error) w->sync_error = errno ? errno : EIO;
+    if (w->sync_error) rc = -1;
+    if (rc == 0) {
+        w->stats.records += done;
+        w->stats.page_bytes += (uint64_t)done * w->page_size;
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return rc == 0 ? (int)done : -1;
+}
+
+// Append page images, compressed where that makes them smaller. Records are
+// written in order at the head of the active half, switching to the other
+// half when it is free. Returns the number of pages logged, fewer than n when
+// both halves are full until the closed one is retired, or -1 if the log
+// could not be written.
+int cache_wal_append(cache_wal_t *w, const cache_wal_page_t *pages, uint32_t n) {
+    cache_wal_scratch_t *sc = scratch_take(w);
+    uint32_t done = 0;
+    int rc = 0;
+    while (done < n) {
+        uint32_t k = n - done < w->batch ? n - done : w->batch;
+        int logged = wal_append_batch(w, sc, pages + done, k);
+        if (logged < 0) {
+            rc = -1;
+            break;
+        }
+        done += (uint32_t)logged;
+        if ((uint32_t)logged < k) break;
+    }
+    scratch_put(w, sc);
+    return rc == 0 ? (int)done : -1;
+}
+
+// Make everything appended so far durable
+int cache_wal_sync(cache_wal_t *w) {
+    int rc = fdatasync(w->fd);
+    pthread_mutex_lock(&w->mutex);
+    w->stats.syncs++;
+    if (rc != 0 && !w->sync_error) w->sync_error = errno;
+    rc = w->sync_error ? -1 : 0;
+    pthread_mutex_unlock(&w->mutex);
+    return rc;
+}
+
+// Start a checkpoint: close the active half unless it is empty. Returns 1 if
+// there is a closed half, whose pages the caller writes home and syncs before
+// calling cache_wal_retire(); records appended from now on go to the other
+// half.
+int cache_wal_close_half(cache_wal_t *w) {
+    pthread_mutex_lock(&w->mutex);
+    int rc = w->closed;
+    if (!rc && w->head > CACHE_WAL_HEADER && !w->sync_error) rc = wal_switch(w) == 0;
+    pthread_mutex_unlock(&w->mutex);
+    return rc;
+}
+
+// The pages logged in the closed half are home: free it. The header is not
+// synced, as replaying a retired half again only rewrites what is home.
+void cache_wal_retire(cache_wal_t *w) {
+    pthread_mutex_lock(&w->mutex);
+    if (w->closed && header_write(w, !w->active, 0) == 0) {
+        w->closed = 0;
+        w->stats.checkpoints++;
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// Bytes used in the active half, counting a closed half as full
+uint64_t cache_wal_fill(cache_wal_t *w) {
+    pthread_mutex_lock(&w->mutex);
+    uint64_t used = w->closed ? w->half : w->head - CACHE_WAL_HEADER;
+    pthread_mutex_unlock(&w->mutex);
+    return used;
+}
+
+// With 'clean' every logged page is known to be home and synced, and the log
+// is emptied, so the next open has nothing to replay
+void cache_wal_close(cache_wal_t *w, int clean) {
+    if (w->fd < 0) return;
+    if (clean && header_write(w, 0, 0) == 0 && header_write(w, 1, 0) == 0) fdatasync(w->fd);
+    close(w->fd);
+    w->fd = -1;
+    for (int i = 0; i < CACHE_WAL_MAX_FILES; i++) {
+        free(w->files[i].path);
+        w->files[i].path = NULL;
+    }
+    scratch_release(w);
+    pthread_cond_destroy(&w->scratch_cond);
+    pthread_mutex_destroy(&w->scratch_mutex);
+    pthread_mutex_destroy(&w->mutex);
+}
@@ -0,0 +1,82 @@
+#ifndef CACHE_WAL_H
+#define CACHE_WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define CACHE_WAL_MAX_FILES 256 // object ids the log can name
+#define CACHE_WAL_HEADER 4096   // bytes reserved at the start of each half
+#define CACHE_WAL_SCRATCH 4     // appends that can prepare records at the same time
+#define CACHE_WAL_BATCH_BYTES (1u << 20) // page bytes an append prepares at a time
+
+// A written page to log
+typedef struct {
+    uint32_t obj;
+    uint64_t offset;
+    const char *data;  // page_size bytes
+} cache_wal_page_t;
+
+typedef struct {
+    uint64_t records;      // page images appended
+    uint64_t compressed;   // of which stored compressed
+    uint64_t page_bytes;   // image bytes before compression
+    uint64_t log_bytes;    // bytes appended, headers included
+    uint64_t appends;      // pwritev() calls
+    uint64_t syncs;        // fdatasync() calls
+    uint64_t checkpoints;  // halves retired after their pages reached home
+    uint64_t replayed;     // pages written home by the last replay
+    uint64_t replay_lost;  // logged pages whose file could not be found on replay
+} cache_wal_stats_t;
+
+// Buffers an append prepares records in, kept for the life of the log
+typedef struct {
+    char *records;     // batch records of a page
+    char *compressed;  // batch compression outputs of compress_bound(page_size)
+} cache_wal_scratch_t;
+
+// Who a log record's object id referred to when it was written
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    char *path;        // NULL while the id is unused
+} cache_wal_file_t;
+
+// Write-ahead log of dirty page images. The log file is split in two halves
+// that are appended to in turn: records go to the active half and are durable
+// after cache_wal_sync(). When the active half fills up it is closed and the
+// other one takes over; a closed half is retired by cache_wal_retire() once
+// every page logged in it has been written home and synced. Each half starts
+// with a header carrying a sequence number that every record in it repeats,
+// so records left from an earlier use of the half are not mistaken for new
+// ones, and each record carries checksums that reject a torn tail.
+typedef struct {
+    int fd;
+    uint32_t page_size;
+    uint64_t half;              // bytes per half
+    int active;                 // half being appended to
+    uint64_t seq;               // sequence number of the active half
+    uint64_t head;              // append position in the active half
+    int closed;                 // the other half still holds records not known to be home
+    int sync_error;             // errno of a failed write or fdatasync, sticky
+    cache_wal_file_t files[CACHE_WAL_MAX_FILES];
+    uint8_t logged[CACHE_WAL_MAX_FILES]; // file record already in the active half
+    pthread_mutex_t mutex;      // serializes appends and half switches
+    uint32_t batch;             // pages an append prepares at a time
+    cache_wal_scratch_t scratch[CACHE_WAL_SCRATCH];
+    uint32_t scratch_free;      // bit per scratch set not in use
+    pthread_mutex_t scratch_mutex;
+    pthread_cond_t scratch_cond;
+    cache_wal_stats_t stats;
+} cache_wal_t;
+
+int cache_wal_open(cache_wal_t *w, const char *path, size_t bytes, uint32_t page_size);
+int cache_wal_file(cache_wal_t *w, uint32_t obj, int fd);
+int cache_wal_append(cache_wal_t *w, const cache_wal_page_t *pages, uint32_t n);
+int cache_wal_sync(cache_wal_t *w);
+int cache_wal_close_half(cache_wal_t *w);
+void cache_wal_retire(cache_wal_t *w);
+uint64_t cache_wal_fill(cache_wal_t *w);
+void cache_wal_close(cache_wal_t *w, int clean);
+
+#endif // CACHE_WAL_H
@@ -0,0 +1,373 @@
+// Сжатый уровень кэша PseudoCore для вытесненных страниц
+#include "cache_ztier.h"
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_END 0xFFFF
+
+static inline size_t class_size(const cache_ztier_t *z, uint32_t cls) {
+    return (size_t)(cls + 1) * z->step;
+}
+
+static inline uint16_t class_slots(const cache_ztier_t *z, uint32_t cls) {
+    return (uint16_t)(z->slab_size / class_size(z, cls));
+}
+
+static inline char *slot_mem(const cache_ztier_t *z, uint32_t sl, uint16_t slot) {
+    return z->slabs[sl].mem + (size_t)slot * class_size(z, z->slabs[sl].cls);
+}
+
+static void partial_push(cache_ztier_t *z, uint32_t sl) {
+    cache_zslab_t *b = &z->slabs[sl];
+    b->prev = CACHE_ZTIER_NIL;
+    b->next = z->partial[b->cls];
+    if (b->next != CACHE_ZTIER_NIL) z->slabs[b->next].prev = sl;
+    z->partial[b->cls] = sl;
+}
+
+static void partial_unlink(cache_ztier_t *z, uint32_t sl) {
+    cache_zslab_t *b = &z->slabs[sl];
+    if (b->prev != CACHE_ZTIER_NIL) z->slabs[b->prev].next = b->next;
+    else z->partial[b->cls] = b->next;
+    if (b->next != CACHE_ZTIER_NIL) z->slabs[b->next].prev = b->prev;
+}
+
+// Memory counted against the budget
+static size_t held_bytes(const cache_ztier_t *z) {
+    return z->stats.slab_bytes + z->stats.filled * sizeof(cache_zentry_t);
+}
+
+static int entry_filled(const cache_zentry_t *ent) {
+    return ent->codec == COMPRESS_CODEC_ZERO || ent->codec == COMPRESS_CODEC_SAME;
+}
+
+static int entry_decompress(cache_ztier_t *z, const cache_zentry_t *ent, char *page) {
+    compress_tag_t tag = { ent->codec, ent->word, (int)ent->len };
+    const char *in = entry_filled(ent) ? NULL : slot_mem(z, ent->slab, ent->slot);
+    return decompress_tagged(&tag, in, page, z->page_size) == (int)z->page_size;
+}
+
+// Start a slab for a class, or return NIL once the budget is used up
+static uint32_t slab_new(cache_ztier_t *z, uint32_t cls) {
+    if (z->slab_unused == CACHE_ZTIER_NIL || held_bytes(z) + z->slab_size > z->budget) return CACHE_ZTIER_NIL;
+    char *mem = malloc(z->slab_size);
+    if (!mem) return CACHE_ZTIER_NIL;
+    uint32_t sl = z->slab_unused;
+    cache_zslab_t *b = &z->slabs[sl];
+    z->slab_unused = b->next;
+    b->mem = mem;
+    b->cls = cls;
+    b->used = 0;
+    b->free_slot = 0;
+    uint16_t n = class_slots(z, cls);
+    for (uint16_t i = 0; i < n; i++) {
+        uint16_t next = i + 1 < n ? i + 1 : SLOT_END;
+        memcpy(mem + (size_t)i * class_size(z, cls), &next, sizeof(next));
+    }
+    partial_push(z, sl);
+    z->stats.slab_bytes += z->slab_size;
+    return sl;
+}
+
+static int slot_take(cache_ztier_t *z, uint32_t cls, uint32_t *sl_out, uint16_t *slot_out) {
+    uint32_t sl = z->partial[cls];
+    if (sl == CACHE_ZTIER_NIL) sl = slab_new(z, cls);
+    if (sl == CACHE_ZTIER_NIL) return -1;
+    cache_zslab_t *b = &z->slabs[sl];
+    uint16_t slot = b->free_slot;
+    memcpy(&b->free_slot, slot_mem(z, sl, slot), sizeof(b->free_slot));
+    if (++b->used == class_slots(z, cls)) partial_unlink(z, sl);
+    *sl_out = sl;
+    *slot_out = slot;
+    return 0;
+}
+
+// Return a slot; a slab left empty goes back to the allocator, so memory
+// moves between classes as the compressibility of the data changes
+static void slot_free(cache_ztier_t *z, uint32_t sl, uint16_t slot) {
+    cache_zslab_t *b = &z->slabs[sl];
+    if (b->used == class_slots(z, b->cls)) partial_push(z, sl);
+    memcpy(slot_mem(z, sl, slot), &b->free_slot, sizeof(b->free_slot));
+    b->free_slot = slot;
+    if (--b->used > 0) return;
+    partial_unlink(z, sl);
+    free(b->mem);
+    b->mem = NULL;
+    b->next = z->slab_unused;
+    z->slab_unused = sl;
+    z->stats.slab_bytes -= z->slab_size;
+}
+
+static uint32_t entry_new(cache_ztier_t *z) {
+    if (z->entry_free == CACHE_ZTIER_NIL) {
+        uint32_t cap = z->entries_cap ? z->entries_cap * 2 : 256;
+        cache_zentry_t *grown = realloc(z->entries, (size_t)cap * sizeof(cache_zentry_t));
+        if (!grown) return CACHE_ZTIER_NIL;
+        z->entries = grown;
+        for (uint32_t e = cap; e-- > z->entries_cap;) {
+            z->entries[e].lru_next = z->entry_free;
+            z->entry_free = e;
+        }
+        z->entries_cap = cap;
+    }
+    uint32_t e = z->entry_free;
+    z->entry_free = z->entries[e].lru_next;
+    return e;
+}
+
+static void lru_push_head(cache_ztier_t *z, uint32_t e) {
+    cache_zentry_t *ent = &z->entries[e];
+    ent->lru_prev = CACHE_ZTIER_NIL;
+    ent->lru_next = z->lru_head;
+    if (z->lru_head != CACHE_ZTIER_NIL) z->entries[z->lru_head].lru_prev = e;
+    z->lru_head = e;
+    if (z->lru_tail == CACHE_ZTIER_NIL) z->lru_tail = e;
+}
+
+static void lru_unlink(cache_ztier_t *z, uint32_t e) {
+    cache_zentry_t *ent = &z->entries[e];
+    if (ent->lru_prev != CACHE_ZTIER_NIL) z->entries[ent->lru_prev].lru_next = ent->lru_next;
+    else z->lru_head = ent->lru_next;
+    if (ent->lru_next != CACHE_ZTIER_NIL) z->entries[ent->lru_next].lru_prev = ent->lru_prev;
+    else z->lru_tail = ent->lru_prev;
+}
+
+static void entry_remove(cache_ztier_t *z, uint32_t e) {
+    cache_zentry_t *ent = &z->entries[e];
+    cache_index_erase(&z->index, ent->key, ent->hash);
+    lru_unlink(z, e);
+    ent->writing = 0;
+    if (entry_filled(ent)) z->stats.filled--;
+    else slot_free(z, ent->slab, ent->slot);
+    z->stats.pages--;
+    z->stats.bytes -= ent->len;
+    ent->lru_next = z->entry_free;
+    z->entry_free = e;
+}
+
+// Write a dirty entry back through the owner's callback
+static int entry_write(cache_ztier_t *z, cache_zentry_t *ent) {
+    if (!entry_decompress(z, ent, z->page) || z->writeback(z->arg, ent->key, z->page) != 0) {
+        z->stats.write_errors++;
+        return -1;
+    }
+    z->stats.written++;
+    ent->dirty = 0;
+    return 0;
+}
+
+// Push the least recently stored entry out to the backing file. A dirty
+// entry that could not be written stays at the tail; returns -1 then.
+static int demote_tail(cache_ztier_t *z) {
+    uint32_t e = z->lru_tail;
+    if (z->entries[e].dirty && entry_write(z, &z->entries[e]) != 0) return -1;
+    z->stats.demoted++;
+    entry_remove(z, e);
+    return 0;
+}
+
+// A budget below one slab leaves the tier disabled: stores are refused and
+// loads always miss. Class granularity and slab size scale with the page
+// size, so every page size gets the same classes and slots per slab.
+int cache_ztier_init(cache_ztier_t *z, size_t budget, int codec_budget, size_t page_size, cache_ztier_writeback_t writeback, void *arg) {
+    memset(z, 0, sizeof(*z));
+    z->codec_budget = codec_budget;
+    z->page_size = page_size;
+    z->step = CACHE_ZTIER_STEP * (page_size / CACHE_ZTIER_PAGE);
+    z->slab_size = CACHE_ZTIER_SLAB * (page_size / CACHE_ZTIER_PAGE);
+    z->classes = z->step ? page_size * 3 / 4 / z->step : 0;
+    z->entry_free = CACHE_ZTIER_NIL;
+    z->lru_head = z->lru_tail = CACHE_ZTIER_NIL;
+    z->slab_unused = CACHE_ZTIER_NIL;
+    z->writeback = writeback;
+    z->arg = arg;
+    if (budget < z->slab_size || z->classes == 0) return 0;
+    z->nslabs = budget / z->slab_size;
+    z->slabs = calloc(z->nslabs, sizeof(cache_zslab_t));
+    z->partial = malloc(z->classes * sizeof(uint32_t));
+    z->scratch = malloc(compress_bound(page_size));
+    // Written back directly, so aligned for files opened with O_DIRECT
+    z->page = aligned_alloc(page_size, page_size);
+    if (!z->slabs || !z->partial || !z->scratch || !z->page || cache_index_init(&z->index, 256) != 0) {
+        cache_ztier_destroy(z);
+        return -1;
+    }
+    for (uint32_t sl = z->nslabs; sl-- > 0;) {
+        z->slabs[sl].next = z->slab_unused;
+        z->slab_unused = sl;
+    }
+    for (uint32_t cls = 0; cls < z->classes; cls++) {
+        z->partial[cls] = CACHE_ZTIER_NIL;
+    }
+    z->budget = budget;
+    return 0;
+}
+
+// Keep a copy of a page evicted from the block cache. Returns 1 if it was
+// stored, 0 if the caller still owns it: the tier is off, the page does not
+// compress well enough, or no memory could be found. A dirty entry in the
+// way that cannot be written back is kept and the page refused, and with
+// 'deferred' set one is not written at all. A zero or same-filled page only
+// takes an entry. An older copy of the key is replaced.
+int cache_ztier_store(cache_ztier_t *z, uint64_t key, uint32_t hash, const char *page, int dirty) {
+    if (!z->budget) return 0;
+    uint32_t old = cache_index_find(&z->index, key, hash);
+    if (old != CACHE_INDEX_NONE) entry_remove(z, old);
+    compress_tag_t tag;
+    int len = compress_select(page, z->page_size, z->scratch, z->codec_budget, &tag);
+    int filled = tag.codec == COMPRESS_CODEC_ZERO || tag.codec == COMPRESS_CODEC_SAME;
+    if (!filled && (len <= 0 || (size_t)len > class_size(z, z->classes - 1))) {
+        z->stats.rejected++;
+        return 0;
+    }
+    uint32_t sl = CACHE_ZTIER_NIL;
+    uint16_t slot = SLOT_END;
+    // Each demotion frees a slot of its own class or, once a slab empties,
+    // room for a new slab of any class
+    while (filled ? held_bytes(z) + sizeof(cache_zentry_t) > z->budget : slot_take(z, (uint32_t)(len - 1) / z->step, &sl, &slot) != 0) {
+        // With deferred writes a dirty tail is left to the owner, and a taken
+        // one stays until its write is done
+        if (z->lru_tail != CACHE_ZTIER_NIL && z->deferred && (z->entries[z->lru_tail].dirty || z->entries[z->lru_tail].writing)) {
+            z->stats.dirty_refused++;
+            return 0;
+        }
+        if (z->lru_tail == CACHE_ZTIER_NIL || demote_tail(z) != 0) {
+            z->stats.rejected++;
+            return 0;
+        }
+    }
+    uint32_t e = entry_new(z);
+    if (e == CACHE_ZTIER_NIL || cache_index_insert(&z->index, key, hash, e) != 0) {
+        if (e != CACHE_ZTIER_NIL) {
+            z->entries[e].lru_next = z->entry_free;
+            z->entry_free = e;
+        }
+        if (!filled) slot_free(z, sl, slot);
+        z->stats.rejected++;
+        return 0;
+    }
+    if (!filled) memcpy(slot_mem(z, sl, slot), z->scratch, len);
+    z->stats.filled += filled;
+    cache_zentry_t *ent = &z->entries[e];
+    ent->key = key;
+    ent->hash = hash;
+    ent->slab = sl;
+    ent->slot = slot;
+    ent->codec = tag.codec;
+    ent->word = tag.word;
+    ent->len = (uint32_t)len;
+    ent->dirty = dirty != 0;
+    ent->writing = 0;
+    lru_push_head(z, e);
+    z->stats.stored++;
+    z->stats.pages++;
+    z->stats.bytes += len;
+    return 1;
+}
+
+// Move a page back into the block cache: on a hit the data is decompressed
+// into 'page', *dirty tells whether it still has to reach the backing file,
+// and the entry is dropped. Returns 1 on a hit, 0 on a miss and -1 if the
+// entry could not be decompressed (it is dropped as well).
+int cache_ztier_load(cache_ztier_t *z, uint64_t key, uint32_t hash, char *page, int *dirty) {
+    if (!z->budget) return 0;
+    uint32_t e = cache_index_find(&z->index, key, hash);
+    if (e == CACHE_INDEX_NONE) return 0;
+    cache_zentry_t *ent = &z->entries[e];
+    int ok = entry_decompress(z, ent, page);
+    *dirty = ent->dirty;
+    entry_remove(z, e);
+    if (!ok) return -1;
+    z->stats.hits++;
+    return 1;
+}
+
+// Write back the dirty entries with keys in [lo, hi); they stay in the tier
+// clean. Returns -1 if some could not be written.
+int cache_ztier_flush(cache_ztier_t *z, uint64_t lo, uint64_t hi) {
+    int rc = 0;
+    for (uint32_t e = z->lru_head; e != CACHE_ZTIER_NIL; e = z->entries[e].lru_next) {
+        cache_zentry_t *ent = &z->entries[e];
+        if (ent->dirty && ent->key >= lo && ent->key < hi && entry_write(z, ent) != 0) rc = -1;
+    }
+    return rc;
+}
+
+// Take up to 'max' dirty entries, oldest first, for the owner to write back
+// without holding the lock. Their pages are decompressed into 'pages',
+// page_size apart, with the keys and entry ids alongside. The entries stay
+// dirty until cache_ztier_clean_done() is told their writes succeeded. The
+// walk starts after *from, or at the oldest entry when it is CACHE_ZTIER_NIL,
+// and *from is left at the last entry taken: taken entries stay in place, so
+// it can be passed back until the lock is dropped after the next
+// cache_ztier_clean_done().
+uint32_t cache_ztier_clean_take(cache_ztier_t *z, uint32_t *from, uint32_t max, uint64_t *keys, uint32_t *ids, char *pages) {
+    uint32_t n = 0;
+    uint32_t e = *from == CACHE_ZTIER_NIL ? z->lru_tail : z->entries[*from].lru_prev;
+    for (; e != CACHE_ZTIER_NIL && n < max; e = z->entries[e].lru_prev) {
+        cache_zentry_t *ent = &z->entries[e];
+        if (!ent->dirty || ent->writing) continue;
+        if (!entry_decompress(z, ent, pages + (size_t)n * z->page_size)) {
+            z->stats.write_errors++;
+            continue;
+        }
+        ent->writing = 1;
+        keys[n] = ent->key;
+        ids[n++] = e;
+        *from = e;
+    }
+    return n;
+}
+
+// Report the writes of taken entries. An entry loaded or dropped meanwhile is
+// no longer marked as taken and is left alone.
+void cache_ztier_clean_done(cache_ztier_t *z, const uint32_t *ids, const int *ok, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        cache_zentry_t *ent = &z->entries[ids[i]];
+        if (!ent->writing) continue;
+        ent->writing = 0;
+        if (!ok[i]) {
+            z->stats.write_errors++;
+            continue;
+        }
+        z->stats.written += ent->dirty;
+        ent->dirty = 0;
+    }
+}
+
+// Is the entry of a key taken for writing? Its page must not be loaded until
+// the write is done, or a newer copy could reach the file before it.
+int cache_ztier_busy(cache_ztier_t *z, uint64_t key, uint32_t hash) {
+    if (!z->budget) return 0;
+    uint32_t e = cache_index_find(&z->index, key, hash);
+    return e != CACHE_INDEX_NONE && z->entries[e].writing;
+}
+
+// Drop the entries with keys in [lo, hi) without writing them
+void cache_ztier_purge(cache_ztier_t *z, uint64_t lo, uint64_t hi) {
+    uint32_t e = z->lru_head;
+    while (e != CACHE_ZTIER_NIL) {
+        uint32_t next = z->entries[e].lru_next;
+        if (z->entries[e].key >= lo && z->entries[e].key < hi) entry_remove(z, e);
+        e = next;
+    }
+}
+
+void cache_ztier_destroy(cache_ztier_t *z) {
+    for (uint32_t sl = 0; z->slabs && sl < z->nslabs; sl++) {
+        free(z->slabs[sl].mem);
+    }
+    free(z->slabs);
+    free(z->partial);
+    free(z->entries);
+    free(z->scratch);
+    free(z->page);
+    cache_index_destroy(&z->index);
+    z->slabs = NULL;
+    z->partial = NULL;
+    z->entries = NULL;
+    z->scratch = NULL;
+    z->page = NULL;
+    z->budget = 0;
+}
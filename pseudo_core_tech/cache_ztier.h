@@ -0,0 +1,101 @@
+#ifndef CACHE_ZTIER_H
+#define CACHE_ZTIER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cache_index.h"
+
+// Geometry for 4 KB pages, scaled up for larger ones
+#define CACHE_ZTIER_PAGE 4096
+#define CACHE_ZTIER_STEP 128   // size class granularity in bytes
+#define CACHE_ZTIER_SLAB 8192  // every slab holds slots of a single class
+#define CACHE_ZTIER_NIL UINT32_MAX
+
+// Writes a dirty page pushed out of the tier to its backing file, 0 on success
+typedef int (*cache_ztier_writeback_t)(void *arg, uint64_t key, const char *page);
+
+// One compressed page, in a slot of a slab of its size class. Zero and
+// same-filled pages are kept in the entry alone, without a slot.
+typedef struct {
+    uint64_t key;
+    uint32_t hash;
+    uint32_t slab;
+    uint16_t slot;
+    uint8_t codec;     // COMPRESS_CODEC_*
+    uint32_t word;     // of a same-filled page
+    uint32_t len;      // compressed bytes
+    uint32_t lru_next; // also links the entry free list
+    uint32_t lru_prev;
+    uint8_t dirty;     // newer than the backing file
+    uint8_t writing;   // taken by cache_ztier_clean_take(), being written back
+} cache_zentry_t;
+
+typedef struct {
+    char *mem;          // slab_size bytes, NULL while the table slot is unused
+    uint32_t next;      // partial slab list of the class, or the unused slot list
+    uint32_t prev;
+    uint16_t used;
+    uint16_t free_slot; // first free slot; each free slot holds the next one
+    uint8_t cls;
+} cache_zslab_t;
+
+typedef struct {
+    uint64_t stored;       // pages accepted
+    uint64_t hits;         // pages handed back to the block cache
+    uint64_t rejected;     // pages that did not compress below the largest class
+    uint64_t demoted;      // entries pushed out to make room
+    uint64_t written;      // dirty entries written to the backing file
+    uint64_t write_errors;
+    uint64_t dirty_refused; // pages refused because the oldest entry was still dirty
+    size_t pages;          // entries held
+    size_t bytes;          // compressed bytes held
+    size_t slab_bytes;     // memory held in slabs, bounded by the budget
+    size_t filled;         // entries of zero or same-filled pages, held without a slot
+} cache_ztier_stats_t;
+
+// Second-level store for pages evicted from the block cache, kept compressed
+// in RAM under a byte budget. Compressed pages are packed into slabs by size
+// class (multiples of step up to 3/4 of a page), and the least
+// recently stored entries are demoted when a class needs room. Dirty pages are
+// only written to the backing file when demoted or flushed; with 'deferred'
+// set a store never writes one, the owner cleans the entries instead through
+// cache_ztier_clean_take() and cache_ztier_clean_done(). Slab memory and
+// the entries of slotless pages count against the budget. Pages are
+// compressed with the codec_budget's codec (compress.h), LZ4 unless the
+// owner asks otherwise. Not thread-safe: the caller serializes access.
+typedef struct {
+    size_t budget;
+    int codec_budget;      // COMPRESS_BUDGET_*
+    size_t page_size;
+    uint32_t step;         // class granularity
+    size_t slab_size;
+    uint32_t classes;
+    cache_zentry_t *entries;
+    uint32_t entries_cap;
+    uint32_t entry_free;
+    uint32_t lru_head;     // most recently stored
+    uint32_t lru_tail;
+    cache_zslab_t *slabs;  // budget / slab_size table slots
+    uint32_t nslabs;
+    uint32_t slab_unused;
+    uint32_t *partial;     // per class: slabs with a free slot
+    cache_index_t index;   // key -> entry
+    char *scratch;         // compression output
+    char *page;            // demoted page being written back
+    cache_ztier_writeback_t writeback;
+    void *arg;
+    int deferred;          // stores refuse pages rather than write a dirty tail back
+    cache_ztier_stats_t stats;
+} cache_ztier_t;
+
+int cache_ztier_init(cache_ztier_t *z, size_t budget, int codec_budget, size_t page_size, cache_ztier_writeback_t writeback, void *arg);
+int cache_ztier_store(cache_ztier_t *z, uint64_t key, uint32_t hash, const char *page, int dirty);
+int cache_ztier_load(cache_ztier_t *z, uint64_t key, uint32_t hash, char *page, int *dirty);
+int cache_ztier_flush(cache_ztier_t *z, uint64_t lo, uint64_t hi);
+uint32_t cache_ztier_clean_take(cache_ztier_t *z, uint32_t *from, uint32_t max, uint64_t *keys, uint32_t *ids, char *pages);
+void cache_ztier_clean_done(cache_ztier_t *z, const uint32_t *ids, const int *ok, uint32_t n);
+int cache_ztier_busy(cache_ztier_t *z, uint64_t key, uint32_t hash);
+void cache_ztier_purge(cache_ztier_t *z, uint64_t lo, uint64_t hi);
+void cache_ztier_destroy(cache_ztier_t *z);
+
+#endif // CACHE_ZTIER_H
@@ -1,23 +1,163 @@
 #include "compress.h"
+#include "compress_dict.h"
 #include <zstd.h>
+#include <lz4.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-// Calculate Shannon entropy of the input data to determine compressibility
-static double calculate_entropy(const char *data, size_t sz) {
+// zstd contexts and LZ4 state of one thread, kept for its lifetime: creating
+// a context costs more than compressing a 4 KB page with it
+typedef struct {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    int level;         // level cctx is set to, 0 before the first use
+    void *lz4;         // LZ4_sizeofState() bytes
+} compress_ctx_t;
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static __thread compress_ctx_t *thread_ctx;
+
+static void ctx_free(void *arg) {
+    compress_ctx_t *ctx = arg;
+    ZSTD_freeCCtx(ctx->cctx);
+    ZSTD_freeDCtx(ctx->dctx);
+    free(ctx->lz4);
+    free(ctx);
+}
+
+static void ctx_key_create(void) {
+    pthread_key_create(&ctx_key, ctx_free);
+}
+
+// Contexts of the calling thread, freed when it exits. NULL if they cannot be
+// allocated; callers then fall back to the one-shot API.
+static compress_ctx_t *ctx_get(void) {
+    if (thread_ctx) return thread_ctx;
+    pthread_once(&ctx_once, ctx_key_create);
+    compress_ctx_t *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) return NULL;
+    ctx->cctx = ZSTD_createCCtx();
+    ctx->dctx = ZSTD_createDCtx();
+    ctx->lz4 = malloc(LZ4_sizeofState());
+    if (!ctx->cctx || !ctx->dctx || !ctx->lz4 || pthread_setspecific(ctx_key, ctx) != 0) {
+        ctx_free(ctx);
+        return NULL;
+    }
+    thread_ctx = ctx;
+    return ctx;
+}
+
+// Entropy is estimated on a sample of the page, ENTROPY_CHUNK bytes at a
+// time spread evenly over it, counted into four histograms so repeated bytes
+// do not wait on each other's increments
+#define ENTROPY_SAMPLE 1024
+#define ENTROPY_CHUNK 16
+#define ENTROPY_RAW_BITS 7.5 // above this many bits per byte zstd finds nothing to remove
+
+typedef uint16_t entropy_hist_t[4][256];
+
+static float clog_table[ENTROPY_SAMPLE + 1]; // c * log2(c)
+static float (*entropy_sum)(const entropy_hist_t h);
+static pthread_once_t entropy_once = PTHREAD_ONCE_INIT;
+
+// Sum of c * log2(c) over the merged histogram
+static float entropy_sum_scalar(const entropy_hist_t h) {
+    float sum = 0;
+    for (int b = 0; b < 256; b++) {
+        sum += clog_table[h[0][b] + h[1][b] + h[2][b] + h[3][b]];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static float entropy_sum_avx2(const entropy_hist_t h) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int b = 0; b < 256; b += 16) {
+        __m256i c = _mm256_add_epi16(
+            _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)&h[0][b]), _mm256_loadu_si256((const __m256i *)&h[1][b])),
+            _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)&h[2][b]), _mm256_loadu_si256((const __m256i *)&h[3][b])));
+        __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(c));
+        __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(c, 1));
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(clog_table, lo, 4));
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(clog_table, hi, 4));
+    }
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_hadd_ps(s, s);
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__ARM_NEON)
+static float entropy_sum_neon(const entropy_hist_t h) {
+    float sum = 0;
+    for (int b = 0; b < 256; b += 8) {
+        uint16x8_t c = vaddq_u16(vaddq_u16(vld1q_u16(&h[0][b]), vld1q_u16(&h[1][b])),
+                                 vaddq_u16(vld1q_u16(&h[2][b]), vld1q_u16(&h[3][b])));
+        uint16_t cnt[8];
+        vst1q_u16(cnt, c);
+        for (int k = 0; k < 8; k++) {
+            sum += clog_table[cnt[k]];
+        }
+    }
+    return sum;
+}
+#endif
+
+static void entropy_init(void) {
+    for (int c = 1; c <= ENTROPY_SAMPLE; c++) {
+        clog_table[c] = (float)(c * log2(c));
+    }
+    entropy_sum = entropy_sum_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) entropy_sum = entropy_sum_avx2;
+#elif defined(__ARM_NEON)
+    entropy_sum = entropy_sum_neon;
+#endif
+}
+
+static void hist_count(entropy_hist_t h, const unsigned char *p, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        h[0][p[i]]++;
+        h[1][p[i + 1]]++;
+        h[2][p[i + 2]]++;
+        h[3][p[i + 3]]++;
+    }
+    for (; i < n; i++) {
+        h[0][p[i]]++;
+    }
+}
+
+// Estimated Shannon entropy of the data in bits per byte, 0 (highly
+// compressible) to 8 (random)
+static double estimate_entropy(const char *data, size_t sz) {
     if (sz == 0) return 0.0;
-    unsigned int freq[256] = {0};
-    for (size_t i = 0; i < sz; i++) {
-        freq[(unsigned char)data[i]]++;
-    }
-    double entropy = 0.0;
-    for (int i = 0; i < 256; i++) {
-        if (freq[i] > 0) {
-            double p = (double)freq[i] / sz;
-            entropy -= p * log2(p);
+    pthread_once(&entropy_once, entropy_init);
+    entropy_hist_t h;
+    memset(h, 0, sizeof(h));
+    const unsigned char *p = (const unsigned char *)data;
+    size_t n = sz;
+    if (sz <= ENTROPY_SAMPLE) {
+        hist_count(h, p, sz);
+    } else {
+        // One chunk per stride, at a position within it that changes from
+        // chunk to chunk, so data repeating with the stride is not aliased
+        size_t stride = sz / (ENTROPY_SAMPLE / ENTROPY_CHUNK);
+        for (size_t k = 0; k < ENTROPY_SAMPLE / ENTROPY_CHUNK; k++) {
+            hist_count(h, p + k * stride + k % (stride / ENTROPY_CHUNK) * ENTROPY_CHUNK, ENTROPY_CHUNK);
         }
+        n = ENTROPY_SAMPLE;
     }
-    return entropy;
+    return log2((double)n) - entropy_sum(h) / n;
 }
 
 // Determine adaptive compression level based on data entropy
@@ -28,13 +168,29 @@ static int determine_compression_level(double entropy) {
     else return 5; // High level for random or high-entropy data
 }
 
-int compress_page(const char *in, size_t sz, char *out, int lvl) {
-    // If lvl is 0, calculate adaptive level based on entropy
-    if (lvl == 0) {
-        double entropy = calculate_entropy(in, sz);
-        lvl = determine_compression_level(entropy);
+// Output room for a page of sz bytes with any codec
+size_t compress_bound(size_t sz) {
+    size_t lz4 = (size_t)LZ4_compressBound((int)sz);
+    return lz4 > ZSTD_compressBound(sz) ? lz4 : ZSTD_compressBound(sz);
+}
+
+// Compress with the thread's context and the current dictionary, switching
+// the context's level only when it changes. The frame records the
+// dictionary's id, so the page stays readable after a retrain.
+static int compress_ctx(compress_ctx_t *ctx, const char *in, size_t sz, char *out, int lvl) {
+    const ZSTD_CDict *cdict = ctx ? compress_dict_cdict(lvl) : NULL;
+    size_t c;
+    if (!ctx) {
+        c = ZSTD_compress(out, ZSTD_compressBound(sz), in, sz, lvl);
+    } else if (cdict) {
+        c = ZSTD_compress_usingCDict(ctx->cctx, out, ZSTD_compressBound(sz), in, sz, cdict);
+    } else {
+        if (ctx->level != lvl) {
+            c = ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel, lvl);
+            if (!ZSTD_isError(c)) ctx->level = lvl;
+        }
+        c = ZSTD_compress2(ctx->cctx, out, ZSTD_compressBound(sz), in, sz);
     }
-    size_t c = ZSTD_compress(out, ZSTD_compressBound(sz), in, sz, lvl);
     if (ZSTD_isError(c)) {
         fprintf(stderr, "ZSTD compression error: %s\n", ZSTD_getErrorName(c));
         return -1;
@@ -42,11 +198,187 @@ int compress_page(const char *in, size_t sz, char *out, int lvl) {
     return (int)c;
 }
 
-int decompress_page(const char *in, size_t sz, char *out) {
-    size_t d = ZSTD_decompress(out, sz, in, sz);
+// Compressed size, 0 for a page that looks incompressible and is better
+// stored raw (zstd is not called for it), -1 on error
+int compress_page(const char *in, size_t sz, char *out, int lvl) {
+    double entropy = estimate_entropy(in, sz);
+    if (entropy > ENTROPY_RAW_BITS) return 0;
+    // If lvl is 0, the level follows the entropy
+    if (lvl == 0) lvl = determine_compression_level(entropy);
+    return compress_ctx(ctx_get(), in, sz, out, lvl);
+}
+
+// Compress n pages of sz bytes with one context. Page i goes to
+// out + i * stride, where stride is at least compress_bound(sz), and its
+// compressed size to lens[i]: 0 for a page to store raw, as with
+// compress_page(), -1 if it failed. Returns the number of pages compressed.
+int compress_pages(const char *const *in, uint32_t n, size_t sz, char *out, size_t stride, int *lens, int lvl) {
+    compress_ctx_t *ctx = ctx_get();
+    int done = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        double entropy = estimate_entropy(in[i], sz);
+        if (entropy > ENTROPY_RAW_BITS) {
+            lens[i] = 0;
+            continue;
+        }
+        lens[i] = compress_ctx(ctx, in[i], sz, out + i * stride, lvl ? lvl : determine_compression_level(entropy));
+        done += lens[i] > 0;
+    }
+    return done;
+}
+
+static int decompress_ctx(compress_ctx_t *ctx, const char *in, size_t sz, char *out, size_t out_sz) {
+    size_t d;
+    unsigned id = ZSTD_getDictID_fromFrame(in, sz);
+    if (id == 0) {
+        d = ctx ? ZSTD_decompressDCtx(ctx->dctx, out, out_sz, in, sz) : ZSTD_decompress(out, out_sz, in, sz);
+    } else {
+        const ZSTD_DDict *ddict = compress_dict_ddict(id);
+        if (!ddict || !ctx) {
+            fprintf(stderr, "ZSTD decompression error: dictionary %u not available\n", id);
+            return -1;
+        }
+        d = ZSTD_decompress_usingDDict(ctx->dctx, out, out_sz, in, sz, ddict);
+    }
     if (ZSTD_isError(d)) {
         fprintf(stderr, "ZSTD decompression error: %s\n", ZSTD_getErrorName(d));
         return -1;
     }
     return (int)d;
 }
+
+// sz is the compressed size, out_sz the room in out (the original page size)
+int decompress_page(const char *in, size_t sz, char *out, size_t out_sz) {
+    return decompress_ctx(ctx_get(), in, sz, out, out_sz);
+}
+
+// Decompress n pages with one context, page i of sizes[i] bytes into out[i]
+// of out_sz bytes. Returns the number of pages that came back whole.
+int decompress_pages(const char *const *in, const size_t *sizes, uint32_t n, char *const *out, size_t out_sz) {
+    compress_ctx_t *ctx = ctx_get();
+    int done = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        done += decompress_ctx(ctx, in[i], sizes[i], out[i], out_sz) == (int)out_sz;
+    }
+    return done;
+}
+
+// The word a page repeats when it is one 32-bit word over and over
+static int page_same_word(const char *in, size_t sz, uint32_t *word) {
+    if (sz < sizeof(uint32_t) || sz % sizeof(uint32_t)) return 0;
+    if (memcmp(in, in + sizeof(uint32_t), sz - sizeof(uint32_t)) != 0) return 0;
+    memcpy(word, in, sizeof(uint32_t));
+    return 1;
+}
+
+static int lz4_encode(compress_ctx_t *ctx, const char *in, size_t sz, char *out) {
+    int bound = LZ4_compressBound((int)sz);
+    int c = ctx ? LZ4_compress_fast_extState(ctx->lz4, in, out, (int)sz, bound, 1) : LZ4_compress_default(in, out, (int)sz, bound);
+    if (c <= 0) {
+        fprintf(stderr, "LZ4 compression error\n");
+        return -1;
+    }
+    return c;
+}
+
+static int decode_fill(const compress_tag_t *tag, const char *in, char *out, size_t out_sz) {
+    (void)in;
+    if (tag->codec == COMPRESS_CODEC_ZERO) {
+        memset(out, 0, out_sz);
+        return (int)out_sz;
+    }
+    if (out_sz % sizeof(uint32_t)) return -1;
+    for (size_t i = 0; i < out_sz; i += sizeof(uint32_t)) {
+        memcpy(out + i, &tag->word, sizeof(uint32_t));
+    }
+    return (int)out_sz;
+}
+
+static int decode_raw(const compress_tag_t *tag, const char *in, char *out, size_t out_sz) {
+    if ((size_t)tag->len < out_sz) return -1;
+    memcpy(out, in, out_sz);
+    return (int)out_sz;
+}
+
+static int decode_zstd(const compress_tag_t *tag, const char *in, char *out, size_t out_sz) {
+    return decompress_ctx(ctx_get(), in, (size_t)tag->len, out, out_sz);
+}
+
+static int decode_lz4(const compress_tag_t *tag, const char *in, char *out, size_t out_sz) {
+    int d = LZ4_decompress_safe(in, out, tag->len, (int)out_sz);
+    if (d < 0) {
+        fprintf(stderr, "LZ4 decompression error\n");
+        return -1;
+    }
+    return d;
+}
+
+// Codec registry, indexed by the id stored with each page
+typedef struct {
+    const char *name;
+    int (*decode)(const compress_tag_t *tag, const char *in, char *out, size_t out_sz);
+} codec_t;
+
+static const codec_t codecs[COMPRESS_CODECS] = {
+    [COMPRESS_CODEC_ZERO] = { "zero", decode_fill },
+    [COMPRESS_CODEC_RAW] = { "raw", decode_raw },
+    [COMPRESS_CODEC_ZSTD] = { "zstd", decode_zstd },
+    [COMPRESS_CODEC_SAME] = { "same", decode_fill },
+    [COMPRESS_CODEC_LZ4] = { "lz4", decode_lz4 },
+};
+
+const char *compress_codec_name(unsigned codec) {
+    return codec < COMPRESS_CODECS ? codecs[codec].name : "unknown";
+}
+
+static int select_ctx(compress_ctx_t *ctx, const char *in, size_t sz, char *out, int budget, compress_tag_t *tag) {
+    tag->word = 0;
+    tag->len = 0;
+    if (page_same_word(in, sz, &tag->word)) {
+        tag->codec = tag->word ? COMPRESS_CODEC_SAME : COMPRESS_CODEC_ZERO;
+        return 0;
+    }
+    double entropy = estimate_entropy(in, sz);
+    tag->codec = COMPRESS_CODEC_RAW;
+    if (entropy > ENTROPY_RAW_BITS) return 0;
+    int len;
+    if (budget == COMPRESS_BUDGET_FAST) {
+        len = lz4_encode(ctx, in, sz, out);
+        tag->codec = COMPRESS_CODEC_LZ4;
+    } else {
+        len = compress_ctx(ctx, in, sz, out, budget == COMPRESS_BUDGET_SMALL ? determine_compression_level(entropy) : 1);
+        tag->codec = COMPRESS_CODEC_ZSTD;
+    }
+    // Output no smaller than the page is kept raw
+    if (len < 0 || (size_t)len >= sz) tag->codec = COMPRESS_CODEC_RAW;
+    if (len < 0) return -1;
+    tag->len = tag->codec == COMPRESS_CODEC_RAW ? 0 : len;
+    return tag->len;
+}
+
+int compress_select(const char *in, size_t sz, char *out, int budget, compress_tag_t *tag) {
+    return select_ctx(ctx_get(), in, sz, out, budget, tag);
+}
+
+// compress_select() over n pages with one context, output of page i at
+// out + i * stride (stride at least compress_bound(sz)). Returns the number
+// of pages that need no storage of their own or were compressed.
+int compress_select_pages(const char *const *in, uint32_t n, size_t sz, char *out, size_t stride, compress_tag_t *tags, int budget) {
+    compress_ctx_t *ctx = ctx_get();
+    int done = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        select_ctx(ctx, in[i], sz, out + i * stride, budget, &tags[i]);
+        done += tags[i].codec != COMPRESS_CODEC_RAW;
+    }
+    return done;
+}
+
+// Rebuild a page from what compress_select() made of it: in holds tag->len
+// bytes (the page itself for RAW, nothing for ZERO and SAME)
+int decompress_tagged(const compress_tag_t *tag, const char *in, char *out, size_t out_sz) {
+    if (tag->codec >= COMPRESS_CODECS) {
+        fprintf(stderr, "Unknown page codec %u\n", tag->codec);
+        return -1;
+    }
+    return codecs[tag->codec].decode(tag, in, out, out_sz);
+}
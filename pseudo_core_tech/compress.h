@@ -2,8 +2,49 @@
 #define COMPRESS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
+// Every thread compresses with zstd contexts of its own, created on first use
+// and freed when the thread exits. lvl 0 picks the level from the entropy of
+// each page. A page whose sampled entropy is close to 8 bits per byte is not
+// handed to zstd at all: compress_page() returns 0 and the caller stores it
+// raw. Pages are compressed with the newest trained dictionary once
+// one is loaded (compress_dict.h). compress_select() below adds the other
+// codecs, chosen per page.
+size_t compress_bound(size_t sz);
 int compress_page(const char *in, size_t sz, char *out, int lvl);
-int decompress_page(const char *in, size_t sz, char *out);
+int decompress_page(const char *in, size_t sz, char *out, size_t out_sz);
+int compress_pages(const char *const *in, uint32_t n, size_t sz, char *out, size_t stride, int *lens, int lvl);
+int decompress_pages(const char *const *in, const size_t *sizes, uint32_t n, char *const *out, size_t out_sz);
+
+// Page codecs. The ids are stored with the pages, so they never change.
+#define COMPRESS_CODEC_ZERO 0   // all zeros, nothing stored
+#define COMPRESS_CODEC_RAW 1    // stored as is
+#define COMPRESS_CODEC_ZSTD 2   // zstd frame
+#define COMPRESS_CODEC_SAME 3   // one 32-bit word repeated, only the word is kept
+#define COMPRESS_CODEC_LZ4 4    // LZ4 block
+#define COMPRESS_CODECS 5
+
+// CPU a page may cost to compress, traded against its stored size
+#define COMPRESS_BUDGET_FAST 0      // LZ4, decompresses several times faster than zstd
+#define COMPRESS_BUDGET_BALANCED 1  // zstd level 1
+#define COMPRESS_BUDGET_SMALL 2     // zstd, level following the entropy
+
+// How a page came out of compress_select(): len bytes of output in codec,
+// none for ZERO and SAME, whose word is all there is to the page
+typedef struct {
+    uint8_t codec;
+    uint32_t word;
+    int len;
+} compress_tag_t;
+
+// Pick a codec for a page by what it holds and the budget: zero and
+// same-filled pages are recognized without compressing, pages that look
+// incompressible are left RAW (nothing is written to out; the caller keeps
+// the page), the rest go to the budget's codec. Returns tag->len, -1 on error.
+int compress_select(const char *in, size_t sz, char *out, int budget, compress_tag_t *tag);
+int compress_select_pages(const char *const *in, uint32_t n, size_t sz, char *out, size_t stride, compress_tag_t *tags, int budget);
+int decompress_tagged(const compress_tag_t *tag, const char *in, char *out, size_t out_sz);
+const char *compress_codec_name(unsigned codec);
 
 #endif // COMPRESS_H
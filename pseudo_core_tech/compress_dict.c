@@ -0,0 +1,295 @@
+// Обученные словари zstd для сжатия страниц PseudoCore
+#include "compress_dict.h"
+#include <zdict.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define DICT_MAGIC "PCDICT01"
+#define DICT_LEVELS 23             // zstd levels 1..22 get a prepared dictionary each
+#define DICT_MAX_BYTES (16u << 20) // larger entries are taken for a torn tail
+#define DICT_MIN_SAMPLES 16        // fewer non-zero pages are not worth training on
+#define DICT_KEEP_GAIN 0.97        // retraining needs at least 3% smaller output to switch
+
+// One entry of the dictionary file, followed by size bytes of dictionary
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint64_t sum;      // over the header with sum = 0 and the dictionary
+} dict_header_t;
+
+typedef struct {
+    void *data;
+    size_t size;
+    ZSTD_DDict *ddict;
+    ZSTD_CDict *cdict[DICT_LEVELS]; // created on first use of the level
+} dict_t;
+
+static dict_t *dicts[COMPRESS_DICT_MAX];  // by version, published once and kept until unload
+static uint32_t active;                   // newest version, 0 while there is none
+static pthread_mutex_t dict_mutex = PTHREAD_MUTEX_INITIALIZER;  // loading and training
+static pthread_mutex_t cdict_mutex = PTHREAD_MUTEX_INITIALIZER; // lazy CDict creation
+
+static uint64_t dict_sum(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (; len > 0; p++, len--) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t entry_sum(const dict_header_t *h, const void *data) {
+    dict_header_t tmp = *h;
+    tmp.sum = 0;
+    return dict_sum(dict_sum(14695981039346656037ULL, &tmp, sizeof(tmp)), data, h->size);
+}
+
+static void dict_free(dict_t *d) {
+    for (int l = 0; l < DICT_LEVELS; l++) {
+        ZSTD_freeCDict(d->cdict[l]);
+    }
+    ZSTD_freeDDict(d->ddict);
+    free(d->data);
+    free(d);
+}
+
+// Publish a version for decompression. Takes ownership of data.
+static int dict_add(uint32_t version, void *data, size_t size) {
+    dict_t *d = calloc(1, sizeof(*d));
+    if (!d) {
+        free(data);
+        return -1;
+    }
+    d->data = data;
+    d->size = size;
+    d->ddict = ZSTD_createDDict(data, size);
+    if (!d->ddict) {
+        dict_free(d);
+        return -1;
+    }
+    __atomic_store_n(&dicts[version], d, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Read the entries of the file, loading versions not loaded yet. Stops at the
+// first entry that does not check out, which is where the next one goes.
+// Returns the newest version in the file, or -1 if one could not be loaded.
+static int dict_scan(int fd, uint64_t *end) {
+    uint64_t pos = 0;
+    uint32_t newest = 0;
+    dict_header_t h;
+    while (pread(fd, &h, sizeof(h), pos) == (ssize_t)sizeof(h)) {
+        if (memcmp(h.magic, DICT_MAGIC, 8) != 0 || h.version == 0 || h.version >= COMPRESS_DICT_MAX ||
+            h.size == 0 || h.size > DICT_MAX_BYTES) {
+            break;
+        }
+        void *data = malloc(h.size);
+        if (!data) return -1;
+        if (pread(fd, data, h.size, pos + sizeof(h)) != (ssize_t)h.size || entry_sum(&h, data) != h.sum) {
+            free(data);
+            break;
+        }
+        if (dicts[h.version]) {
+            free(data);
+        } else if (dict_add(h.version, data, h.size) != 0) {
+            return -1;
+        }
+        if (h.version > newest) newest = h.version;
+        pos += sizeof(h) + h.size;
+    }
+    *end = pos;
+    return (int)newest;
+}
+
+static void set_active(uint32_t version) {
+    if (version > active) __atomic_store_n(&active, version, __ATOMIC_RELEASE);
+}
+
+// Load the dictionaries stored at path and make the newest one current.
+// Returns its version, 0 if there is no dictionary yet, -1 on failure.
+int compress_dict_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    pthread_mutex_lock(&dict_mutex);
+    uint64_t end;
+    int newest = dict_scan(fd, &end);
+    if (newest > 0) set_active((uint32_t)newest);
+    pthread_mutex_unlock(&dict_mutex);
+    close(fd);
+    return newest;
+}
+
+static int page_is_zero(const char *p, size_t sz) {
+    return p[0] == 0 && memcmp(p, p + 1, sz - 1) == 0;
+}
+
+// Compressed size of the samples at level 1 with a dictionary, 0 on failure
+static size_t dict_cost(const void *dict, size_t len, const char *samples, uint32_t n, size_t page_size) {
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict, len, 1);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    size_t bound = ZSTD_compressBound(page_size);
+    char *out = malloc(bound);
+    size_t total = 0;
+    if (cdict && cctx && out) {
+        for (uint32_t i = 0; i < n; i++) {
+            size_t c = ZSTD_compress_usingCDict(cctx, out, bound, samples + i * page_size, page_size, cdict);
+            if (ZSTD_isError(c)) {
+                total = 0;
+                break;
+            }
+            total += c;
+        }
+    }
+    free(out);
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeCDict(cdict);
+    return total;
+}
+
+// Store a trained dictionary as the next version and make it current, unless
+// the current one compresses the same samples about as well
+static int dict_adopt(const char *path, char *dict, size_t len, const char *samples, uint32_t n, size_t page_size) {
+    pthread_mutex_lock(&dict_mutex);
+    int rc = -1;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    uint64_t end;
+    int newest = fd >= 0 ? dict_scan(fd, &end) : -1;
+    if (newest < 0 || newest + 1 >= COMPRESS_DICT_MAX) goto out;
+    if (newest > 0) {
+        dict_t *cur = dicts[newest];
+        size_t old_cost = dict_cost(cur->data, cur->size, samples, n, page_size);
+        size_t new_cost = dict_cost(dict, len, samples, n, page_size);
+        if (new_cost == 0) goto out;
+        if (old_cost && new_cost > old_cost * DICT_KEEP_GAIN) {
+            rc = 0;
+            goto out;
+        }
+    }
+    // A zstd dictionary starts with its magic number and then its id, both
+    // little-endian; the id is what compressed frames refer to
+    uint32_t version = (uint32_t)newest + 1;
+    uint32_t id = COMPRESS_DICT_ID_BASE + version;
+    for (int b = 0; b < 4; b++) {
+        ((unsigned char *)dict)[4 + b] = (unsigned char)(id >> (8 * b));
+    }
+    dict_header_t h;
+    memcpy(h.magic, DICT_MAGIC, 8);
+    h.version = version;
+    h.size = (uint32_t)len;
+    h.sum = entry_sum(&h, dict);
+    char *entry = malloc(sizeof(h) + len);
+    if (!entry) goto out;
+    memcpy(entry, &h, sizeof(h));
+    memcpy(entry + sizeof(h), dict, len);
+    // On disk before any page is compressed with it
+    int ok = pwrite(fd, entry, sizeof(h) + len, end) == (ssize_t)(sizeof(h) + len) && fdatasync(fd) == 0;
+    free(entry);
+    void *copy = ok ? malloc(len) : NULL;
+    if (!copy) goto out;
+    memcpy(copy, dict, len);
+    if (dict_add(version, copy, len) != 0) goto out;
+    set_active(version);
+    rc = (int)version;
+out:
+    if (fd >= 0) close(fd);
+    pthread_mutex_unlock(&dict_mutex);
+    return rc;
+}
+
+// Train a dictionary of up to dict_bytes on pages sampled across the image
+// at img_path and store it at path as the next version. Returns the new
+// version, 0 if the current dictionary was kept because the new one was not
+// clearly better, -1 if there was too little data to train on or the
+// dictionary could not be stored.
+int compress_dict_train(const char *path, const char *img_path, size_t page_size, uint32_t samples, size_t dict_bytes) {
+    if (page_size == 0 || samples == 0 || dict_bytes == 0) return -1;
+    int img = open(img_path, O_RDONLY);
+    if (img < 0) return -1;
+    struct stat st;
+    uint64_t npages = fstat(img, &st) == 0 ? (uint64_t)st.st_size / page_size : 0;
+    if (samples > npages) samples = (uint32_t)npages;
+    char *buf = samples ? malloc((size_t)samples * page_size) : NULL;
+    int rc = -1;
+    if (!buf) goto out;
+
+    // One page from a random spot in each of samples equal stretches
+    uint64_t stretch = npages / samples;
+    uint64_t rnd = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < samples; i++) {
+        rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t page = i * stretch + (rnd >> 33) % stretch;
+        char *p = buf + (size_t)n * page_size;
+        if (pread(img, p, page_size, page * page_size) != (ssize_t)page_size) continue;
+        // Holes and zeroed pages teach the dictionary nothing
+        if (page_is_zero(p, page_size)) continue;
+        n++;
+    }
+    rc = compress_dict_train_pages(path, buf, n, page_size, dict_bytes);
+out:
+    close(img);
+    free(buf);
+    return rc;
+}
+
+// Train on n pages of page_size bytes already in memory, as
+// compress_dict_train() does on the ones it samples
+int compress_dict_train_pages(const char *path, const char *pages, uint32_t n, size_t page_size, size_t dict_bytes) {
+    if (n < DICT_MIN_SAMPLES || page_size == 0 || dict_bytes == 0) return -1;
+    size_t *sizes = malloc(n * sizeof(*sizes));
+    char *dict = malloc(dict_bytes);
+    int rc = -1;
+    if (sizes && dict) {
+        for (uint32_t i = 0; i < n; i++) {
+            sizes[i] = page_size;
+        }
+        size_t len = ZDICT_trainFromBuffer(dict, dict_bytes, pages, sizes, n);
+        if (!ZDICT_isError(len)) rc = dict_adopt(path, dict, len, pages, n, page_size);
+    }
+    free(sizes);
+    free(dict);
+    return rc;
+}
+
+uint32_t compress_dict_version(void) {
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+}
+
+const ZSTD_CDict *compress_dict_cdict(int lvl) {
+    uint32_t v = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if (v == 0 || lvl < 1 || lvl >= DICT_LEVELS) return NULL;
+    dict_t *d = __atomic_load_n(&dicts[v], __ATOMIC_ACQUIRE);
+    ZSTD_CDict *cdict = __atomic_load_n(&d->cdict[lvl], __ATOMIC_ACQUIRE);
+    if (cdict) return cdict;
+    pthread_mutex_lock(&cdict_mutex);
+    if (!d->cdict[lvl]) {
+        __atomic_store_n(&d->cdict[lvl], ZSTD_createCDict(d->data, d->size, lvl), __ATOMIC_RELEASE);
+    }
+    cdict = d->cdict[lvl];
+    pthread_mutex_unlock(&cdict_mutex);
+    return cdict;
+}
+
+const ZSTD_DDict *compress_dict_ddict(unsigned dict_id) {
+    if (dict_id <= COMPRESS_DICT_ID_BASE || dict_id >= COMPRESS_DICT_ID_BASE + COMPRESS_DICT_MAX) return NULL;
+    dict_t *d = __atomic_load_n(&dicts[dict_id - COMPRESS_DICT_ID_BASE], __ATOMIC_ACQUIRE);
+    return d ? d->ddict : NULL;
+}
+
+// Only once nothing compresses or decompresses any more
+void compress_dict_unload(void) {
+    pthread_mutex_lock(&dict_mutex);
+    __atomic_store_n(&active, 0, __ATOMIC_RELEASE);
+    for (uint32_t v = 0; v < COMPRESS_DICT_MAX; v++) {
+        if (dicts[v]) dict_free(dicts[v]);
+        dicts[v] = NULL;
+    }
+    pthread_mutex_unlock(&dict_mutex);
+}
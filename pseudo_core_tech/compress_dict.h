@@ -0,0 +1,28 @@
+#ifndef COMPRESS_DICT_H
+#define COMPRESS_DICT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zstd.h>
+
+#define COMPRESS_DICT_MAX 1024            // dictionary versions one file can hold
+#define COMPRESS_DICT_ID_BASE 0x50430000u // zstd dictionary id of version 0 ("PC")
+
+// Trained zstd dictionaries for page compression. Every version ever adopted
+// is kept in an append-only file next to the storage image and stays loaded,
+// since pages compressed with it may still be around; new pages are
+// compressed with the newest one. A zstd frame names the dictionary it was
+// made with (COMPRESS_DICT_ID_BASE + version), so decompression needs no
+// side table.
+int compress_dict_load(const char *path);
+int compress_dict_train(const char *path, const char *img_path, size_t page_size, uint32_t samples, size_t dict_bytes);
+int compress_dict_train_pages(const char *path, const char *pages, uint32_t n, size_t page_size, size_t dict_bytes);
+uint32_t compress_dict_version(void);
+void compress_dict_unload(void);
+
+// Used by compress.c: the newest dictionary prepared for a level, NULL when
+// there is none, and the dictionary a frame names, NULL when it is unknown
+const ZSTD_CDict *compress_dict_cdict(int lvl);
+const ZSTD_DDict *compress_dict_ddict(unsigned dict_id);
+
+#endif // COMPRESS_DICT_H
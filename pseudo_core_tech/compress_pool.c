@@ -0,0 +1,146 @@
+// Пул потоков сжатия пакетов страниц PseudoCore
+#include "compress_pool.h"
+#include <string.h>
+
+// A batch lives on its writer's stack; it is unlinked from the queue once
+// its last chunk has been taken, and the writer returns only after every
+// chunk is finished, so workers never see it gone
+struct compress_batch {
+    const char *const *in;
+    size_t sz;
+    char *out;
+    size_t stride;
+    compress_tag_t *tags;
+    int budget;
+    uint32_t n;
+    uint32_t nchunks;
+    uint32_t next;           // next chunk to take
+    uint32_t finished;       // chunks done
+    compress_batch_t *link;
+};
+
+static void batch_unlink(compress_pool_t *pool, compress_batch_t *b) {
+    compress_batch_t *prev = NULL;
+    for (compress_batch_t *q = pool->head; q; prev = q, q = q->link) {
+        if (q != b) continue;
+        if (prev) prev->link = b->link;
+        else pool->head = b->link;
+        if (pool->tail == b) pool->tail = prev;
+        pool->queued--;
+        return;
+    }
+}
+
+// Take the next chunk of a batch, or -1 when all are taken - caller holds the mutex
+static int64_t chunk_take(compress_pool_t *pool, compress_batch_t *b) {
+    if (b->next == b->nchunks) return -1;
+    uint32_t chunk = b->next++;
+    if (b->next == b->nchunks) batch_unlink(pool, b);
+    return chunk;
+}
+
+// Compress a chunk with the mutex released, then count it as finished
+static void chunk_run(compress_pool_t *pool, compress_batch_t *b, uint32_t chunk) {
+    uint32_t first = chunk * COMPRESS_POOL_CHUNK;
+    uint32_t n = b->n - first < COMPRESS_POOL_CHUNK ? b->n - first : COMPRESS_POOL_CHUNK;
+    pthread_mutex_unlock(&pool->mutex);
+    compress_select_pages(b->in + first, n, b->sz, b->out + first * b->stride, b->stride, b->tags + first, b->budget);
+    pthread_mutex_lock(&pool->mutex);
+    if (++b->finished == b->nchunks) pthread_cond_broadcast(&pool->done);
+}
+
+static void *pool_worker(void *arg) {
+    compress_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->running) {
+        compress_batch_t *b = pool->head;
+        if (!b) {
+            pthread_cond_wait(&pool->work, &pool->mutex);
+            continue;
+        }
+        int64_t chunk = chunk_take(pool, b);
+        uint32_t n = b->n - (uint32_t)chunk * COMPRESS_POOL_CHUNK;
+        pool->stats.worker_pages += n < COMPRESS_POOL_CHUNK ? n : COMPRESS_POOL_CHUNK;
+        chunk_run(pool, b, (uint32_t)chunk);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// Start 'threads' workers (at most COMPRESS_POOL_MAX_THREADS) behind a queue
+// of queue_cap batches. With no threads the pool compresses in the caller.
+int compress_pool_init(compress_pool_t *pool, unsigned threads, unsigned queue_cap) {
+    memset(pool, 0, sizeof(*pool));
+    if (threads > COMPRESS_POOL_MAX_THREADS) threads = COMPRESS_POOL_MAX_THREADS;
+    pool->queue_cap = queue_cap ? queue_cap : 1;
+    pool->running = 1;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (; pool->nthreads < threads; pool->nthreads++) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, pool_worker, pool) != 0) {
+            compress_pool_destroy(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// compress_select_pages() with the batch split over the workers and the
+// caller. Returns when every page is done; results are where
+// compress_select_pages() would put them.
+int compress_pool_select_pages(compress_pool_t *pool, const char *const *in, uint32_t n, size_t sz, char *out,
+                               size_t stride, compress_tag_t *tags, int budget) {
+    if (!pool || pool->nthreads == 0 || n <= COMPRESS_POOL_CHUNK) {
+        if (pool) __atomic_add_fetch(&pool->stats.inline_batches, 1, __ATOMIC_RELAXED);
+        return compress_select_pages(in, n, sz, out, stride, tags, budget);
+    }
+    compress_batch_t b = { in, sz, out, stride, tags, budget, n, (n + COMPRESS_POOL_CHUNK - 1) / COMPRESS_POOL_CHUNK, 0, 0, NULL };
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->queued == pool->queue_cap) {
+        __atomic_add_fetch(&pool->stats.inline_batches, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->mutex);
+        return compress_select_pages(in, n, sz, out, stride, tags, budget);
+    }
+    if (pool->tail) pool->tail->link = &b;
+    else pool->head = &b;
+    pool->tail = &b;
+    pool->queued++;
+    pool->stats.batches++;
+    pool->stats.pages += n;
+    pthread_cond_broadcast(&pool->work);
+    for (int64_t chunk; (chunk = chunk_take(pool, &b)) >= 0;) {
+        chunk_run(pool, &b, (uint32_t)chunk);
+    }
+    while (b.finished < b.nchunks) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    int done = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        done += tags[i].codec != COMPRESS_CODEC_RAW;
+    }
+    return done;
+}
+
+void compress_pool_get_stats(compress_pool_t *pool, compress_pool_stats_t *out) {
+    pthread_mutex_lock(&pool->mutex);
+    *out = pool->stats;
+    out->inline_batches = __atomic_load_n(&pool->stats.inline_batches, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Stop the workers; no writer may be using the pool
+void compress_pool_destroy(compress_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->running = 0;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for (unsigned i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->mutex);
+    pool->nthreads = 0;
+}
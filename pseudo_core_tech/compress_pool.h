@@ -0,0 +1,48 @@
+#ifndef COMPRESS_POOL_H
+#define COMPRESS_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "compress.h"
+
+#define COMPRESS_POOL_CHUNK 4      // pages a worker takes from a batch at a time
+#define COMPRESS_POOL_MAX_THREADS 64
+
+typedef struct compress_batch compress_batch_t;
+
+typedef struct {
+    uint64_t batches;        // batches handed to the workers
+    uint64_t pages;          // pages of those batches
+    uint64_t worker_pages;   // of those, pages a worker compressed
+    uint64_t inline_batches; // batches the caller compressed alone: the queue was full or the batch small
+} compress_pool_stats_t;
+
+// Worker threads compressing the pages of write batches. A writer hands its
+// batch to compress_pool_select_pages(), which queues it and then takes
+// chunks of it itself alongside the workers, so a batch never waits for a
+// busy pool and the writer gets the results of its pages in their order.
+// The queue holds at most queue_cap batches; a writer finding it full
+// compresses its batch alone. Pages are compressed as by
+// compress_select_pages() (compress.h).
+typedef struct {
+    pthread_t threads[COMPRESS_POOL_MAX_THREADS];
+    unsigned nthreads;
+    unsigned queue_cap;
+    unsigned queued;
+    compress_batch_t *head;     // batches with chunks left to take, oldest first
+    compress_batch_t *tail;
+    int running;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // a batch was queued
+    pthread_cond_t done;        // a chunk was finished
+    compress_pool_stats_t stats;
+} compress_pool_t;
+
+int compress_pool_init(compress_pool_t *pool, unsigned threads, unsigned queue_cap);
+int compress_pool_select_pages(compress_pool_t *pool, const char *const *in, uint32_t n, size_t sz, char *out,
+                               size_t stride, compress_tag_t *tags, int budget);
+void compress_pool_get_stats(compress_pool_t *pool, compress_pool_stats_t *out);
+void compress_pool_destroy(compress_pool_t *pool);
+
+#endif // COMPRESS_POOL_H
@@ -5,12 +5,37 @@
 #define CACHE_MB     128       // RAM-кэш в МБ
 #define SEGMENT_MB   512       // сегмент swap на ядро в МБ
 #define BLOCK_SIZE   4096      // размер блока 4 КБ
-#define MAX_CACHE_ENTRIES 8192 // Максимальное количество записей в кэше для LRU
+#define MAX_CACHE_ENTRIES (CACHE_MB * 1024 * 1024 / BLOCK_SIZE) // Кадров в общем пуле кэша: весь бюджет CACHE_MB
+#define CACHE_HUGEPAGES 1      // Пул страниц кэша в huge pages (с откатом на обычные)
+#define CACHE_NUMA 1           // Шарды кэша размещаются на узлах NUMA (mbind)
+#define CACHE_DIRTY_LOW_PCT 5  // Фоновая запись сбрасывает грязные страницы до этой доли кэша (%)
+#define CACHE_DIRTY_HIGH_PCT 20 // При превышении этой доли (%) фоновая запись будится немедленно
+#define CACHE_ZTIER_MB 64      // Сжатый второй уровень для вытесненных страниц (МБ, 0 = выключен)
+#define CACHE_ZTIER_CODEC COMPRESS_BUDGET_FAST // Сжатие второго уровня: LZ4, распаковка при попадании в разы быстрее zstd
+#define CACHE_VICTIM_RING 1    // Вытесненные страницы, не принятые сжатым уровнем, сохраняются в кольцевом кэше
+#define RING_CACHE_PATH "./storage_swap.ring" // Кольцевой кэш в файле переживает перезапуск ("" = анонимная память)
+#define CACHE_MANIFEST_PATH "./storage_swap.hot" // Горячие страницы сохраняются при остановке и подгружаются при старте
+#define CACHE_WARMUP_MB_S 64   // Предел скорости подгрузки горячих страниц (МБ/с)
+#define CACHE_DEFAULT_POLICY CACHE_POLICY_TINYLFU // Политика вытеснения: устойчива к последовательному проходу по сегменту
+#define CACHE_DURABILITY CACHE_DURABILITY_WRITEBACK // Долговечность записи: WRITEBACK, WRITETHROUGH, GROUP (групповой fdatasync) или WAL
+#define CACHE_WAL_PATH "./storage_swap.wal" // Журнал упреждающей записи режима WAL: последовательные записи вместо случайных
+#define CACHE_WAL_MB 64        // Размер журнала (МБ), две половины по очереди
 #define MIGRATION_THRESHOLD 5  // Порог для миграции задач (разница от среднего)
 #define COMPRESSION_MIN_LVL 1  // Минимальный уровень сжатия
 #define COMPRESSION_MAX_LVL 9  // Максимальный уровень сжатия
 #define COMPRESSION_ADAPTIVE_THRESHOLD 0.5 // Порог для адаптивного сжатия (коэффициент сжатия)
+#define COMPRESS_DICT_PATH "./storage_swap.dict" // Обученные словари zstd, все версии: сжатая страница помнит свою
+#define COMPRESS_DICT_KB 16    // Размер словаря (КБ), 0 = сжатие без обучения словаря
+#define COMPRESS_DICT_SAMPLES 2048 // Страниц образа в выборке для обучения
+#define COMPRESS_DICT_RETRAIN_S 3600 // Переобучение на ходу раз в столько секунд (0 = только при первом запуске)
 
+#define CACHE_CONFIG_PATH "./config.cfg" // Геометрия кэша (CACHE_MB, CACHE_PAGE_SIZE, CACHE_SHARDS) без пересборки
 #define SWAP_IMG_PATH "./storage_swap.img"
+#define STORAGE_DIRECT_IO 1    // Открывать хранилище с O_DIRECT: страницы кэшируются только в cache_t
+#define STORAGE_BLOCK_STORE 1  // Хранилище - блочное: страницы сжаты и упакованы, индекс экстентов (не в режиме WAL)
+#define STORAGE_CAPACITY_MB 1024 // Логический объем блочного хранилища (МБ), задается при его создании
+#define STORAGE_COMPRESSION COMPRESS_BUDGET_BALANCED // Сжатие блочного хранилища: FAST (LZ4), BALANCED (zstd 1) или SMALL (zstd по энтропии)
+#define STORAGE_COMPRESS_THREADS 2 // Потоки сжатия пакетов записи в хранилище (0 = сжимает сам пишущий поток)
+#define STORAGE_COMPRESS_QUEUE 16  // Пакетов в очереди сжатия; при полной очереди пишущий поток сжимает пакет сам
 
 #endif // CONFIG_H
@@ -16,10 +16,20 @@ if swapon --show | grep -q "$SWAP_IMG_PATH"; then
   gcc -O3 -D_FILE_OFFSET_BITS=64 -pthread \
       pseudo_core.c \
           cache.c \
+          cache_index.c \
+          cache_sketch.c \
+          cache_ztier.c \
+          cache_manifest.c \
+          cache_wal.c \
+          page_pool.c \
+          numa_node.c \
               compress.c \
+              compress_dict.c \
+              compress_pool.c \
+              block_store.c \
                   ring_cache.c \
                       scheduler.c \
-                          -o pseudo_core -lzstd
+                          -o pseudo_core -lzstd -llz4
 
                           if [[ $? -ne 0 ]]; then
                               echo "[!] Compilation failed"
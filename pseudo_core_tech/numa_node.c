@@ -0,0 +1,77 @@
+// Топология NUMA для PseudoCore: число узлов, привязка памяти и потоков
+#define _GNU_SOURCE
+#include "numa_node.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// Parse a sysfs list such as "0-3,8,10-11" and call fn for every entry.
+// Returns the highest entry, or -1 if the file could not be read.
+static int parse_list(const char *path, void (*fn)(int, void*), void *arg) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char buf[1024];
+    int max = -1;
+    if (fgets(buf, sizeof(buf), f)) {
+        for (char *p = buf; *p && *p != '\n';) {
+            char *end;
+            long lo = strtol(p, &end, 10), hi = lo;
+            if (end == p) break;
+            if (*end == '-') {
+                p = end + 1;
+                hi = strtol(p, &end, 10);
+            }
+            for (long i = lo; i <= hi; i++) {
+                if (fn) fn((int)i, arg);
+            }
+            if (hi > max) max = (int)hi;
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    fclose(f);
+    return max;
+}
+
+// Node ids may be sparse; the count covers the highest online id
+int numa_node_count(void) {
+    int max = parse_list("/sys/devices/system/node/online", NULL, NULL);
+    if (max < 0) return 1;
+    return max + 1 < NUMA_NODE_MAX ? max + 1 : NUMA_NODE_MAX;
+}
+
+// Prefer 'node' for the pages of [addr, addr + len) that are not faulted in
+// yet. The range must be aligned to the mapping's page size.
+int numa_node_bind_memory(void *addr, size_t len, int node) {
+    if (node < 0 || node >= NUMA_NODE_MAX) return -1;
+    unsigned long mask = 1UL << node;
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+        fprintf(stderr, "NUMA: mbind to node %d failed (errno: %d)\n", node, errno);
+        return -1;
+    }
+    return 0;
+}
+
+static void add_cpu(int cpu, void *arg) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, (cpu_set_t*)arg);
+}
+
+// Restrict the calling thread to the CPUs of one node
+int numa_node_bind_thread(int node) {
+    char path[64];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (parse_list(path, add_cpu, &set) < 0 || CPU_COUNT(&set) == 0) return -1;
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        fprintf(stderr, "NUMA: failed to bind thread to node %d (errno: %d)\n", node, rc);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef NUMA_NODE_H
+#define NUMA_NODE_H
+
+#include <stddef.h>
+
+// Minimal NUMA topology helpers on top of sysfs and the mbind() system call,
+// so the build does not depend on libnuma. On machines without NUMA the node
+// count is 1 and binding is a no-op.
+#define NUMA_NODE_MAX 64
+
+int numa_node_count(void);
+int numa_node_bind_memory(void *addr, size_t len, int node);
+int numa_node_bind_thread(int node);
+
+#endif // NUMA_NODE_H
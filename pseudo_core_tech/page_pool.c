@@ -0,0 +1,83 @@
+// Пул страниц для кэша PseudoCore
+#include "page_pool.h"
+#include "numa_node.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+static void prefault(char *mem, size_t len) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(mem, len, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < len; off += page) {
+        mem[off] = 0;
+    }
+}
+
+int page_pool_init(page_pool_t *p, uint32_t nframes, size_t frame_size, int flags) {
+    memset(p, 0, sizeof(*p));
+    if (nframes == 0 || frame_size == 0) {
+        fprintf(stderr, "Page pool: invalid geometry (%u frames of %zu bytes)\n", nframes, frame_size);
+        return -1;
+    }
+    size_t len = (size_t)nframes * frame_size;
+    void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (flags & PAGE_POOL_HUGE) {
+        // Reserved huge pages are all-or-nothing, so round up to a whole huge page
+        size_t hlen = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        mem = mmap(NULL, hlen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (flags & PAGE_POOL_LAZY ? 0 : MAP_POPULATE), -1, 0);
+        if (mem != MAP_FAILED) {
+            len = hlen;
+            p->huge = 1;
+        }
+    }
+#endif
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Page pool: failed to map %zu bytes (errno: %d)\n", len, errno);
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        // No reserved huge pages available - let THP back the pool where it can
+        if (flags & PAGE_POOL_HUGE) madvise(mem, len, MADV_HUGEPAGE);
+#endif
+        // Faulted in after the advice, so THP can hand out huge pages right away
+        if (!(flags & PAGE_POOL_LAZY)) prefault((char*)mem, len);
+    }
+    p->base = mem;
+    p->map_len = len;
+    p->frame_size = frame_size;
+    p->nframes = nframes;
+    return 0;
+}
+
+// Place frames [first, first + nframes) on a NUMA node and fault them in
+// there. Only the part of the range covering whole pages of the mapping is
+// bound; the edges stay with the default policy.
+int page_pool_bind(page_pool_t *p, uint32_t first, uint32_t nframes, int node) {
+    size_t page = p->huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)page_pool_frame(p, first);
+    uintptr_t end = (uintptr_t)page_pool_frame(p, first + nframes);
+    start = (start + page - 1) & ~(uintptr_t)(page - 1);
+    end &= ~(uintptr_t)(page - 1);
+    int rc = 0;
+    if (end > start) rc = numa_node_bind_memory((void*)start, end - start, node);
+    // First touch allocates under the policy just set
+    for (uint32_t i = first; i < first + nframes; i++) {
+        *(volatile char*)page_pool_frame(p, i) = 0;
+    }
+    return rc;
+}
+
+void page_pool_destroy(page_pool_t *p) {
+    if (p->base) munmap(p->base, p->map_len);
+    memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,29 @@
+#ifndef PAGE_POOL_H
+#define PAGE_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Флаги page_pool_init()
+#define PAGE_POOL_HUGE 0x1 // try MAP_HUGETLB first, fall back to THP madvise
+#define PAGE_POOL_LAZY 0x2 // do not prefault, ranges are placed with page_pool_bind()
+
+// Preallocated, page-aligned array of fixed-size data frames.
+// The pool only owns the memory; frame bookkeeping is done by the user.
+typedef struct {
+    char *base;
+    size_t map_len;
+    size_t frame_size;
+    uint32_t nframes;
+    int huge; // 1 if the mapping is backed by hugetlbfs pages
+} page_pool_t;
+
+int page_pool_init(page_pool_t *p, uint32_t nframes, size_t frame_size, int flags);
+int page_pool_bind(page_pool_t *p, uint32_t first, uint32_t nframes, int node);
+void page_pool_destroy(page_pool_t *p);
+
+static inline char *page_pool_frame(const page_pool_t *p, uint32_t idx) {
+    return p->base + (size_t)idx * p->frame_size;
+}
+
+#endif // PAGE_POOL_H
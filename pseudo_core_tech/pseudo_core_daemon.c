@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,8 +15,10 @@
 #include "config.h"
 #include "cache.h"
 #include "compress.h"
+#include "compress_dict.h"
 #include "ring_cache.h"
 #include "scheduler.h"
+#include "numa_node.h"
 
 // Конфигурация демона
 #undef CORES
@@ -27,36 +30,30 @@
 #define HIGH_LOAD_DELAY_NS 50000000  // 50ms
 #define LOW_LOAD_DELAY_NS 25000000   // 25ms
 #define BASE_LOAD_DELAY_NS 10000000  // 10ms
+#define DAEMON_BATCH_PAGES 16  // Страниц за одно чтение из кэша (один preadv на промахи)
 #define PID_FILE "/var/run/pseudo_core.pid"
 #define LOG_FILE "/var/log/pseudo_core.log"
 
 // Определяем структуру аргументов для потока
 typedef struct {
     int id;               // ID ядра
-    int fd;               // Файловый дескриптор для операций I/O
     uint64_t seg_size;    // Размер сегмента для выбора блока
+    cache_t *cache;       // Общий кэш всех ядер
+    int obj;              // Файл хранилища, зарегистрированный в кэше
     volatile int running; // Флаг для контроля завершения потока
 } daemon_core_arg_t;
 
 volatile int global_running = 1;
 static pthread_t core_threads[DAEMON_CORES];
 static daemon_core_arg_t core_args[DAEMON_CORES];
+static cache_t shared_cache;
 static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Остановка выполняется в main(): потоки завершаются, затем общий кэш
+// сбрасывает грязные страницы
 void signal_handler(int sig) {
     if (sig == SIGTERM || sig == SIGINT) {
-        syslog(LOG_INFO, "Получен сигнал завершения, останавливаем сервис...");
         global_running = 0;
-        
-        // Ждем завершения всех потоков
-        for (int i = 0; i < DAEMON_CORES; i++) {
-            core_args[i].running = 0;
-            pthread_join(core_threads[i], NULL);
-        }
-        
-        closelog();
-        unlink(PID_FILE);
-        exit(0);
     }
 }
 
@@ -97,72 +94,161 @@ void daemonize(void) {
 
 void* core_run(void *v) {
     daemon_core_arg_t *c = (daemon_core_arg_t*)v;
-    cache_t cache;
-    cache_init(&cache);
-    ring_cache_init();
+    // Размер страницы задается геометрией кэша (config.cfg), а не при сборке
+    size_t page_size = c->cache->page_size;
+    // Ядро работает на узле NUMA, где лежат шарды его сегмента
+    int node = cache_home_node(c->cache, (uint64_t)c->id * c->seg_size);
+    if (c->cache->numa_nodes > 1 && numa_node_bind_thread(node) != 0) {
+        syslog(LOG_WARNING, "Core %d: Failed to bind to NUMA node %d", c->id, node);
+    }
 
     while (c->running && global_running) {
         // Основная логика обработки с увеличенными задержками
         static uint64_t pos[DAEMON_CORES] = {0};
-        uint64_t idx = pos[c->id]++;
-        uint64_t offset = (uint64_t)c->id * c->seg_size + 
-                         (idx % (c->seg_size / BLOCK_SIZE)) * BLOCK_SIZE;
-
-        char buf[BLOCK_SIZE];
-        char *page = cache_get(&cache, c->fd, offset, 1);
-        if (!page) {
-            syslog(LOG_ERR, "Core %d: Failed to get cache page", c->id);
+        uint64_t seg_pages = c->seg_size / page_size;
+        uint64_t idx = pos[c->id] % seg_pages;
+        // Пакет не выходит за конец сегмента
+        uint32_t npages = seg_pages - idx < DAEMON_BATCH_PAGES ? (uint32_t)(seg_pages - idx) : DAEMON_BATCH_PAGES;
+        pos[c->id] += npages;
+        uint64_t offset = (uint64_t)c->id * c->seg_size + idx * page_size;
+
+        // Страницы закреплены в кэше и обрабатываются на месте, без копии
+        cache_page_t pages[DAEMON_BATCH_PAGES];
+        if (cache_get_range(c->cache, c->obj, offset, npages, 1, pages) != 0) {
+            syslog(LOG_ERR, "Core %d: Failed to get cache pages", c->id);
             struct timespec delay = {0, HIGH_LOAD_DELAY_NS};
             nanosleep(&delay, NULL);
             continue;
         }
 
-        memcpy(buf, page, BLOCK_SIZE);
-
-        // Сокращенная обработка данных
-        for (int i = 0; i < BLOCK_SIZE; i++) {
-            buf[i] ^= c->id;
-        }
-
-        // Сжатие и запись
-        char cmp[BLOCK_SIZE];
-        int cs = compress_page(buf, BLOCK_SIZE, cmp, 1);
-        if (cs > 0) {
-            pwrite(c->fd, cmp, cs, offset);
+        for (uint32_t p = 0; p < npages; p++) {
+            // Сокращенная обработка данных
+            for (size_t i = 0; i < page_size; i++) {
+                pages[p].data[i] ^= c->id;
+            }
         }
+        // Страницы грязные: кэш запишет их в хранилище, блочное хранилище -
+        // сжатыми, пакетами по соседним страницам
+        cache_unpin_range(c->cache, pages, npages);
 
-        cache_to_ring(offset, buf);
-
-        // Увеличенная задержка для снижения нагрузки
-        struct timespec delay = {0, BASE_LOAD_DELAY_NS * 2};
+        // Увеличенная задержка для снижения нагрузки, темп по страницам прежний
+        uint64_t delay_ns = (uint64_t)BASE_LOAD_DELAY_NS * 2 * npages;
+        struct timespec delay = {delay_ns / 1000000000ULL, delay_ns % 1000000000ULL};
         nanosleep(&delay, NULL);
     }
 
-    ring_cache_destroy();
-    cache_destroy(&cache, c->fd);
     return NULL;
 }
 
+// Обучение словаря на страницах хранилища: блочное хранилище отдает их
+// распакованными, обычный образ читается как есть
+static int train_dictionary(block_store_t *store, size_t page_size) {
+    if (!store) {
+        return compress_dict_train(COMPRESS_DICT_PATH, SWAP_IMG_PATH, page_size,
+                                   COMPRESS_DICT_SAMPLES, COMPRESS_DICT_KB * 1024);
+    }
+    char *buf = malloc((size_t)COMPRESS_DICT_SAMPLES * page_size);
+    if (!buf) return -1;
+    uint32_t n = block_store_sample(store, buf, COMPRESS_DICT_SAMPLES);
+    int v = compress_dict_train_pages(COMPRESS_DICT_PATH, buf, n, page_size, COMPRESS_DICT_KB * 1024);
+    free(buf);
+    return v;
+}
+
 int main(void) {
+    // Геометрия кэша из config.cfg: файл читается до перехода в "/"
+    cache_config_t cache_cfg;
+    cache_config_default(&cache_cfg);
+    int cfg_loaded = cache_config_load(&cache_cfg, CACHE_CONFIG_PATH) == 0;
+
     daemonize();
     syslog(LOG_INFO, "PseudoCore daemon запущен");
+    if (!cfg_loaded) {
+        syslog(LOG_WARNING, "Не удалось прочитать %s, используется геометрия кэша по умолчанию", CACHE_CONFIG_PATH);
+    }
 
     // Устанавливаем обработчики сигналов
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
 
-    // Открываем файл хранилища
-    int fd = open("storage_swap.img", O_RDWR | O_CREAT, 0644);
+    // Открываем файл хранилища. Блочное хранилище держит страницы сжатыми и
+    // упакованными (индекс экстентов); журнал WAL восстанавливает страницы
+    // на их места в файле, поэтому с ним, как и с образом старого формата,
+    // файл остается обычным
+    static block_store_t store;
+    static compress_pool_t pool;
+    block_store_t *stored = NULL;
+    int fd = -1;
+    if (STORAGE_BLOCK_STORE && cache_cfg.durability != CACHE_DURABILITY_WAL) {
+        fd = open("storage_swap.img", O_RDWR | O_CREAT, 0644);
+        uint64_t capacity = (uint64_t)STORAGE_CAPACITY_MB * 1024 * 1024 / cache_cfg.page_size;
+        if (fd >= 0 && block_store_open(&store, fd, cache_cfg.page_size, capacity) == 0) {
+            stored = &store;
+            // Пакеты записи сжимаются пулом потоков: тяжелый уровень сжатия
+            // не задерживает поток, отдающий страницы на запись. Потоков не
+            // больше, чем свободных процессоров, иначе пул только мешает
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            unsigned threads = STORAGE_COMPRESS_THREADS;
+            if (cpus > 0 && threads > (unsigned)cpus - 1) threads = (unsigned)cpus - 1;
+            if (compress_pool_init(&pool, threads, STORAGE_COMPRESS_QUEUE) != 0) {
+                syslog(LOG_WARNING, "Не удалось запустить потоки сжатия, страницы сжимаются пишущим потоком");
+            }
+            block_store_set_compression(&store, STORAGE_COMPRESSION, pool.nthreads ? &pool : NULL);
+        } else {
+            syslog(LOG_WARNING, "storage_swap.img не является блочным хранилищем, страницы хранятся несжатыми");
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+    }
+    // С O_DIRECT страницы не дублируются в страничном кэше ядра; файловые
+    // системы без него (tmpfs) работают как раньше
+    if (!stored && STORAGE_DIRECT_IO) {
+        fd = open("storage_swap.img", O_RDWR | O_CREAT | O_DIRECT, 0644);
+        if (fd < 0) syslog(LOG_WARNING, "O_DIRECT недоступен для файла хранилища, используется буферизованный ввод-вывод");
+    }
+    if (fd < 0) fd = open("storage_swap.img", O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
         syslog(LOG_ERR, "Не удалось открыть файл хранилища");
         exit(EXIT_FAILURE);
     }
 
+    // Словари сжатия загружаются до кэша: при восстановлении из журнала WAL
+    // распаковываются страницы, сжатые с ними
+    int dict = compress_dict_load(COMPRESS_DICT_PATH);
+    if (dict < 0) {
+        syslog(LOG_WARNING, "Не удалось загрузить словари сжатия из %s", COMPRESS_DICT_PATH);
+    } else if (dict == 0 && COMPRESS_DICT_KB > 0) {
+        dict = train_dictionary(stored, cache_cfg.page_size);
+        if (dict > 0) syslog(LOG_INFO, "Обучен словарь сжатия, версия %d", dict);
+    }
+
+    // Кольцо принимает страницы, вытесненные из кэша, поэтому создается первым.
+    // Из файла оно поднимается с содержимым прошлого запуска
+    if (!RING_CACHE_PATH[0] || ring_cache_open(RING_CACHE_PATH, cache_cfg.page_size) != 0) {
+        if (RING_CACHE_PATH[0]) syslog(LOG_WARNING, "Не удалось открыть %s, кольцевой кэш в памяти", RING_CACHE_PATH);
+        ring_cache_init(cache_cfg.page_size);
+    }
+
+    // Один кэш на все ядра: общий бюджет CACHE_MB, сегмент ядра i живет
+    // на узле NUMA i по кругу
+    cache_cfg.numa_stripe = (uint64_t)DAEMON_SEGMENT_MB * 1024 * 1024;
+    if (cache_init(&shared_cache, &cache_cfg) != 0) {
+        syslog(LOG_ERR, "Не удалось инициализировать кэш (%zu МБ, страница %zu байт, шардов %u)",
+               cache_cfg.cache_bytes >> 20, cache_cfg.page_size, cache_cfg.shards);
+        exit(EXIT_FAILURE);
+    }
+    int obj = stored ? cache_register_store(&shared_cache, stored, 0) : cache_register(&shared_cache, fd, 0);
+    if (obj < 0) {
+        syslog(LOG_ERR, "Не удалось зарегистрировать хранилище в кэше");
+        exit(EXIT_FAILURE);
+    }
+
     // Запускаем потоки обработки
     for (int i = 0; i < DAEMON_CORES; i++) {
         core_args[i].id = i;
-        core_args[i].fd = fd;
         core_args[i].seg_size = DAEMON_SEGMENT_MB * 1024 * 1024;
+        core_args[i].cache = &shared_cache;
+        core_args[i].obj = obj;
         core_args[i].running = 1;
 
         if (pthread_create(&core_threads[i], NULL, core_run, &core_args[i]) != 0) {
@@ -172,11 +258,47 @@ int main(void) {
     }
 
     // Основной цикл демона
+    time_t retrain = time(NULL) + COMPRESS_DICT_RETRAIN_S;
     while (global_running) {
         sleep(1);
+        // Переобучение на ходу: страницы, сжатые прежними версиями, остаются читаемыми
+        if (COMPRESS_DICT_KB > 0 && COMPRESS_DICT_RETRAIN_S > 0 && time(NULL) >= retrain) {
+            int v = train_dictionary(stored, cache_cfg.page_size);
+            if (v > 0) syslog(LOG_INFO, "Словарь сжатия переобучен, версия %d", v);
+            retrain = time(NULL) + COMPRESS_DICT_RETRAIN_S;
+        }
     }
 
+    syslog(LOG_INFO, "Получен сигнал завершения, останавливаем сервис...");
+    for (int i = 0; i < DAEMON_CORES; i++) {
+        core_args[i].running = 0;
+        pthread_join(core_threads[i], NULL);
+    }
+    cache_destroy(&shared_cache, fd);
+    if (stored) {
+        block_store_stats_t st = stored->stats;
+        uint64_t written = 0;
+        char codecs[128] = "";
+        for (unsigned k = 0; k < COMPRESS_CODECS; k++) {
+            size_t len = strlen(codecs);
+            written += st.pages[k];
+            snprintf(codecs + len, sizeof(codecs) - len, "%s%s %lu", len ? ", " : "", compress_codec_name(k), st.pages[k]);
+        }
+        syslog(LOG_INFO, "Блочное хранилище: %lu страниц записано (%s), %lu МБ вместо %lu МБ, на диске %lu МБ",
+               written, codecs, st.stored_bytes >> 20, st.page_bytes >> 20, block_store_disk_bytes(stored) >> 20);
+        if (block_store_close(stored) != 0) syslog(LOG_ERR, "Не удалось сохранить индекс блочного хранилища");
+    }
+    if (pool.nthreads) {
+        compress_pool_stats_t ps;
+        compress_pool_get_stats(&pool, &ps);
+        syslog(LOG_INFO, "Пул сжатия: %lu пакетов (%lu страниц, %lu сжато рабочими потоками), %lu пакетов сжато пишущим потоком",
+               ps.batches, ps.pages, ps.worker_pages, ps.inline_batches);
+        compress_pool_destroy(&pool);
+    }
+    ring_cache_destroy();
+    compress_dict_unload();
     close(fd);
+    unlink(PID_FILE);
     syslog(LOG_INFO, "PseudoCore daemon завершил работу");
     closelog();
     return 0;
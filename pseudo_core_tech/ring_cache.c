@@ -1,41 +1,442 @@
+#define _GNU_SOURCE // sched_getcpu
 #include "ring_cache.h"
+#include "cache_index.h"
+#include "page_pool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static size_t ring_pos;
-static void *ring_buffer;
-static pthread_mutex_t ring_mutex;
+#define RING_EMPTY UINT64_MAX // key of a slot that holds nothing
+#define RING_INDEX_STRIPES 64 // index partitions by key hash, each with its own writer lock
+#define RING_MAX_SEGMENTS 256 // CPUs beyond this share segments
+#define RING_FILE_MAGIC "PCRING01"
+#define RING_FILE_VERSION 1
+#define RING_FILE_ALIGN (2UL * 1024 * 1024) // slot data starts on a huge page boundary
 
-void ring_cache_init(void) {
-    ring_buffer = malloc(RING_SIZE);
-    if (!ring_buffer) {
+// Slot header. seq is odd while the slot is owned by a writer filling it or a
+// reader taking the block out; every completed change adds 2.
+typedef struct {
+    uint64_t seq;
+    uint64_t key;
+} ring_slot_t;
+
+// Slots written by the threads of one CPU. The cursor is only ever
+// incremented, so concurrent writers reserve distinct slots without a lock.
+typedef struct {
+    uint64_t cursor;
+    uint32_t first;
+    uint32_t nslots;
+    int64_t held;          // blocks held, may go negative while a drop and an insert race
+    uint64_t stored;
+    uint64_t overwritten;
+    uint64_t hits;
+    uint64_t misses;
+} __attribute__((aligned(64))) ring_segment_t;
+
+// Header of a file-backed ring, followed by the slot headers and, from
+// data_offset, the slots. clean is cleared while the file is mapped, so a
+// ring that was not shut down properly is discarded on the next open.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t clean;
+    uint64_t slot_size;
+    uint64_t nslots;
+    uint64_t data_offset;
+    ring_object_t objects[RING_MAX_OBJECTS];
+} ring_file_header_t;
+
+typedef struct {
+    pthread_mutex_t mutex; // serializes index writers; find() runs without it
+    cache_index_t index;   // key -> slot
+} __attribute__((aligned(64))) ring_stripe_t;
+
+static char *ring_buffer;
+static ring_slot_t *ring_slots_meta;
+static page_pool_t ring_pool;         // slots of an anonymous ring
+static ring_file_header_t *ring_file; // mapping of a file-backed ring
+static size_t ring_file_len;
+static int ring_fd = -1;
+static ring_object_t ring_anon_objects[RING_MAX_OBJECTS];
+static ring_object_t *ring_objects;
+static uint32_t ring_slots;
+static size_t ring_slot;     // bytes per slot
+static ring_segment_t *ring_segments;
+static int ring_nsegments;
+static ring_stripe_t ring_stripes[RING_INDEX_STRIPES];
+static uint64_t ring_invalidated;
+static __thread int ring_thread_segment = -1;
+static unsigned ring_next_segment;
+
+static uint32_t ring_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+static ring_stripe_t *stripe_for(uint32_t h) {
+    return &ring_stripes[(h >> 26) % RING_INDEX_STRIPES];
+}
+
+// Segment of the calling thread's CPU, or a fixed one per thread when the
+// CPU is not known
+static ring_segment_t *segment_for_thread(void) {
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        if (ring_thread_segment < 0) ring_thread_segment = (int)__atomic_fetch_add(&ring_next_segment, 1, __ATOMIC_RELAXED);
+        cpu = ring_thread_segment;
+    }
+    return &ring_segments[cpu % ring_nsegments];
+}
+
+static ring_segment_t *segment_of_slot(uint32_t slot) {
+    uint32_t per = ring_slots / ring_nsegments;
+    int seg = (int)(slot / per);
+    return &ring_segments[seg < ring_nsegments ? seg : ring_nsegments - 1];
+}
+
+// Take a slot whose sequence number was seen as 'seq' (even)
+static int slot_claim(uint32_t slot, uint64_t seq) {
+    return __atomic_compare_exchange_n(&ring_slots_meta[slot].seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void slot_publish(uint32_t slot) {
+    __atomic_add_fetch(&ring_slots_meta[slot].seq, 1, __ATOMIC_RELEASE);
+}
+
+// Remove key -> slot from the index unless the key has moved on to another slot
+static void index_erase(uint64_t key, uint32_t slot) {
+    uint32_t h = ring_hash(key);
+    ring_stripe_t *st = stripe_for(h);
+    pthread_mutex_lock(&st->mutex);
+    if (cache_index_find(&st->index, key, h) == slot) cache_index_erase(&st->index, key, h);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+// Empty a claimed slot and publish it
+static void slot_drop(uint32_t slot) {
+    uint64_t key = ring_slots_meta[slot].key;
+    __atomic_store_n(&ring_slots_meta[slot].key, RING_EMPTY, __ATOMIC_RELAXED);
+    slot_publish(slot);
+    index_erase(key, slot);
+    __atomic_sub_fetch(&segment_of_slot(slot)->held, 1, __ATOMIC_RELAXED);
+}
+
+// Segments, index and counters for ring_slots slots whose headers are in
+// ring_slots_meta. Blocks already in the slots are indexed.
+static int ring_setup(size_t slot_size) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    ring_nsegments = cpus > 0 ? (cpus < RING_MAX_SEGMENTS ? (int)cpus : RING_MAX_SEGMENTS) : 1;
+    if (ring_nsegments > (int)ring_slots) ring_nsegments = (int)ring_slots;
+    ring_segments = aligned_alloc(64, (size_t)ring_nsegments * sizeof(ring_segment_t));
+    if (!ring_segments) return -1;
+    uint32_t per = ring_slots / ring_nsegments;
+    for (int i = 0; i < ring_nsegments; i++) {
+        ring_segment_t *seg = &ring_segments[i];
+        memset(seg, 0, sizeof(*seg));
+        seg->first = (uint32_t)i * per;
+        seg->nslots = i == ring_nsegments - 1 ? ring_slots - seg->first : per;
+    }
+    for (int i = 0; i < RING_INDEX_STRIPES; i++) {
+        pthread_mutex_init(&ring_stripes[i].mutex, NULL);
+        if (cache_index_init(&ring_stripes[i].index, ring_slots / RING_INDEX_STRIPES + 1) != 0) return -1;
+    }
+    ring_invalidated = 0;
+    ring_slot = slot_size;
+    for (uint32_t i = 0; i < ring_slots; i++) {
+        uint64_t key = ring_slots_meta[i].key;
+        if (key == RING_EMPTY) continue;
+        uint32_t h = ring_hash(key);
+        if (cache_index_insert(&stripe_for(h)->index, key, h, i) != 0) return -1;
+        segment_of_slot(i)->held++;
+    }
+    return 0;
+}
+
+// Anonymous ring: the slots come from a page pool on huge pages when there
+// are any, faulted in up front rather than on first use
+void ring_cache_init(size_t slot_size) {
+    ring_slots = slot_size ? (uint32_t)(RING_SIZE / slot_size) : 0;
+    ring_slots_meta = malloc((size_t)ring_slots * sizeof(ring_slot_t) + 1);
+    if (ring_slots == 0 || !ring_slots_meta || page_pool_init(&ring_pool, ring_slots, slot_size, PAGE_POOL_HUGE) != 0) {
+        fprintf(stderr, "Error allocating memory for ring buffer\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < ring_slots; i++) {
+        ring_slots_meta[i].seq = 0;
+        ring_slots_meta[i].key = RING_EMPTY;
+    }
+    memset(ring_anon_objects, 0, sizeof(ring_anon_objects));
+    ring_objects = ring_anon_objects;
+    if (ring_setup(slot_size) != 0) {
         fprintf(stderr, "Error allocating memory for ring buffer\n");
         exit(1);
     }
-    ring_pos = 0;
-    pthread_mutex_init(&ring_mutex, NULL);
+    ring_buffer = ring_pool.base;
 }
 
-void cache_to_ring(uint64_t off, const void *data) {
-    if (!data || !ring_buffer) {
-        fprintf(stderr, "Invalid data or ring buffer not initialized for offset %lu\n", off);
+// File-backed ring: the slots live in a shared mapping of path, so the blocks
+// kept at a clean shutdown are there again on the next open. A file of
+// another geometry, or one that was not closed with ring_cache_destroy(), is
+// reset. Returns -1 if the file cannot be used; the ring is then left
+// uninitialized.
+int ring_cache_open(const char *path, size_t slot_size) {
+    ring_slots = slot_size ? (uint32_t)(RING_SIZE / slot_size) : 0;
+    if (ring_slots == 0) return -1;
+    size_t meta_len = (size_t)ring_slots * sizeof(ring_slot_t);
+    size_t data_offset = (sizeof(ring_file_header_t) + meta_len + RING_FILE_ALIGN - 1) & ~(RING_FILE_ALIGN - 1);
+    size_t len = (data_offset + (size_t)ring_slots * slot_size + RING_FILE_ALIGN - 1) & ~(RING_FILE_ALIGN - 1);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || ((size_t)st.st_size != len && ftruncate(fd, (off_t)len) != 0)) {
+        fprintf(stderr, "Ring cache: cannot use %s (errno: %d)\n", path, errno);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Ring cache: failed to map %s (errno: %d)\n", path, errno);
+        close(fd);
+        return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    // Takes effect where the file system can back the mapping with huge pages
+    madvise((char *)mem + data_offset, len - data_offset, MADV_HUGEPAGE);
+#endif
+    ring_file_header_t *hdr = mem;
+    ring_slots_meta = (ring_slot_t *)(hdr + 1);
+    if (memcmp(hdr->magic, RING_FILE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != RING_FILE_VERSION ||
+        !hdr->clean || hdr->slot_size != slot_size || hdr->nslots != ring_slots || hdr->data_offset != data_offset) {
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, RING_FILE_MAGIC, sizeof(hdr->magic));
+        hdr->version = RING_FILE_VERSION;
+        hdr->slot_size = slot_size;
+        hdr->nslots = ring_slots;
+        hdr->data_offset = data_offset;
+        for (uint32_t i = 0; i < ring_slots; i++) {
+            ring_slots_meta[i].seq = 0;
+            ring_slots_meta[i].key = RING_EMPTY;
+        }
+    }
+    // Until ring_cache_destroy() sets it again the contents are not trusted
+    hdr->clean = 0;
+    msync(hdr, sizeof(*hdr), MS_SYNC);
+    ring_file = hdr;
+    ring_file_len = len;
+    ring_fd = fd;
+    ring_objects = hdr->objects;
+    if (ring_setup(slot_size) != 0) {
+        fprintf(stderr, "Error allocating memory for ring buffer\n");
+        exit(1);
+    }
+    ring_buffer = (char *)mem + data_offset;
+    ring_cache_stats_t rs;
+    ring_cache_get_stats(&rs);
+    if (rs.blocks) fprintf(stderr, "Ring cache: %zu blocks restored from %s\n", rs.blocks, path);
+    return 0;
+}
+
+// Slot size the ring was set up with, 0 while it is not initialized
+size_t ring_slot_size(void) {
+    return ring_buffer ? ring_slot : 0;
+}
+
+// Copy a block in, replacing an older copy of the same key. The slot is
+// reserved with a fetch-add on the cursor of the calling CPU's segment and
+// owned through its sequence number while the block is copied, so writers on
+// different CPUs share no lock or cache line until the index update.
+void cache_to_ring(uint64_t key, const void *data) {
+    if (!data || !ring_buffer || key == RING_EMPTY) {
+        fprintf(stderr, "Invalid data or ring buffer not initialized for key %lu\n", key);
         return;
     }
-    pthread_mutex_lock(&ring_mutex);
-    // Copy block data into the ring buffer
-    if (ring_pos + BLOCK_SIZE <= RING_SIZE) {
-        memcpy((char*)ring_buffer + ring_pos, data, BLOCK_SIZE);
-        ring_pos = (ring_pos + BLOCK_SIZE) % RING_SIZE;
+    ring_segment_t *seg = segment_for_thread();
+    uint32_t slot = 0;
+    int claimed = 0;
+    // Slots still owned by a slow writer or a reader are skipped
+    for (uint32_t tries = 0; tries < seg->nslots && !claimed; tries++) {
+        uint64_t pos = __atomic_fetch_add(&seg->cursor, 1, __ATOMIC_RELAXED);
+        slot = seg->first + (uint32_t)(pos % seg->nslots);
+        uint64_t seq = __atomic_load_n(&ring_slots_meta[slot].seq, __ATOMIC_ACQUIRE);
+        claimed = !(seq & 1) && slot_claim(slot, seq);
+    }
+    if (!claimed) return;
+    uint64_t old = ring_slots_meta[slot].key;
+    if (old != RING_EMPTY) {
+        // The oldest block of the segment is overwritten
+        index_erase(old, slot);
+        __atomic_add_fetch(&seg->overwritten, 1, __ATOMIC_RELAXED);
     } else {
-        fprintf(stderr, "Ring buffer overflow prevented for offset %lu\n", off);
+        __atomic_add_fetch(&seg->held, 1, __ATOMIC_RELAXED);
+    }
+    memcpy(ring_buffer + (size_t)slot * ring_slot, data, ring_slot);
+    __atomic_store_n(&ring_slots_meta[slot].key, key, __ATOMIC_RELAXED);
+    slot_publish(slot);
+    __atomic_add_fetch(&seg->stored, 1, __ATOMIC_RELAXED);
+
+    uint32_t h = ring_hash(key);
+    ring_stripe_t *st = stripe_for(h);
+    pthread_mutex_lock(&st->mutex);
+    uint32_t prev = cache_index_find(&st->index, key, h);
+    if (prev != CACHE_INDEX_NONE) cache_index_erase(&st->index, key, h);
+    int rc = cache_index_insert(&st->index, key, h, slot);
+    pthread_mutex_unlock(&st->mutex);
+    // An older copy must not be found through a stale index probe
+    if (prev != CACHE_INDEX_NONE && prev != slot && prev < ring_slots) {
+        uint64_t seq = __atomic_load_n(&ring_slots_meta[prev].seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) && __atomic_load_n(&ring_slots_meta[prev].key, __ATOMIC_RELAXED) == key && slot_claim(prev, seq)) {
+            if (ring_slots_meta[prev].key == key) {
+                __atomic_store_n(&ring_slots_meta[prev].key, RING_EMPTY, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&segment_of_slot(prev)->held, 1, __ATOMIC_RELAXED);
+            }
+            slot_publish(prev);
+        }
+    }
+    // Without an index entry the block cannot be found, so give the slot back
+    if (rc != 0) {
+        uint64_t seq = __atomic_load_n(&ring_slots_meta[slot].seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) && slot_claim(slot, seq)) {
+            if (ring_slots_meta[slot].key == key) {
+                __atomic_store_n(&ring_slots_meta[slot].key, RING_EMPTY, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&seg->held, 1, __ATOMIC_RELAXED);
+            }
+            slot_publish(slot);
+        }
+    }
+}
+
+// Copy a block out and free its slot. Returns 1 on a hit, 0 on a miss. The
+// index is probed without a lock; the slot's key and sequence number reject
+// a probe that raced with a writer, and claiming the slot keeps it from being
+// overwritten during the copy.
+int ring_lookup(uint64_t key, void *out) {
+    if (!ring_buffer) return 0;
+    ring_segment_t *seg = segment_for_thread();
+    uint32_t h = ring_hash(key);
+    uint32_t slot = cache_index_find(&stripe_for(h)->index, key, h);
+    if (slot < ring_slots) {
+        uint64_t seq = __atomic_load_n(&ring_slots_meta[slot].seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) && __atomic_load_n(&ring_slots_meta[slot].key, __ATOMIC_RELAXED) == key && slot_claim(slot, seq)) {
+            if (ring_slots_meta[slot].key == key) {
+                memcpy(out, ring_buffer + (size_t)slot * ring_slot, ring_slot);
+                slot_drop(slot);
+                __atomic_add_fetch(&seg->hits, 1, __ATOMIC_RELAXED);
+                return 1;
+            }
+            slot_publish(slot);
+        }
+    }
+    __atomic_add_fetch(&seg->misses, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Drop every block with a key in [lo, hi)
+void ring_invalidate(uint64_t lo, uint64_t hi) {
+    if (!ring_buffer) return;
+    for (uint32_t i = 0; i < ring_slots; i++) {
+        uint64_t seq = __atomic_load_n(&ring_slots_meta[i].seq, __ATOMIC_ACQUIRE);
+        uint64_t key = __atomic_load_n(&ring_slots_meta[i].key, __ATOMIC_RELAXED);
+        if ((seq & 1) || key == RING_EMPTY || key < lo || key >= hi || !slot_claim(i, seq)) continue;
+        if (ring_slots_meta[i].key == key) {
+            slot_drop(i);
+            __atomic_add_fetch(&ring_invalidated, 1, __ATOMIC_RELAXED);
+        } else {
+            slot_publish(i);
+        }
+    }
+}
+
+void ring_cache_get_stats(ring_cache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    int64_t held = 0;
+    for (int i = 0; ring_buffer && i < ring_nsegments; i++) {
+        ring_segment_t *seg = &ring_segments[i];
+        out->hits += __atomic_load_n(&seg->hits, __ATOMIC_RELAXED);
+        out->misses += __atomic_load_n(&seg->misses, __ATOMIC_RELAXED);
+        out->stored += __atomic_load_n(&seg->stored, __ATOMIC_RELAXED);
+        out->overwritten += __atomic_load_n(&seg->overwritten, __ATOMIC_RELAXED);
+        held += __atomic_load_n(&seg->held, __ATOMIC_RELAXED);
+    }
+    out->invalidated = __atomic_load_n(&ring_invalidated, __ATOMIC_RELAXED);
+    out->blocks = held > 0 ? (size_t)held : 0;
+}
+
+static int object_stat(int fd, ring_object_t *o) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    o->dev = st.st_dev;
+    o->ino = st.st_ino;
+    o->size = st.st_size;
+    o->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+// A backing file is taken into use as object obj, whose blocks have keys in
+// [lo, hi). Blocks left from an earlier use are kept only if that use ended
+// with ring_object_close() on the same file and the file has not changed since.
+void ring_object_open(uint32_t obj, int fd, uint64_t lo, uint64_t hi) {
+    if (!ring_buffer) return;
+    ring_object_t now;
+    int known = object_stat(fd, &now) == 0;
+    if (obj < RING_MAX_OBJECTS) {
+        ring_object_t *o = &ring_objects[obj];
+        if (known && o->closed && o->dev == now.dev && o->ino == now.ino && o->size == now.size &&
+            o->mtime_ns == now.mtime_ns) {
+            o->closed = 0;
+            return;
+        }
+        memset(o, 0, sizeof(*o));
     }
-    pthread_mutex_unlock(&ring_mutex);
+    ring_invalidate(lo, hi);
+}
+
+// The object's file is released with everything written back: record its
+// state, so its blocks are trusted again by ring_object_open() if the file
+// comes back unchanged.
+void ring_object_close(uint32_t obj, int fd) {
+    if (!ring_buffer || obj >= RING_MAX_OBJECTS) return;
+    ring_object_t *o = &ring_objects[obj];
+    if (object_stat(fd, o) == 0) o->closed = 1;
 }
 
+// Callers must have stopped using the ring
 void ring_cache_destroy(void) {
-    pthread_mutex_destroy(&ring_mutex);
-    free(ring_buffer);
+    if (!ring_buffer) return;
+    ring_cache_stats_t st;
+    ring_cache_get_stats(&st);
+    if (st.stored) {
+        fprintf(stderr, "Ring cache: %lu blocks stored, %lu hits, %lu misses, %lu overwritten\n",
+                st.stored, st.hits, st.misses, st.overwritten);
+    }
+    for (int i = 0; i < RING_INDEX_STRIPES; i++) {
+        cache_index_destroy(&ring_stripes[i].index);
+        pthread_mutex_destroy(&ring_stripes[i].mutex);
+    }
+    if (ring_file) {
+        // The slots reach the file before it is marked clean
+        msync(ring_file, ring_file_len, MS_SYNC);
+        ring_file->clean = 1;
+        msync(ring_file, sizeof(*ring_file), MS_SYNC);
+        munmap(ring_file, ring_file_len);
+        close(ring_fd);
+        ring_file = NULL;
+        ring_fd = -1;
+    } else {
+        page_pool_destroy(&ring_pool);
+        free(ring_slots_meta);
+    }
+    free(ring_segments);
     ring_buffer = NULL;
-    ring_pos = 0;
+    ring_slots_meta = NULL;
+    ring_objects = NULL;
+    ring_segments = NULL;
+    ring_slots = 0;
+    ring_nsegments = 0;
 }
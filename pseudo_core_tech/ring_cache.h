@@ -2,13 +2,51 @@
 #define RING_CACHE_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <pthread.h>
 #include "config.h"
 
 #define RING_SIZE (CACHE_MB * 1024 * 1024)
+#define RING_MAX_OBJECTS 256 // backing files whose blocks can outlive a restart
 
-void ring_cache_init(void);
-void cache_to_ring(uint64_t off, const void *data);
+// State of a backing file when its blocks were last known to match it
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t closed;   // 1 after ring_object_close(), 0 while the file is in use
+    uint32_t reserved;
+} ring_object_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stored;      // blocks copied in
+    uint64_t overwritten; // blocks lost to a segment wrapping around
+    uint64_t invalidated; // blocks dropped by ring_invalidate()
+    size_t blocks;        // blocks held
+} ring_cache_stats_t;
+
+// FIFO victim cache: RING_SIZE bytes of fixed-size slots split into one
+// segment per CPU. Each segment is filled in order and overwrites its oldest
+// slot when its write cursor wraps; writers reserve slots with an atomic
+// fetch-add and mark them busy through a per-slot sequence number, so inserts
+// from different CPUs take no common lock. Blocks are found by key through a
+// striped index; a hit hands the block back and frees its slot.
+// ring_cache_init() keeps the slots in anonymous memory, on huge pages when
+// possible; ring_cache_open() maps them from a file so that they survive a
+// restart. Blocks of a backing file are kept across its close and reopen only
+// while the file is unchanged.
+void ring_cache_init(size_t slot_size);
+int ring_cache_open(const char *path, size_t slot_size);
+size_t ring_slot_size(void);
+void cache_to_ring(uint64_t key, const void *data);
+int ring_lookup(uint64_t key, void *out);
+void ring_invalidate(uint64_t lo, uint64_t hi);
+void ring_object_open(uint32_t obj, int fd, uint64_t lo, uint64_t hi);
+void ring_object_close(uint32_t obj, int fd);
+void ring_cache_get_stats(ring_cache_stats_t *out);
 void ring_cache_destroy(void);
 
 #endif // RING_CACHE_H